@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// Counts global heap allocations, so tests and benchmarks can check that hot paths stay off the
+// heap. This header replaces the global operator new and delete, so a program includes it from
+// exactly one source file.
+class AllocationCounter {
+public:
+    // Allocations made by every thread, e.g. for work spread over worker threads
+    static uint64_t total() { return totalCount().load(std::memory_order_relaxed); }
+
+    // Allocations made by the calling thread, leaving out background threads such as the logger's
+    static uint64_t thisThread() { return threadCount(); }
+
+    static void record() {
+        totalCount().fetch_add(1, std::memory_order_relaxed);
+        threadCount()++;
+    }
+
+private:
+    static std::atomic<uint64_t>& totalCount() {
+        static std::atomic<uint64_t> count{0};
+        return count;
+    }
+
+    static uint64_t& threadCount() {
+        thread_local uint64_t count = 0;
+        return count;
+    }
+};
+
+void* operator new(size_t size) {
+    AllocationCounter::record();
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
@@ -1,15 +1,18 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
+#include <random>
 #include <vector>
 #include <string>
+#include "AllocationCounter.h"
 #include "Block.h"
 
 TEST(Block, CalculateHash) {
     // Arrange
     std::vector<Transaction> transactions = {Transaction("Alice", "Bob", 10.0, 0.1)};
+    transactions[0].setTimestamp(1682247600);
     std::string previousHash = "0000000000000000000000000000000000000000000000000000000000000000";
-    Block block(transactions, previousHash);
-    std::string expectedHash = "836ed8a2e92537c5b5f5b5d54e14d5c5e75b6aa3a6a128e6a1c6d193563aaae2";
+    Block block(transactions, previousHash, 1682247600);
+    std::string expectedHash = "5930c93074014bedbbac3710062303e8da6758cfa1bde82a1614914758bb30d2";
 
     // Act
     std::string actualHash = block.calculateHash();
@@ -71,3 +74,239 @@ TEST(Block, MineBlock_Failed) {
     ASSERT_EQ(actualHash.substr(0, difficulty), std::string(difficulty, '0'));
     ASSERT_EQ(actualReward, 50.0);
 }
+
+TEST(Block, MineBlock_ThreadCountDoesNotChangeResult) {
+    // Arrange
+    std::vector<Transaction> transactions = {Transaction("Alice", "Bob", 10.0, 0.1)};
+    std::string previousHash = "0000000000000000000000000000000000000000000000000000000000000000";
+    Block singleThreaded(transactions, previousHash);
+    Block multiThreaded(transactions, previousHash);
+    int difficulty = 2;
+    Wallet minerWallet("Miner");
+
+    // Act
+    singleThreaded.mineBlock(difficulty, minerWallet, 1);
+    multiThreaded.mineBlock(difficulty, minerWallet, 4);
+
+    // Assert
+    ASSERT_EQ(multiThreaded.getNonce(), singleThreaded.getNonce());
+    ASSERT_EQ(multiThreaded.getHash(), singleThreaded.getHash());
+    ASSERT_EQ(multiThreaded.getReward(), singleThreaded.getReward());
+    ASSERT_EQ(multiThreaded.getTransactions().size(), singleThreaded.getTransactions().size());
+    ASSERT_EQ(singleThreaded.getMiningStats().size(), 1);
+    ASSERT_EQ(multiThreaded.getMiningStats().size(), 4);
+    ASSERT_EQ(multiThreaded.getHash().substr(0, difficulty), std::string(difficulty, '0'));
+}
+
+TEST(Block, HeaderHasherMatchesFullHash) {
+    // Arrange
+    std::vector<Transaction> transactions = {Transaction("Alice", "Bob", 10.0, 0.1)};
+    Block block(transactions, "0", 1682247600);
+    HeaderHasher hasher(block.getHeader());
+
+    // Act / Assert
+    for (uint64_t nonce = 0; nonce < 100; ++nonce) {
+        BlockHeader header = block.getHeader();
+        header.nonce = nonce;
+        auto bytes = header.serialize();
+        ASSERT_EQ(hasher.hash(nonce), sha256Digest(std::string(bytes.begin(), bytes.end())));
+        ASSERT_EQ(block.calculateDigest(nonce), hasher.hash(nonce));
+    }
+}
+
+TEST(Block, TargetFromDifficulty) {
+    Hash256 target = targetFromDifficulty(3);
+    ASSERT_EQ(toHex(target), "000" + std::string(61, 'f'));
+    ASSERT_TRUE(meetsTarget(hashFromHex("000a" + std::string(60, '0')), target));
+    ASSERT_FALSE(meetsTarget(hashFromHex("0010" + std::string(60, '0')), target));
+}
+
+TEST(Block, MultiBufferSha256MatchesOpenSSL) {
+    // Arrange
+    std::mt19937_64 rng(2023);
+    std::vector<BlockHeader> headers(37);
+    for (auto& header : headers) {
+        for (auto& byte : header.previousHash) byte = static_cast<unsigned char>(rng());
+        for (auto& byte : header.merkleRoot) byte = static_cast<unsigned char>(rng());
+        header.timestamp = static_cast<int64_t>(rng());
+        header.reward = static_cast<double>(rng() % 1000);
+        header.nonce = rng();
+    }
+    std::vector<uint64_t> nonces(37);
+    for (auto& nonce : nonces) nonce = rng();
+    Sha256MultiBuffer::Kernel originalKernel = Sha256MultiBuffer::getKernel();
+
+    for (auto kernel : {Sha256MultiBuffer::Kernel::Scalar, Sha256MultiBuffer::Kernel::Avx2, Sha256MultiBuffer::Kernel::Avx512}) {
+        if (!Sha256MultiBuffer::isSupported(kernel)) {
+            continue;
+        }
+        Sha256MultiBuffer::setKernel(kernel);
+
+        // Act
+        std::vector<Hash256> headerDigests = HeaderHasher::hashHeaders(headers);
+        HeaderHasher hasher(headers[0]);
+        std::vector<Hash256> nonceDigests(nonces.size());
+        hasher.hashBatch(nonces.data(), nonces.size(), nonceDigests.data());
+
+        // Assert
+        for (size_t i = 0; i < headers.size(); ++i) {
+            auto bytes = headers[i].serialize();
+            ASSERT_EQ(headerDigests[i], sha256Digest(std::string(bytes.begin(), bytes.end())));
+            ASSERT_EQ(nonceDigests[i], hasher.hash(nonces[i]));
+        }
+    }
+    Sha256MultiBuffer::setKernel(originalKernel);
+}
+
+TEST(Block, MerkleRootIncrementalUpdates) {
+    // Arrange
+    std::vector<Transaction> transactions = {
+        Transaction("Alice", "Bob", 10.0, 0.1),
+        Transaction("Bob", "Charlie", 5.0, 0.1),
+        Transaction("Charlie", "Dave", 2.5, 0.1)
+    };
+    Block assembled({}, "0", 1682247600);
+
+    // Act
+    for (const auto& transaction : transactions) {
+        assembled.addTransaction(transaction);
+    }
+    Transaction replacement("Alice", "Eve", 7.0, 0.2);
+    assembled.replaceTransaction(1, replacement);
+    transactions[1] = replacement;
+    Block rebuilt(transactions, "0", 1682247600);
+
+    // Assert
+    ASSERT_EQ(assembled.getMerkleRoot(), rebuilt.getMerkleRoot());
+    ASSERT_EQ(assembled.calculateHash(), rebuilt.calculateHash());
+}
+
+TEST(Block, MerkleInclusionProof) {
+    // Arrange
+    std::vector<Transaction> transactions;
+    for (int i = 0; i < 7; ++i) {
+        transactions.emplace_back("Alice", "Bob", 1.0 + i, 0.1);
+    }
+    Block block(transactions, "0");
+
+    // Act / Assert
+    for (size_t i = 0; i < transactions.size(); ++i) {
+        MerkleProof proof = block.getMerkleProof(i);
+        ASSERT_TRUE(MerkleTree::verifyProof(transactions[i].calculateHash(), proof, block.getMerkleRoot()));
+    }
+    MerkleProof proof = block.getMerkleProof(2);
+    ASSERT_FALSE(MerkleTree::verifyProof(transactions[3].calculateHash(), proof, block.getMerkleRoot()));
+}
+
+TEST(Block, MerkleRootIsNotMalleable) {
+    // Arrange: the same transactions, once with the last one repeated
+    Transaction a("Alice", "Bob", 1.0, 0.1);
+    Transaction b("Alice", "Bob", 2.0, 0.1);
+    Transaction c("Alice", "Bob", 3.0, 0.1);
+    Block odd({a, b, c}, "0", 1682208000);
+    Block repeated({a, b, c, c}, "0", 1682208000);
+
+    // Act / Assert: an odd last node isn't paired with itself, so repeating it changes the root
+    ASSERT_NE(odd.getMerkleRoot(), repeated.getMerkleRoot());
+
+    // An inner node doesn't verify as a leaf, even with the rest of the path
+    MerkleTree tree({a.calculateHash(), b.calculateHash(), c.calculateHash(), Transaction("Alice", "Bob", 4.0, 0.1).calculateHash()});
+    MerkleProof proof = tree.getProof(0);
+    MerkleProof innerProof;
+    innerProof.index = 0;
+    innerProof.leafCount = 2;
+    innerProof.siblings = {proof.siblings[1]};
+    MerkleTree pairs({a.calculateHash(), b.calculateHash()});
+    ASSERT_FALSE(MerkleTree::verifyProof(pairs.getRoot(), innerProof, tree.getRoot()));
+    ASSERT_TRUE(MerkleTree::verifyProof(a.calculateHash(), proof, tree.getRoot()));
+}
+
+TEST(Block, MineBlock_AllocationsDoNotDependOnHashCount) {
+    // Arrange
+    Wallet minerWallet("Miner");
+    auto allocationsToMine = [&](int difficulty) {
+        std::vector<Transaction> transactions = {Transaction("Alice", "Bob", 10.0, 0.1)};
+        Block block(transactions, "0", 1682247600);
+        uint64_t before = AllocationCounter::thisThread();
+        block.mineBlock(difficulty, minerWallet, 1);
+        return AllocationCounter::thisThread() - before;
+    };
+    allocationsToMine(1);
+
+    // Act
+    uint64_t easy = allocationsToMine(1);
+    uint64_t hard = allocationsToMine(4);
+
+    // Assert: searching ~65k nonces allocates no more than searching a handful
+    ASSERT_EQ(hard, easy);
+}
+
+TEST(Block, MineBlock_WarmedUpSearchDoesNotAllocate) {
+    // Arrange: a search that can't succeed, run once so the arena and the mining stats are sized
+    Wallet minerWallet("Miner");
+    Block block({Transaction("Alice", "Bob", 10.0, 0.1)}, "0", 1682247600);
+    Hash256 root = block.getMerkleRoot();
+    Hash256 impossible{};
+    ASSERT_FALSE(block.mineBlock(impossible, minerWallet, 1, 0.01));
+
+    // Act
+    uint64_t before = AllocationCounter::thisThread();
+    block.mineBlock(impossible, minerWallet, 1, 0.01);
+    uint64_t allocations = AllocationCounter::thisThread() - before;
+
+    // Assert: nothing allocated, and the failed searches left the block as it was
+    ASSERT_EQ(allocations, 0u);
+    ASSERT_EQ(block.getTransactions().size(), 1u);
+    ASSERT_EQ(block.getMerkleRoot(), root);
+
+    // Only failed searches are covered: a successful one allocates the reward's slot, the Merkle
+    // tree and the hash the block keeps, which MineBlock_AllocationsDoNotDependOnHashCount bounds
+    block.mineBlock(1, minerWallet, 1);
+    ASSERT_EQ(block.getTransactions().size(), 2u);
+    ASSERT_EQ(block.getHash(), block.calculateHash());
+    ASSERT_EQ(block.getHash().substr(0, 1), "0");
+}
+
+TEST(Block, HashHeaders_SteadyStateDoesNotAllocate) {
+    // Arrange
+    std::vector<BlockHeader> headers(1000);
+    for (size_t i = 0; i < headers.size(); ++i) {
+        headers[i].nonce = i;
+    }
+    std::vector<Hash256> digests(headers.size());
+    HeaderHasher::hashHeaders(headers.data(), headers.size(), digests.data());
+
+    // Act
+    uint64_t before = AllocationCounter::thisThread();
+    HeaderHasher::hashHeaders(headers.data(), headers.size(), digests.data());
+    uint64_t allocations = AllocationCounter::thisThread() - before;
+
+    // Assert
+    ASSERT_EQ(allocations, 0u);
+    ASSERT_EQ(digests, HeaderHasher::hashHeaders(headers));
+    ASSERT_EQ(digests[7], HeaderHasher(headers[7]).hash(7));
+}
+
+TEST(Block, BlockArenaReusesChunksAcrossScopes) {
+    // Arrange
+    BlockArena arena(4096);
+    {
+        BlockArena::Scope scope(arena);
+        std::pmr::vector<Hash256> scratch(1000, &arena);
+        std::pmr::vector<uint64_t> more(100, &arena);
+    }
+    size_t capacity = arena.getCapacity();
+
+    // Act
+    uint64_t before = AllocationCounter::thisThread();
+    for (int i = 0; i < 10; ++i) {
+        BlockArena::Scope scope(arena);
+        std::pmr::vector<Hash256> scratch(1000, &arena);
+        std::pmr::vector<uint64_t> more(100, &arena);
+    }
+    uint64_t allocations = AllocationCounter::thisThread() - before;
+
+    // Assert
+    ASSERT_EQ(allocations, 0u);
+    ASSERT_EQ(arena.getCapacity(), capacity);
+}
@@ -0,0 +1,528 @@
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "AllocationCounter.h"
+#include "Block.h"
+#include "Blockchain.h"
+
+// Allocations by every thread, since some benchmarks spread their work over workers
+static void reportAllocations(benchmark::State& state, uint64_t before) {
+    state.counters["allocs_per_iter"] = benchmark::Counter(static_cast<double>(AllocationCounter::total() - before), benchmark::Counter::kAvgIterations);
+}
+
+// Generates transactions and chains from a fixed seed, so every run and every release measures
+// exactly the same work
+class SyntheticWorkload {
+public:
+    static constexpr uint64_t defaultSeed = 20230423;
+
+    explicit SyntheticWorkload(uint64_t seed = defaultSeed) : m_random(seed) {}
+
+    // A payment between two of a fixed set of accounts, whose sender has historyLength earlier spends
+    Transaction transaction(size_t historyLength) {
+        std::uniform_int_distribution<int> account(0, accountCount - 1);
+        std::uniform_real_distribution<double> amount(1.0, 100.0);
+        std::vector<double> senderSent(historyLength);
+        for (auto& sent : senderSent) {
+            sent = amount(m_random);
+        }
+        double value = amount(m_random);
+        return Transaction("Account" + std::to_string(account(m_random)), "Account" + std::to_string(account(m_random)), value, value / 1000.0, senderSent);
+    }
+
+    std::vector<Transaction> transactions(size_t count, size_t historyLength) {
+        std::vector<Transaction> result;
+        result.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            result.push_back(transaction(historyLength));
+        }
+        return result;
+    }
+
+    // A chain of length blocks, genesis included, on an easy proof of work limit so it builds in
+    // seconds. Timestamps are one block interval apart, which keeps the target at the limit.
+    std::unique_ptr<Blockchain> chain(size_t length, size_t transactionsPerBlock) {
+        auto chain = std::make_unique<Blockchain>(easyPowLimit);
+        chain->setMiningThreads(1);
+        int64_t timestamp = chain->getLastBlock().getTimestamp();
+        for (size_t height = 1; height < length; ++height) {
+            std::vector<Transaction> payments;
+            std::map<std::string, double> pendingDebits;
+            for (size_t i = 0; i < transactionsPerBlock; ++i) {
+                payments.push_back(payment(*chain, pendingDebits));
+            }
+            timestamp += chain->getTargetBlockSeconds();
+            chain->addBlock(Block(payments, chain->getLastBlockHash(), timestamp));
+        }
+        return chain;
+    }
+
+private:
+    // About one hash in two meets it
+    static constexpr uint32_t easyPowLimit = 0x207fffff;
+    static constexpr int accountCount = 1000;
+    std::mt19937_64 m_random;
+
+    // A payment that passes the chain's checks: each account always sends the same amount, with a
+    // matching history, and only while it holds enough on chain beyond its pendingDebits in the
+    // block being built. Alice pays from the genesis allocation for accounts that don't.
+    Transaction payment(const Blockchain& chain, std::map<std::string, double>& pendingDebits) {
+        std::uniform_int_distribution<int> account(0, accountCount - 1);
+        auto covers = [&](const std::string& name, double amount) { return chain.getBalance(name) - pendingDebits[name] >= amount + amount / 1000.0; };
+        int sender;
+        std::string senderName;
+        double amount;
+        do {
+            sender = account(m_random);
+            senderName = "Account" + std::to_string(sender);
+            amount = 1.0 + sender % 100;
+            if (!covers(senderName, amount)) {
+                senderName = "Alice";
+                amount = 100.0;
+            }
+        } while (!covers(senderName, amount));
+        int recipient = account(m_random);
+        while (recipient == sender) {
+            recipient = account(m_random);
+        }
+        pendingDebits[senderName] += amount + amount / 1000.0;
+        return Transaction(senderName, "Account" + std::to_string(recipient), amount, amount / 1000.0, std::vector<double>(3, amount));
+    }
+};
+
+static std::vector<Transaction> makeTransactions(int count) {
+    std::vector<Transaction> transactions;
+    for (int i = 0; i < count; ++i) {
+        transactions.emplace_back("Alice", "Bob", 10.0 + i, 0.1, std::vector<double>{1.0, 2.0, 3.0});
+    }
+    return transactions;
+}
+
+// The pre-midstate hashing path: stringstream preimage over every transaction and hex encoding per nonce
+static std::string legacyHash(const std::string& previousHash, uint64_t nonce, double reward, const std::vector<Transaction>& transactions) {
+    std::stringstream ss;
+    ss << previousHash << nonce << reward;
+    for (const auto& transaction : transactions) {
+        ss << transaction.getSender() << transaction.getRecipient() << transaction.getAmount();
+        for (const auto& sent : transaction.getSenderSent()) {
+            ss << sent;
+        }
+    }
+    Hash256 digest = sha256Digest(ss.str());
+    std::stringstream hex;
+    for (unsigned char byte : digest) {
+        hex << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(byte);
+    }
+    return hex.str();
+}
+
+static void BM_LegacyNonceHash(benchmark::State& state) {
+    std::vector<Transaction> transactions = makeTransactions(state.range(0));
+    uint64_t nonce = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(legacyHash("0", nonce++, 50.0, transactions));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LegacyNonceHash)->Arg(1)->Arg(10)->Arg(100);
+
+static void BM_MidstateNonceHash(benchmark::State& state) {
+    Block block(makeTransactions(state.range(0)), "0", 1682247600);
+    HeaderHasher hasher(block.getHeader());
+    Hash256 target = targetFromDifficulty(4);
+    uint64_t nonce = 0;
+    for (auto _ : state) {
+        Hash256 digest = hasher.hash(nonce++);
+        benchmark::DoNotOptimize(meetsTarget(digest, target));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MidstateNonceHash)->Arg(1)->Arg(10)->Arg(100);
+
+static void BM_MultiBufferNonceHash(benchmark::State& state) {
+    Sha256MultiBuffer::Kernel originalKernel = Sha256MultiBuffer::getKernel();
+    Sha256MultiBuffer::Kernel kernel = static_cast<Sha256MultiBuffer::Kernel>(state.range(0));
+    if (!Sha256MultiBuffer::isSupported(kernel)) {
+        state.SkipWithError("kernel not supported on this CPU");
+        return;
+    }
+    Sha256MultiBuffer::setKernel(kernel);
+    Block block(makeTransactions(10), "0", 1682247600);
+    HeaderHasher hasher(block.getHeader());
+    uint64_t nonces[Sha256MultiBuffer::maxLanes];
+    Hash256 digests[Sha256MultiBuffer::maxLanes];
+    uint64_t next = 0;
+    for (auto _ : state) {
+        for (auto& nonce : nonces) {
+            nonce = next++;
+        }
+        hasher.hashBatch(nonces, Sha256MultiBuffer::maxLanes, digests);
+        benchmark::DoNotOptimize(digests);
+    }
+    state.SetItemsProcessed(state.iterations() * Sha256MultiBuffer::maxLanes);
+    Sha256MultiBuffer::setKernel(originalKernel);
+}
+BENCHMARK(BM_MultiBufferNonceHash)->Arg(0)->Arg(1)->Arg(2);
+
+// The Merkle root is maintained as transactions are added, so hashing a block costs the same at every size
+static void BM_CalculateBlockHash(benchmark::State& state) {
+    Block block(SyntheticWorkload().transactions(state.range(0), 3), "0", 1682247600);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(block.calculateHash());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CalculateBlockHash)->Arg(1)->Arg(10)->Arg(100)->Arg(1000);
+
+// Mining a block at a fixed difficulty of four leading zero digits; hashes_per_second is the rate
+// over all mining threads
+static void BM_MineBlock(benchmark::State& state) {
+    std::vector<Transaction> transactions = SyntheticWorkload().transactions(3, 3);
+    Wallet minerWallet("Miner");
+    uint64_t hashes = 0;
+    int64_t timestamp = 1682247600;
+    for (auto _ : state) {
+        // A new timestamp each time gives a new header, so the nonce search starts over
+        Block block(transactions, "0", timestamp++);
+        block.mineBlock(4, minerWallet, state.range(0));
+        for (const auto& threadStats : block.getMiningStats()) {
+            hashes += threadStats.hashes;
+        }
+    }
+    state.counters["hashes_per_second"] = benchmark::Counter(static_cast<double>(hashes), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_MineBlock)->Arg(1)->Arg(4)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Full validation of a synthetic chain. Chains are built once per length and kept for later runs.
+static void BM_ValidateChain(benchmark::State& state) {
+    static std::map<int64_t, std::unique_ptr<Blockchain>> chains;
+    std::unique_ptr<Blockchain>& chain = chains[state.range(0)];
+    if (!chain) {
+        chain = SyntheticWorkload().chain(state.range(0), 2);
+    }
+    if (chain->getLength() != static_cast<size_t>(state.range(0)) || !chain->isValid()) {
+        state.SkipWithError("synthetic chain is not valid");
+        return;
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(chain->isValid());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ValidateChain)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Headers-first sync of a fresh node from range(1) local nodes that all serve the same synthetic
+// chain of range(0) blocks. Only the sync itself is timed, not starting and stopping the nodes.
+static void BM_HeadersFirstSync(benchmark::State& state) {
+    static std::map<int64_t, std::vector<std::unique_ptr<Blockchain>>> servedChains;
+    std::vector<std::unique_ptr<Blockchain>>& chains = servedChains[state.range(0)];
+    if (chains.empty()) {
+        chains.push_back(SyntheticWorkload().chain(state.range(0), 2));
+    }
+    const Blockchain& source = *chains.front();
+    if (chains.size() < static_cast<size_t>(state.range(1))) {
+        std::vector<std::string> records;
+        for (size_t height = 1; height < source.getLength(); ++height) {
+            records.push_back(BlockView::encode(source.getBlock(height)));
+        }
+        while (chains.size() < static_cast<size_t>(state.range(1))) {
+            chains.push_back(std::make_unique<Blockchain>(source.getPowLimit()));
+            chains.back()->importBlocks(records);
+        }
+    }
+    std::vector<std::unique_ptr<Node>> peers;
+    for (int64_t i = 0; i < state.range(1); ++i) {
+        peers.push_back(std::make_unique<Node>(*chains[i]));
+    }
+
+    uint64_t blocks = 0;
+    double seconds = 0.0;
+    for (auto _ : state) {
+        Blockchain fresh(source.getPowLimit());
+        Node node(fresh);
+        for (const auto& peer : peers) {
+            node.connect("127.0.0.1", peer->getPort());
+        }
+        Node::SyncResult result = node.sync();
+        if (fresh.getLastBlockHash() != source.getLastBlockHash()) {
+            state.SkipWithError("sync did not reach the peers' tip");
+            return;
+        }
+        state.SetIterationTime(result.seconds);
+        blocks += result.blocks;
+        seconds += result.seconds;
+    }
+    state.counters["blocks_per_second"] = seconds > 0.0 ? blocks / seconds : 0.0;
+}
+BENCHMARK(BM_HeadersFirstSync)->Args({2000, 1})->Args({2000, 3})->Unit(benchmark::kMillisecond)->UseManualTime();
+
+// Starting a node from a state snapshot holding range(0) accounts: checking the checksum, decoding
+// the balances and indexing the tip's headers, instead of replaying every block since genesis
+static void BM_StartFromSnapshot(benchmark::State& state) {
+    std::vector<Transaction> mints;
+    mints.reserve(state.range(0));
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        mints.emplace_back("Mint", "Account" + std::to_string(i), 100.0, 0.0);
+    }
+    ChainState balances;
+    balances.applyGenesis(Block(std::move(mints), "0"));
+    std::string path = "/tmp/blockchain_benchmark_snapshot.dat";
+    Blockchain(0x207fffff).writeSnapshot(path);
+    StateSnapshot snapshot = StateSnapshot::read(path);
+    snapshot.state = balances.withoutUndo();
+    std::string bytes = snapshot.encode();
+    std::remove(path.c_str());
+
+    for (auto _ : state) {
+        Blockchain chain(StateSnapshot::decode(bytes), 0x207fffff);
+        benchmark::DoNotOptimize(chain.getLength());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_StartFromSnapshot)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+// Transaction::isValid reads the summary of the senderSent history built when the transaction was
+// made, so it should stay flat as the history grows
+static void BM_TransactionIsValid(benchmark::State& state) {
+    Transaction transaction = SyntheticWorkload().transaction(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(transaction.isValid());
+    }
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_TransactionIsValid)->RangeMultiplier(10)->Range(10, 100000)->Complexity();
+
+// Checking a transaction against a sender who already has range(0) transfers in the chain state
+static void BM_CheckTransactionAgainstChainState(benchmark::State& state) {
+    ChainState chainState;
+    chainState.applyGenesis(Block({Transaction("Mint", "Alice", 1e12, 0.0)}, "0"));
+    std::vector<Transaction> transfers;
+    transfers.reserve(state.range(0));
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        transfers.emplace_back("Alice", "Bob", 10.0 + (i % 3) * 0.1, 0.01);
+    }
+    chainState.applyBlock(Block(std::move(transfers), "1"));
+    Transaction transaction("Alice", "Carol", 10.0, 0.01);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(chainState.checkTransaction(transaction));
+    }
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_CheckTransactionAgainstChainState)->RangeMultiplier(10)->Range(10, 100000)->Complexity();
+
+static void BM_BuildBlockTemplate(benchmark::State& state) {
+    Mempool mempool(1024 * 1024 * 1024);
+    for (int i = 0; i < state.range(0); ++i) {
+        double amount = 10.0 + i % 7;
+        mempool.add(Transaction("Sender" + std::to_string(i), "Bob", amount, 0.01 * (i % 1000 + 1), std::vector<double>(5, amount)));
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(mempool.buildBlockTemplate("0", "Miner"));
+    }
+}
+BENCHMARK(BM_BuildBlockTemplate)->Arg(100000)->Unit(benchmark::kMicrosecond);
+
+// Cost of one receive into a wallet that already holds state.range(0) received transactions
+static void BM_ReceiveMoney(benchmark::State& state) {
+    Wallet wallet("Bob");
+    for (int i = 0; i < state.range(0); ++i) {
+        wallet.receiveMoney({Transaction("Alice" + std::to_string(i), "Bob", 1.0, 0.05)});
+    }
+    int next = 0;
+    for (auto _ : state) {
+        wallet.receiveMoney({Transaction("Carol" + std::to_string(next++), "Bob", 1.0, 0.05)});
+    }
+}
+BENCHMARK(BM_ReceiveMoney)->Arg(1000)->Arg(10000)->Arg(100000);
+
+// Copying a block's transactions: with interned addresses and shared optional fields this is one allocation
+static void BM_CopyTransactions(benchmark::State& state) {
+    Block block(makeTransactions(state.range(0)), "0", 1682247600);
+    uint64_t before = AllocationCounter::total();
+    for (auto _ : state) {
+        std::vector<Transaction> copy = block.getTransactions();
+        benchmark::DoNotOptimize(copy.data());
+    }
+    reportAllocations(state, before);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CopyTransactions)->Arg(100)->Arg(1000);
+
+// Hashing and validating transactions already in a block should not touch the heap at all
+static void BM_HashAndValidateTransactions(benchmark::State& state) {
+    std::vector<Transaction> transactions = makeTransactions(state.range(0));
+    uint64_t before = AllocationCounter::total();
+    for (auto _ : state) {
+        for (const auto& transaction : transactions) {
+            benchmark::DoNotOptimize(transaction.calculateHash());
+            benchmark::DoNotOptimize(transaction.isValid());
+        }
+    }
+    reportAllocations(state, before);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_HashAndValidateTransactions)->Arg(100)->Arg(1000);
+
+// One block's worth of transactions from many senders, checked one at a time and as a batch
+static std::vector<Transaction> makeBlockTransactions(int count) {
+    std::vector<Transaction> transactions;
+    for (int i = 0; i < count; ++i) {
+        double amount = 10.0 + i % 7;
+        transactions.emplace_back("Sender" + std::to_string(i % 5000), "Bob", amount, 0.01, std::vector<double>(8, amount));
+    }
+    return transactions;
+}
+
+static void BM_ValidateTransactionsSequential(benchmark::State& state) {
+    std::vector<Transaction> transactions = makeBlockTransactions(state.range(0));
+    for (auto _ : state) {
+        size_t valid = 0;
+        for (const auto& transaction : transactions) {
+            valid += transaction.isValid();
+        }
+        benchmark::DoNotOptimize(valid);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ValidateTransactionsSequential)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static void BM_ValidateTransactionsBatch(benchmark::State& state) {
+    std::vector<Transaction> transactions = makeBlockTransactions(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(TransactionBatchValidator(transactions).validate(state.range(1)));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ValidateTransactionsBatch)->Args({100000, 1})->Args({100000, 4})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Verifying the signatures of range(0) signed transactions on range(1) threads. With range(2) set
+// every signature is already in the cache, as for a block whose transactions came through the mempool.
+static void BM_VerifySignatures(benchmark::State& state) {
+    Wallet wallet = Wallet::generate(1e9);
+    std::vector<Transaction> transactions;
+    transactions.reserve(state.range(0));
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        transactions.push_back(wallet.sendMoney(1.0, {"Account" + std::to_string(i)}).front());
+    }
+    SignatureCache cache;
+    SignatureBatchVerifier verifier(transactions, state.range(2) ? &cache : nullptr);
+    if (state.range(2)) {
+        verifier.verify(state.range(1));
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(verifier.verify(state.range(1)).data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_VerifySignatures)->Args({1000, 1, 0})->Args({1000, 4, 0})->Args({1000, 1, 1})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Decoding block records: reading every field in place through the views, and building a Block
+static std::string makeBlockRecord(int count) {
+    return BlockView::encode(Block(SyntheticWorkload().transactions(count, 8), "0", 1682247600));
+}
+
+static void BM_ReadBlockView(benchmark::State& state) {
+    std::string record = makeBlockRecord(state.range(0));
+    for (auto _ : state) {
+        BlockView view(reinterpret_cast<const unsigned char*>(record.data()), record.size());
+        int64_t units = 0;
+        size_t addressBytes = 0;
+        for (size_t i = 0; i < view.getTransactionCount(); ++i) {
+            TransactionView transaction = view.getTransaction(i);
+            units += transaction.getAmountUnits() + transaction.getFeeUnits();
+            addressBytes += transaction.getSender().size() + transaction.getRecipient().size();
+            for (size_t j = 0; j < transaction.getSenderSentCount(); ++j) {
+                benchmark::DoNotOptimize(transaction.getSenderSent(j));
+            }
+        }
+        benchmark::DoNotOptimize(units);
+        benchmark::DoNotOptimize(addressBytes);
+    }
+    state.SetBytesProcessed(state.iterations() * record.size());
+}
+BENCHMARK(BM_ReadBlockView)->Arg(1000)->Arg(10000);
+
+static void BM_DecodeBlock(benchmark::State& state) {
+    std::string record = makeBlockRecord(state.range(0));
+    for (auto _ : state) {
+        BlockView view(reinterpret_cast<const unsigned char*>(record.data()), record.size());
+        benchmark::DoNotOptimize(view.isWellFormed());
+        benchmark::DoNotOptimize(view.toBlock());
+    }
+    state.SetBytesProcessed(state.iterations() * record.size());
+}
+BENCHMARK(BM_DecodeBlock)->Arg(1000)->Arg(10000)->Unit(benchmark::kMicrosecond);
+
+// Cost on the calling thread of one INFO event like the ones the wallet logs; the writer thread
+// formats into a stream with no buffer, so only the hand-off is measured
+static void BM_LogInfoEvent(benchmark::State& state) {
+    static std::ostream discard(nullptr);
+    Logger& logger = Logger::instance();
+    Logger::Level level = logger.getLevel();
+    logger.setLevel(Logger::Level::Info);
+    logger.setSink(discard);
+    Transaction transaction("Alice", "Bob", 50.0, 0.05);
+    uint64_t events = 0;
+    for (auto _ : state) {
+        logger.log(Logger::Level::Info, "transaction sent", {{"sender", transaction.getSender()}, {"recipient", transaction.getRecipient()}, {"amount", transaction.getAmount()}, {"fee", transaction.getFee()}});
+        // Stay below the ring's capacity so events are handed off rather than dropped
+        if ((++events & (Logger::capacity / 2 - 1)) == 0) {
+            state.PauseTiming();
+            logger.flush();
+            state.ResumeTiming();
+        }
+    }
+    logger.flush();
+    logger.setSink(std::clog);
+    logger.setLevel(level);
+    state.counters["dropped"] = static_cast<double>(logger.getDroppedCount());
+}
+BENCHMARK(BM_LogInfoEvent);
+
+static void BM_LogDisabledEvent(benchmark::State& state) {
+    Logger& logger = Logger::instance();
+    Logger::Level level = logger.getLevel();
+    logger.setLevel(Logger::Level::Warning);
+    Transaction transaction("Alice", "Bob", 50.0, 0.05);
+    for (auto _ : state) {
+        logger.log(Logger::Level::Info, "transaction sent", {{"sender", transaction.getSender()}, {"amount", transaction.getAmount()}});
+    }
+    logger.setLevel(level);
+}
+BENCHMARK(BM_LogDisabledEvent);
+
+// Like BENCHMARK_MAIN, but results are also written as JSON to benchmark_results.json unless
+// --benchmark_out says otherwise. Two such files can be compared with tools/compare.py from Google
+// Benchmark to see what changed between releases.
+int main(int argc, char** argv) {
+    std::vector<char*> args(argv, argv + argc);
+    std::string out = "--benchmark_out=benchmark_results.json";
+    std::string format = "--benchmark_out_format=json";
+    bool hasOut = std::any_of(args.begin(), args.end(), [](const char* arg) { return std::strncmp(arg, "--benchmark_out=", 16) == 0; });
+    if (!hasOut) {
+        args.push_back(&out[0]);
+        args.push_back(&format[0]);
+    }
+    int count = static_cast<int>(args.size());
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data())) {
+        return 1;
+    }
+    benchmark::AddCustomContext("workload_seed", std::to_string(SyntheticWorkload::defaultSeed));
+
+    // Keep per-block log lines out of the measurements
+    Logger::instance().setLevel(Logger::Level::Warning);
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -1,4 +1,15 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include "AllocationCounter.h"
 #include "Blockchain.h"
 
 // Test fixture for the Blockchain class
@@ -12,7 +23,7 @@ TEST_F(BlockchainTest, TestAddBlock) {
     std::vector<Transaction> transactions;
     transactions.emplace_back(Transaction(Wallet("Alice", 1000000.0), Wallet("Bob", 0.0), 50.0));
     Block block(transactions, chain.getLastBlockHash());
-    chain.addBlock(block);
+    EXPECT_TRUE(chain.addBlock(block));
 
     // Check that the block was added to the chain
     EXPECT_EQ(chain.getLength(), 2);
@@ -23,17 +34,969 @@ TEST_F(BlockchainTest, TestIsValid) {
     // Check that the chain is valid
     EXPECT_TRUE(chain.isValid());
 
-    // Create an invalid block and add it to the chain
+    // A block that doesn't link to any block is refused, and the chain stays valid
     std::vector<Transaction> transactions;
     transactions.emplace_back(Transaction(Wallet("Alice", 1000000.0), Wallet("Bob", 0.0), 50.0));
     Block block(transactions, "invalid_previous_hash");
-    chain.addBlock(block);
-
-    // Check that the chain is now invalid
-    EXPECT_FALSE(chain.isValid());
+    EXPECT_FALSE(chain.addBlock(block));
+    EXPECT_EQ(chain.getLength(), 1);
+    EXPECT_TRUE(chain.isValid());
 }
 
 TEST_F(BlockchainTest, TestPrintChain) {
     // Print the chain to the console
     chain.printChain();
 }
+
+TEST_F(BlockchainTest, TestIncrementalValidation) {
+    // A full validation records the verified height
+    EXPECT_TRUE(chain.isValid());
+    EXPECT_EQ(chain.getValidatedHeight(), chain.getLength());
+
+    // Only the newly added block needs to be checked
+    std::vector<Transaction> transactions;
+    transactions.emplace_back(Transaction("Alice", "Bob", 50.0, 0.05));
+    chain.addBlock(Block(transactions, chain.getLastBlockHash()));
+    EXPECT_TRUE(chain.validateNewBlocks());
+    EXPECT_EQ(chain.getValidatedHeight(), chain.getLength());
+
+    // A block that doesn't link to any block never reaches the chain, so there's nothing new to check
+    size_t validatedHeight = chain.getValidatedHeight();
+    EXPECT_FALSE(chain.addBlock(Block(transactions, "invalid_previous_hash")));
+    EXPECT_TRUE(chain.validateNewBlocks());
+    EXPECT_EQ(chain.getValidatedHeight(), validatedHeight);
+}
+
+TEST(BlockchainStoreTest, TestReopenPersistedChain) {
+    std::string directory = (std::filesystem::temp_directory_path() / "blockchain_store_test").string();
+    std::filesystem::remove_all(directory);
+
+    std::string lastHash;
+    {
+        Blockchain chain(directory);
+        std::vector<Transaction> transactions;
+        transactions.emplace_back(Transaction("Alice", "Bob", 50.0, 0.05));
+        chain.addBlock(Block(transactions, chain.getLastBlockHash()));
+        lastHash = chain.getLastBlockHash();
+    }
+
+    // Reopening restores the chain, and blocks can be read straight from the mapped segment
+    Blockchain reopened(directory);
+    EXPECT_EQ(reopened.getLength(), 2);
+    EXPECT_EQ(reopened.getLastBlockHash(), lastHash);
+    ASSERT_NE(reopened.getStore(), nullptr);
+    BlockView view = reopened.getStore()->get(1);
+    EXPECT_EQ(view.getHash(), lastHash);
+    EXPECT_EQ(view.getTransactionCount(), reopened.getLastBlock().getTransactions().size());
+
+    std::filesystem::remove_all(directory);
+}
+
+TEST(BlockchainStoreTest, TestReopenReadsHeadersAndChecksTheIndex) {
+    std::string directory = (std::filesystem::temp_directory_path() / "blockchain_lazy_store_test").string();
+    std::filesystem::remove_all(directory);
+
+    // Arrange: a snapshot at height 2 and one block after it
+    std::vector<Block> blocks;
+    {
+        Blockchain chain(directory);
+        chain.setMiningThreads(1);
+        chain.setSnapshotInterval(2);
+        for (int i = 0; i < 3; ++i) {
+            int64_t timestamp = chain.getLastBlock().getTimestamp() + chain.getTargetBlockSeconds();
+            chain.addBlock(Block({Transaction("Bob", "Carol", 5.0 + i, 0.05)}, chain.getLastBlockHash(), timestamp));
+            blocks.push_back(chain.getLastBlock());
+        }
+    }
+
+    // Act
+    {
+        Blockchain reopened(directory);
+
+        // Assert: balances come from the snapshot plus the block after it, and bodies load from the store
+        EXPECT_EQ(reopened.getLength(), 4u);
+        EXPECT_EQ(reopened.getBalance("Carol"), 5.0 + 6.0 + 7.0);
+        for (size_t height = 1; height < reopened.getLength(); ++height) {
+            Block block = reopened.getBlock(height);
+            EXPECT_EQ(block.getHash(), blocks[height - 1].getHash());
+            EXPECT_EQ(block.getMerkleRoot(), blocks[height - 1].getMerkleRoot());
+            EXPECT_EQ(block.getTransactions().size(), blocks[height - 1].getTransactions().size());
+        }
+        EXPECT_TRUE(reopened.isValid());
+    }
+
+    // An index entry pointing past its segment is reported instead of read
+    {
+        std::fstream index(directory + "/index.dat", std::ios::in | std::ios::out | std::ios::binary);
+        uint64_t offset = uint64_t(1) << 40;
+        index.seekp(3 * 16 + 8);
+        index.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+    }
+    EXPECT_THROW(Blockchain corrupted(directory), std::runtime_error);
+
+    std::filesystem::remove_all(directory);
+}
+
+TEST(BlockchainStoreTest, TestReopensPrunedStoreFromSnapshot) {
+    std::string directory = (std::filesystem::temp_directory_path() / "blockchain_pruned_store_test").string();
+    std::filesystem::remove_all(directory);
+
+    // Arrange: small segments, so pruning has whole segments to delete
+    const size_t segmentSize = 1024;
+    std::string lastHash;
+    {
+        Blockchain chain(directory, segmentSize);
+        chain.setMiningThreads(1);
+        chain.setPruneDepth(4);
+        chain.setSnapshotInterval(10);
+        for (int i = 0; i < 25; ++i) {
+            int64_t timestamp = chain.getLastBlock().getTimestamp() + chain.getTargetBlockSeconds();
+            chain.addBlock(Block({Transaction("Alice", "Carol", 5.0, 0.05)}, chain.getLastBlockHash(), timestamp));
+        }
+        lastHash = chain.getLastBlockHash();
+
+        // Only blocks after the latest snapshot, at height 20, have to stay on disk
+        EXPECT_EQ(chain.getPrunedHeight(), 22u);
+        EXPECT_GT(chain.getStore()->getFirstHeight(), 0u);
+        EXPECT_LE(chain.getStore()->getFirstHeight(), 21u);
+        EXPECT_FALSE(std::filesystem::exists(directory + "/blk00000.dat"));
+        EXPECT_THROW(chain.getStore()->get(0), std::out_of_range);
+    }
+
+    // Act
+    Blockchain reopened(directory, segmentSize);
+
+    // Assert: the chain picks up from the snapshot and replays the blocks stored after it
+    EXPECT_EQ(reopened.getLength(), 26u);
+    EXPECT_EQ(reopened.getLastBlockHash(), lastHash);
+    EXPECT_EQ(reopened.getBalance("Carol"), 25 * 5.0);
+    EXPECT_EQ(reopened.getBlock(25).getHash(), lastHash);
+    EXPECT_TRUE(reopened.isValid());
+
+    std::filesystem::remove_all(directory);
+}
+
+TEST(BlockViewTest, TestRoundTripsThroughCompactRecords) {
+    // Arrange: addresses repeat across transactions, and one has both optional lists
+    Transaction detailed("Alice", "Bob", 12.5, 0.25, {10.0, 11.0, 12.0});
+    detailed.setRecipientList({"Bob", "Carol"});
+    detailed.setTimestamp(1682247600);
+    std::vector<Transaction> transactions = {Transaction("Miner", "Miner", 50.0, 0.0), detailed, Transaction("Bob", "Alice", 3.0, 0.01),
+                                             Transaction("Alice", "Bob", 1.0, 0.01)};
+    Block block(transactions, std::string(64, 'a'), 1682247600, 42, 50.0, std::string(64, 'b'));
+
+    // Act
+    std::string record = BlockView::encode(block);
+    BlockView view(reinterpret_cast<const unsigned char*>(record.data()), record.size());
+    Block decoded = view.toBlock();
+
+    // Assert: fields are read in place, and every address is stored once
+    ASSERT_TRUE(view.isWellFormed());
+    EXPECT_EQ(view.getAddresses().size(), 3u);
+    EXPECT_EQ(view.getTransaction(1).getSender(), "Alice");
+    EXPECT_EQ(view.getTransaction(1).getRecipientListEntry(1), "Carol");
+    EXPECT_EQ(view.getTransaction(1).getSenderSent(2), 12.0);
+    EXPECT_EQ(decoded.getHash(), block.getHash());
+    EXPECT_EQ(decoded.getPreviousHash(), block.getPreviousHash());
+    EXPECT_EQ(decoded.getNonce(), 42u);
+    EXPECT_EQ(decoded.getMerkleRoot(), block.getMerkleRoot());
+    EXPECT_EQ(decoded.calculateHash(), block.calculateHash());
+
+    // Transaction::getSize is exactly the size of a standalone record
+    for (const auto& transaction : transactions) {
+        std::string transactionRecord = TransactionView::encode(transaction);
+        EXPECT_EQ(transaction.getSize(), transactionRecord.size());
+        TransactionView transactionView = TransactionView::fromRecord(reinterpret_cast<const unsigned char*>(transactionRecord.data()), transactionRecord.size());
+        ASSERT_TRUE(transactionView.isWellFormed());
+        EXPECT_EQ(transactionView.toTransaction().calculateHash(), transaction.calculateHash());
+    }
+
+    // A record cut short anywhere is rejected rather than read past its end
+    for (size_t size = 0; size < record.size(); ++size) {
+        std::string truncated = record.substr(0, size);
+        EXPECT_FALSE(BlockView(reinterpret_cast<const unsigned char*>(truncated.data()), truncated.size()).isWellFormed()) << size;
+    }
+}
+
+// Transaction with enough sending history to pass Transaction::isValid
+static Transaction pendingTransaction(const std::string& sender, double amount, double fee) {
+    return Transaction(sender, "Bob", amount, fee, {amount, amount, amount, amount, amount});
+}
+
+TEST(MempoolTest, TestRejectsInvalidAndDuplicateTransactions) {
+    Mempool mempool;
+    Transaction transaction = pendingTransaction("Alice", 10.0, 0.5);
+
+    EXPECT_EQ(mempool.add(transaction), Mempool::AddResult::Added);
+    EXPECT_EQ(mempool.add(transaction), Mempool::AddResult::Duplicate);
+    EXPECT_EQ(mempool.add(Transaction("Alice", "Alice", 10.0, 0.5)), Mempool::AddResult::Invalid);
+    EXPECT_EQ(mempool.size(), 1);
+    EXPECT_TRUE(mempool.contains(transaction.calculateHash()));
+    EXPECT_EQ(mempool.getBySender("Alice").size(), 1);
+}
+
+TEST(MempoolTest, TestBlockTemplateOrderedByFeeDensity) {
+    Mempool mempool;
+    for (int i = 0; i < 50; ++i) {
+        mempool.add(pendingTransaction("Sender" + std::to_string(i), 10.0, 0.01 * (i + 1)));
+    }
+
+    Block block = mempool.buildBlockTemplate("0", "Miner");
+    std::vector<Transaction> transactions = block.getTransactions();
+
+    // The template respects the size limit and starts with the best paying transactions
+    ASSERT_FALSE(transactions.empty());
+    EXPECT_LE(block.getBlockSize(), Block::maxBlockSize);
+    EXPECT_EQ(transactions[0].getSender(), "Sender49");
+    for (size_t i = 1; i < transactions.size(); ++i) {
+        EXPECT_GE(transactions[i - 1].getFee() / transactions[i - 1].getSize(), transactions[i].getFee() / transactions[i].getSize());
+    }
+}
+
+TEST(MempoolTest, TestEvictsLowestFeeDensityUnderMemoryCap) {
+    Mempool mempool(2000);
+    Transaction cheap = pendingTransaction("Cheap", 10.0, 0.01);
+    mempool.add(cheap);
+    for (int i = 0; i < 20; ++i) {
+        mempool.add(pendingTransaction("Sender" + std::to_string(i), 10.0, 1.0 + i));
+    }
+
+    EXPECT_LE(mempool.getMemoryUsage(), 2000);
+    EXPECT_FALSE(mempool.contains(cheap.calculateHash()));
+    EXPECT_EQ(mempool.add(pendingTransaction("Cheaper", 10.0, 0.001)), Mempool::AddResult::FeeTooLow);
+}
+
+TEST(MempoolTest, TestFailedEvictionLeavesThePoolUntouched) {
+    Mempool mempool(2000);
+    Transaction cheap = pendingTransaction("Cheap", 10.0, 0.01);
+    mempool.add(cheap);
+    for (int i = 0; mempool.getMemoryUsage() + 400 < 2000; ++i) {
+        mempool.add(pendingTransaction("Sender" + std::to_string(i), 10.0, 1.0 + i));
+    }
+    size_t count = mempool.size();
+    size_t memory = mempool.getMemoryUsage();
+
+    // Pays more per byte than the cheap transaction, but evicting it alone doesn't make room
+    Transaction large = pendingTransaction(std::string(1000, 'L'), 10.0, 0.5);
+    ASSERT_GT(large.getFee() / large.getSize(), cheap.getFee() / cheap.getSize());
+    EXPECT_EQ(mempool.add(large), Mempool::AddResult::FeeTooLow);
+
+    EXPECT_TRUE(mempool.contains(cheap.calculateHash()));
+    EXPECT_EQ(mempool.size(), count);
+    EXPECT_EQ(mempool.getMemoryUsage(), memory);
+}
+
+TEST(MempoolTest, TestRejectsTransactionsLargerThanThePool) {
+    Mempool mempool(2000);
+    Transaction cheap = pendingTransaction("Cheap", 10.0, 0.01);
+    mempool.add(cheap);
+
+    EXPECT_EQ(mempool.add(pendingTransaction(std::string(4000, 'L'), 10.0, 1000.0)), Mempool::AddResult::TooLarge);
+    EXPECT_TRUE(mempool.contains(cheap.calculateHash()));
+    EXPECT_EQ(mempool.size(), 1u);
+}
+
+TEST(ChainStateTest, TestApplyAndUndoBlocks) {
+    ChainState state;
+    state.applyGenesis(Block({Transaction("Mint", "Alice", 100.0, 0.0)}, "0"));
+    EXPECT_EQ(state.getBalance("Alice"), 100.0);
+
+    // Spends are checked against the balances, including earlier spends in the same block
+    Block covered({Transaction("Miner", "Miner", 50.0, 0.0), Transaction("Alice", "Bob", 40.0, 1.0)}, "1");
+    Block overspent({Transaction("Alice", "Bob", 60.0, 1.0), Transaction("Alice", "Carol", 60.0, 1.0)}, "1");
+    EXPECT_TRUE(state.validateBlock(covered));
+    EXPECT_FALSE(state.validateBlock(overspent));
+
+    state.applyBlock(covered);
+    EXPECT_EQ(state.getBalance("Alice"), 59.0);
+    EXPECT_EQ(state.getBalance("Bob"), 40.0);
+    EXPECT_EQ(state.getBalance("Miner"), 51.0);
+    EXPECT_EQ(state.getAccount("Alice")->sentCount, 1);
+
+    // Rolling back restores the balances from before the block
+    state.undoBlock();
+    EXPECT_EQ(state.getBalance("Alice"), 100.0);
+    EXPECT_EQ(state.getBalance("Bob"), 0.0);
+    EXPECT_EQ(state.getBalance("Miner"), 0.0);
+    EXPECT_EQ(state.getHeight(), 1);
+}
+
+TEST(ChainStateTest, TestKeepsSenderStatisticsAsBlocksApply) {
+    // Arrange: Alice sends a steady amount in each of several blocks
+    ChainState state;
+    state.applyGenesis(Block({Transaction("Mint", "Alice", 1000.0, 0.0)}, "0"));
+    std::vector<double> amounts = {10.0, 10.2, 9.9, 10.1, 10.0, 9.8};
+    for (double amount : amounts) {
+        state.applyBlock(Block({Transaction("Alice", "Bob", amount, 0.01)}, "1"));
+    }
+
+    // Act
+    const SenderStats& stats = state.getAccount("Alice")->sent;
+    SenderStats expected = SenderStats::of(amounts);
+
+    // Assert: the running summary matches one computed over the whole history
+    EXPECT_EQ(stats.count, amounts.size());
+    EXPECT_DOUBLE_EQ(stats.total, expected.total);
+    EXPECT_DOUBLE_EQ(stats.mean, expected.mean);
+    EXPECT_NEAR(stats.variance(), expected.variance(), 1e-12);
+    EXPECT_EQ(stats.min, 9.8);
+    EXPECT_EQ(stats.max, 10.2);
+
+    // The history checks read the chain's summary, not a history the transaction brings along
+    EXPECT_TRUE(state.checkTransaction(Transaction("Alice", "Carol", 9.82, 0.01)));
+    EXPECT_FALSE(state.checkTransaction(Transaction("Alice", "Carol", 10.2, 0.01)));
+    // Funds are the sender's balance: Bob has received but never sent, and Carol holds nothing
+    EXPECT_TRUE(state.checkTransaction(Transaction("Bob", "Carol", 1.0, 0.01)));
+    EXPECT_FALSE(state.checkTransaction(Transaction("Carol", "Bob", 1.0, 0.01)));
+
+    // Rolling a block back restores the summary from before it
+    state.undoBlock();
+    EXPECT_EQ(state.getAccount("Alice")->sent.count, amounts.size() - 1);
+    EXPECT_EQ(state.getAccount("Alice")->sent.min, 9.9);
+}
+
+TEST_F(BlockchainTest, TestBalancesFollowTheChain) {
+    chain.setMiningThreads(1);
+    std::vector<Transaction> transactions;
+    transactions.emplace_back(Transaction("Bob", "Carol", 20.0, 0.05));
+    chain.addBlock(Block(transactions, chain.getLastBlockHash()));
+
+    EXPECT_EQ(chain.getBalance("Carol"), 20.0);
+    EXPECT_EQ(chain.getBalance("Miner Wallet"), 50.05);
+}
+
+TEST_F(BlockchainTest, TestReorgToBranchWithMoreWork) {
+    chain.setMiningThreads(1);
+    std::string genesisHash = chain.getLastBlockHash();
+    Wallet forkMiner("Fork Miner");
+
+    // The active chain gets one block paying Carol
+    chain.addBlock(Block({Transaction("Bob", "Carol", 20.0, 0.05, {20.0, 20.0, 20.0})}, genesisHash));
+    std::string mainTip = chain.getLastBlockHash();
+
+    // A competing block at the same height doesn't have more work, so the first one seen stays active
+    Block forkBlock({Transaction("Bob", "Dave", 30.0, 0.05, {30.0, 30.0, 30.0})}, genesisHash);
+    forkBlock.mineBlock(4, forkMiner, 1);
+    EXPECT_TRUE(chain.submitBlock(forkBlock));
+    EXPECT_EQ(chain.getLastBlockHash(), mainTip);
+    EXPECT_EQ(chain.getBalance("Carol"), 20.0);
+
+    // Extending the fork gives it more work, and the chain switches over to it
+    Block forkChild({}, forkBlock.getHash());
+    forkChild.mineBlock(4, forkMiner, 1);
+    EXPECT_TRUE(chain.submitBlock(forkChild));
+    EXPECT_EQ(chain.getLastBlockHash(), forkChild.getHash());
+    EXPECT_EQ(chain.getLength(), 3);
+    EXPECT_EQ(chain.getIndexedBlockCount(), 4);
+    EXPECT_EQ(chain.getBalance("Carol"), 0.0);
+    EXPECT_EQ(chain.getBalance("Dave"), 30.0);
+    EXPECT_TRUE(chain.isValid());
+
+    // The abandoned block's transaction is pending again, and blocks can't be submitted twice
+    EXPECT_EQ(chain.getMempool().size(), 1);
+    EXPECT_FALSE(chain.submitBlock(forkChild));
+}
+
+TEST_F(BlockchainTest, TestRejectsBlocksThatOverspend) {
+    chain.setMiningThreads(1);
+    std::string genesisHash = chain.getLastBlockHash();
+    Wallet miner("Fork Miner");
+
+    // Bob holds 50 from genesis, so a block paying out 500 of his is refused however it arrives
+    Block overspent({Transaction("Bob", "Carol", 500.0, 0.05, {500.0, 500.0, 500.0})}, genesisHash);
+    overspent.mineBlock(4, miner, 1);
+    EXPECT_FALSE(chain.submitBlock(overspent));
+    EXPECT_EQ(chain.importBlocks({BlockView::encode(overspent)}), 0u);
+    EXPECT_EQ(chain.getLength(), 1);
+    EXPECT_EQ(chain.getBalance("Carol"), 0.0);
+
+    // A branch with more work is abandoned at its overspending block, and nothing can build on it
+    chain.addBlock(Block({Transaction("Bob", "Carol", 20.0, 0.05)}, genesisHash));
+    std::string mainTip = chain.getLastBlockHash();
+    Block forkBlock({Transaction("Bob", "Dave", 30.0, 0.05, {30.0, 30.0, 30.0})}, genesisHash);
+    forkBlock.mineBlock(4, miner, 1);
+    EXPECT_TRUE(chain.submitBlock(forkBlock));
+    Block forkChild({Transaction("Bob", "Erin", 40.0, 0.05, {40.0, 40.0, 40.0})}, forkBlock.getHash());
+    forkChild.mineBlock(4, miner, 1);
+    EXPECT_FALSE(chain.submitBlock(forkChild));
+    Block forkGrandchild({}, forkChild.getHash());
+    forkGrandchild.mineBlock(4, miner, 1);
+    EXPECT_FALSE(chain.submitBlock(forkGrandchild));
+
+    EXPECT_EQ(chain.getLastBlockHash(), mainTip);
+    EXPECT_EQ(chain.getBalance("Carol"), 20.0);
+    EXPECT_EQ(chain.getBalance("Dave"), 0.0);
+    EXPECT_EQ(chain.getBalance("Erin"), 0.0);
+    EXPECT_TRUE(chain.isValid());
+}
+
+TEST_F(BlockchainTest, TestRejectsBlocksThatMintMoreThanTheSubsidy) {
+    chain.setMiningThreads(1);
+    std::string genesisHash = chain.getLastBlockHash();
+    int64_t timestamp = Blockchain::genesisTimestamp + 60;
+
+    // A block whose header claims a far larger reward, with the miner paying themselves that much
+    Block inflated({Transaction("Bob", "Carol", 5.0, 0.05)}, genesisHash, timestamp, 0, 1e9, "");
+    inflated.mineBlock(4, Wallet("Greedy Miner"), 1);
+    ASSERT_EQ(inflated.getTransactions()[0].getAmount(), 1e9);
+    EXPECT_FALSE(chain.submitBlock(inflated));
+    EXPECT_EQ(chain.importBlocks({BlockView::encode(inflated)}), 0u);
+
+    // A block with the right header but no reward, whose first transaction pays its sender
+    std::vector<Transaction> transactions = {Transaction("Bob", "Bob", 10.0, 0.0)};
+    Block candidate(transactions, genesisHash, timestamp, 0, Blockchain::blockReward, "");
+    Hash256 target = targetFromCompact(chain.getNextTarget());
+    uint64_t nonce = 0;
+    while (!meetsTarget(candidate.calculateDigest(nonce), target)) {
+        nonce++;
+    }
+    Block selfPayment(transactions, genesisHash, timestamp, nonce, Blockchain::blockReward, toHex(candidate.calculateDigest(nonce)));
+    EXPECT_FALSE(chain.submitBlock(selfPayment));
+    EXPECT_EQ(chain.importBlocks({BlockView::encode(selfPayment)}), 0u);
+
+    EXPECT_EQ(chain.getLength(), 1);
+    EXPECT_EQ(chain.getBalance("Greedy Miner"), 0.0);
+    EXPECT_EQ(chain.getBalance("Bob"), 50.0);
+
+    // A block mined for the subsidy still goes in
+    chain.addBlock(Block({Transaction("Bob", "Carol", 5.0, 0.05)}, genesisHash));
+    EXPECT_EQ(chain.getLength(), 2);
+    EXPECT_EQ(chain.getLastBlock().getTransactions()[0].getAmount(), Blockchain::blockReward);
+}
+
+TEST_F(BlockchainTest, TestImportRejectsBlocksWithInvalidTransactions) {
+    // Arrange: Bob sends 5 in each of five blocks, then a block pays Carol more than that history
+    // allows. Transactions are judged by the chain's history, not the one they carry.
+    chain.setMiningThreads(1);
+    for (int i = 0; i < 5; ++i) {
+        chain.addBlock(Block({Transaction("Bob", "Carol", 5.0, 0.05)}, chain.getLastBlockHash()));
+    }
+    Block unusual({Transaction("Bob", "Carol", 8.0, 0.05, {8.0, 8.0, 8.0})}, chain.getLastBlockHash());
+    unusual.mineBlock(targetFromCompact(chain.getNextTarget()), Wallet("Miner"), 1, Block::defaultMiningSeconds);
+    EXPECT_FALSE(chain.submitBlock(unusual));
+    std::vector<std::string> records;
+    for (size_t height = 1; height < chain.getLength(); ++height) {
+        records.push_back(BlockView::encode(chain.getBlock(height)));
+    }
+    records.push_back(BlockView::encode(unusual));
+    Blockchain copy;
+    copy.setValidationThreads(4);
+
+    // Act
+    size_t accepted = copy.importBlocks(records);
+
+    // Assert: every block but the last connects
+    EXPECT_EQ(accepted, 5u);
+    EXPECT_EQ(copy.getLastBlockHash(), chain.getLastBlockHash());
+    EXPECT_EQ(copy.getBalance("Carol"), 25.0);
+
+    // The mempool judges transactions the same way
+    EXPECT_EQ(copy.getMempool().add(Transaction("Bob", "Carol", 8.0, 0.05, {8.0, 8.0, 8.0})), Mempool::AddResult::Invalid);
+    EXPECT_EQ(copy.getMempool().add(pendingTransaction("Nobody", 10.0, 0.5)), Mempool::AddResult::Invalid);
+    EXPECT_EQ(copy.getMempool().add(Transaction("Bob", "Carol", 5.0, 0.05)), Mempool::AddResult::Added);
+}
+
+TEST_F(BlockchainTest, TestImportBlocksFromAnotherChain) {
+    // Arrange: mine a few blocks on chain and encode them the way a peer would send them
+    chain.setMiningThreads(1);
+    for (int i = 0; i < 3; ++i) {
+        chain.addBlock(Block({Transaction("Bob", "Carol", 5.0, 0.05, {5.0, 5.0, 5.0})}, chain.getLastBlockHash()));
+    }
+    std::vector<std::string> records;
+    for (size_t height = 1; height < chain.getLength(); ++height) {
+        records.push_back(BlockView::encode(chain.getBlock(height)));
+    }
+    Blockchain copy;
+    copy.setValidationThreads(4);
+
+    // A record whose stored hash was tampered with fails verification, and the blocks after it are orphaned
+    std::vector<std::string> corrupted = records;
+    // version, then the previous hash's tag and 32 bytes, then this hash's tag
+    size_t hashOffset = 1 + 1 + 32 + 1;
+    corrupted[1][hashOffset] ^= 0x01;
+    Blockchain partial;
+    EXPECT_EQ(partial.importBlocks(corrupted), 1);
+    EXPECT_EQ(partial.getLength(), 2);
+
+    // Act
+    size_t accepted = copy.importBlocks(records);
+
+    // Assert
+    EXPECT_EQ(accepted, records.size());
+    EXPECT_EQ(copy.getLength(), chain.getLength());
+    EXPECT_EQ(copy.getLastBlockHash(), chain.getLastBlockHash());
+    EXPECT_EQ(copy.getBalance("Carol"), chain.getBalance("Carol"));
+    EXPECT_TRUE(copy.isValid());
+}
+
+TEST_F(BlockchainTest, TestCheckingAnImportedBlockDoesNotAllocate) {
+    // Arrange: a block decoded the way importBlocks decodes it, checked once to warm up
+    chain.setMiningThreads(1);
+    chain.addBlock(Block({Transaction("Bob", "Carol", 5.0, 0.05, {5.0, 5.0, 5.0})}, chain.getLastBlockHash()));
+    std::string record = BlockView::encode(chain.getLastBlock());
+    Block block = BlockView(reinterpret_cast<const unsigned char*>(record.data()), record.size()).toBlock();
+    Blockchain copy;
+    ASSERT_TRUE(copy.checkBlock(block));
+
+    // Act
+    uint64_t before = AllocationCounter::thisThread();
+    bool valid = copy.checkBlock(block);
+    uint64_t allocations = AllocationCounter::thisThread() - before;
+
+    // Assert: the checks stay off the heap; only decoding and connecting allocate, for the block itself
+    EXPECT_TRUE(valid);
+    EXPECT_EQ(allocations, 0u);
+}
+
+TEST(TargetTest, TestCompactTargetRoundTrip) {
+    // Four leading zero digits is 0x0000ffffff..., which rounds down to a three byte mantissa
+    uint32_t compact = compactFromDifficulty(4);
+    EXPECT_EQ(compact, 0x1f00ffffu);
+    Hash256 target = targetFromCompact(compact);
+    EXPECT_EQ(toHex(target).substr(0, 8), "0000ffff");
+    EXPECT_EQ(compactFromTarget(target), compact);
+    EXPECT_EQ(compactFromValue(targetValue(compact)), compact);
+    EXPECT_EQ(compactFromValue(targetValue(compact) / 2), 0x1e7fff80u);
+}
+
+// Extend chain with blocks whose timestamps are spacing seconds apart, mined to the chain's target
+static void extendWithSpacing(Blockchain& chain, int count, int64_t spacing) {
+    Wallet miner("Miner");
+    for (int i = 0; i < count; ++i) {
+        Block block({}, chain.getLastBlockHash(), chain.getLastBlock().getTimestamp() + spacing);
+        block.mineBlock(targetFromCompact(chain.getNextTarget()), miner, 1, Block::defaultMiningSeconds);
+        ASSERT_TRUE(chain.submitBlock(block));
+    }
+}
+
+TEST_F(BlockchainTest, TestRetargetsFromBlockTimestamps) {
+    // Blocks on schedule leave the target where it is
+    chain.setTargetBlockSeconds(60);
+    extendWithSpacing(chain, Blockchain::retargetWindow, 60);
+    EXPECT_EQ(chain.getNextTarget(), chain.getPowLimit());
+
+    // One fast block moves the target by the share of the window it took off the timespan, not 16x
+    extendWithSpacing(chain, 1, 30);
+    double ratio = targetValue(chain.getNextTarget()) / targetValue(chain.getPowLimit());
+    EXPECT_NEAR(ratio, (15 * 60 + 30) / (16 * 60.0), 1e-4);
+
+    // While blocks keep coming too fast the target keeps getting harder
+    uint32_t previous = chain.getNextTarget();
+    extendWithSpacing(chain, 4, 30);
+    EXPECT_LT(targetValue(chain.getNextTarget()), targetValue(previous));
+
+    // A block mined to an easier target than its height requires is rejected
+    Block easy({}, chain.getLastBlockHash(), chain.getLastBlock().getTimestamp() + 30);
+    Wallet miner("Miner");
+    do {
+        easy = Block({}, chain.getLastBlockHash(), easy.getTimestamp() + 1);
+        easy.mineBlock(targetFromCompact(chain.getPowLimit()), miner, 1, Block::defaultMiningSeconds);
+    } while (meetsTarget(hashFromHex(easy.getHash()), targetFromCompact(chain.getNextTarget())));
+    EXPECT_FALSE(chain.submitBlock(easy));
+    EXPECT_TRUE(chain.isValid());
+}
+
+TEST_F(BlockchainTest, TestReadersRunWhileBlocksAreMined) {
+    chain.setMiningThreads(1);
+    std::atomic<bool> done(false);
+    std::atomic<uint64_t> reads(0);
+    std::thread reader([&] {
+        while (!done.load()) {
+            EXPECT_GE(chain.getLength(), 1u);
+            EXPECT_TRUE(chain.validateNewBlocks());
+            reads++;
+        }
+    });
+
+    for (int i = 0; i < 3; ++i) {
+        chain.addBlock(Block({Transaction("Bob", "Carol", 5.0, 0.05)}, chain.getLastBlockHash()));
+    }
+    done = true;
+    reader.join();
+
+    EXPECT_EQ(chain.getLength(), 4);
+    EXPECT_GT(reads.load(), 0u);
+    EXPECT_TRUE(chain.isValid());
+}
+
+TEST(LoggerTest, TestWritesEnabledEventsInTheBackground) {
+    Logger& logger = Logger::instance();
+    logger.flush();
+    std::ostringstream sink;
+    logger.setSink(sink);
+    logger.setLevel(Logger::Level::Info);
+
+    // Events from several threads all arrive, and disabled levels are skipped
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&logger, t] {
+            for (int i = 0; i < 100; ++i) {
+                logger.log(Logger::Level::Info, "event", {{"thread", t}, {"index", i}, {"name", std::string("worker")}});
+                logger.log(Logger::Level::Debug, "hidden");
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    logger.log(Logger::Level::Warning, "last", {{"amount", 2.5}, {"wallet", "Alice"}});
+    logger.flush();
+    logger.setSink(std::clog);
+
+    std::string output = sink.str();
+    EXPECT_EQ(std::count(output.begin(), output.end(), '\n'), 401);
+    EXPECT_EQ(output.find("hidden"), std::string::npos);
+    EXPECT_NE(output.find(" INFO event thread=3 index=99 name=worker\n"), std::string::npos);
+    EXPECT_NE(output.find(" WARNING last amount=2.5 wallet=Alice\n"), std::string::npos);
+    EXPECT_EQ(logger.getDroppedCount(), 0u);
+}
+
+TEST(MetricsTest, TestExportsShardedMetricsInPrometheusFormat) {
+    Metrics& metrics = Metrics::instance();
+    Metrics::Counter& counter = metrics.counter("test_events_total", "Events counted by the test");
+    Metrics::Histogram& histogram = metrics.histogram("test_latency_seconds", "Latencies observed by the test", {0.1, 1.0});
+
+    // Updates from several threads land in different shards and are summed on read
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 1000; ++i) {
+                counter.add();
+            }
+            histogram.observe(0.5);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    histogram.observe(0.05);
+    EXPECT_EQ(counter.value(), 4000u);
+    EXPECT_EQ(&metrics.counter("test_events_total", "Events counted by the test"), &counter);
+    EXPECT_THROW(metrics.gauge("test_events_total", "Not a gauge"), std::logic_error);
+
+    std::string text = metrics.exportText();
+    EXPECT_NE(text.find("# TYPE test_events_total counter\ntest_events_total 4000\n"), std::string::npos);
+    EXPECT_NE(text.find("test_latency_seconds_bucket{le=\"0.1\"} 1\ntest_latency_seconds_bucket{le=\"1\"} 5\n"), std::string::npos);
+    EXPECT_NE(text.find("test_latency_seconds_count 5\n"), std::string::npos);
+
+    // Mining and connecting a block is instrumented
+    Blockchain chain;
+    chain.setMiningThreads(1);
+    uint64_t hashesBefore = metrics.counter("blockchain_hash_attempts_total", "").value();
+    chain.addBlock(Block({Transaction("Bob", "Carol", 5.0, 0.05)}, chain.getLastBlockHash()));
+    EXPECT_TRUE(chain.isValid());
+    EXPECT_GT(metrics.counter("blockchain_hash_attempts_total", "").value(), hashesBefore);
+    EXPECT_GT(metrics.histogram("blockchain_block_import_seconds", "").getCount(), 0u);
+    EXPECT_GT(metrics.histogram("blockchain_validation_seconds", "").getCount(), 0u);
+
+    // The export can be written to a file
+    std::string path = (std::filesystem::temp_directory_path() / "blockchain_metrics_test.prom").string();
+    metrics.writeToFile(path);
+    std::ifstream file(path);
+    std::string written((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    EXPECT_NE(written.find("blockchain_hash_attempts_total"), std::string::npos);
+    std::filesystem::remove(path);
+}
+
+TEST(MetricsTest, TestRegistersWhileExporting) {
+    Metrics& metrics = Metrics::instance();
+    std::atomic<bool> done{false};
+    std::thread exporter([&] {
+        while (!done) {
+            metrics.exportText();
+        }
+    });
+
+    // New metrics appear in an export only once they're fully registered
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < 200; ++i) {
+                std::string name = "test_registered_" + std::to_string(t) + "_" + std::to_string(i);
+                metrics.counter(name + "_total", "Registered by the test").add();
+                metrics.gauge(name + "_gauge", "Registered by the test").set(i);
+                metrics.histogram(name + "_seconds", "Registered by the test", {1.0}).observe(0.5);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    done = true;
+    exporter.join();
+
+    EXPECT_NE(metrics.exportText().find("test_registered_3_199_total 1\n"), std::string::npos);
+}
+
+TEST(MetricsTest, TestServesMetricsOverHttp) {
+    Metrics::instance().counter("test_scrapes_total", "Scrapes made by the test").add();
+    MetricsServer server;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(server.getPort());
+    ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)), 0);
+    std::string request = "GET /metrics HTTP/1.0\r\n\r\n";
+    ASSERT_EQ(send(fd, request.data(), request.size(), 0), static_cast<ssize_t>(request.size()));
+    std::string response;
+    char buffer[4096];
+    for (ssize_t received; (received = recv(fd, buffer, sizeof(buffer), 0)) > 0;) {
+        response.append(buffer, received);
+    }
+    close(fd);
+
+    EXPECT_EQ(response.rfind("HTTP/1.0 200 OK\r\n", 0), 0u);
+    EXPECT_NE(response.find("\ntest_scrapes_total 1\n"), std::string::npos);
+}
+
+TEST(SipHashTest, TestMatchesReferenceVector) {
+    // Key 00 01 .. 0f and an empty message, from the SipHash paper's test vectors
+    EXPECT_EQ(sipHash24(0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL, nullptr, 0), 0x726fdb47dd0e0e31ULL);
+}
+
+// Poll until condition holds or a few seconds pass, for state that another node updates
+template<typename Condition>
+static bool waitFor(Condition condition) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+TEST(NodeTest, TestGossipsTransactionsAndRebuildsCompactBlocks) {
+    // Arrange: three nodes in a line, A - B - C
+    Blockchain chainA;
+    Blockchain chainB;
+    Blockchain chainC;
+    chainA.setMiningThreads(1);
+    ASSERT_EQ(chainA.getLastBlockHash(), chainC.getLastBlockHash());
+    Node nodeA(chainA);
+    Node nodeB(chainB);
+    Node nodeC(chainC);
+    nodeA.connect("127.0.0.1", nodeB.getPort());
+    nodeC.connect("127.0.0.1", nodeB.getPort());
+    ASSERT_TRUE(waitFor([&] { return nodeB.getPeerCount() == 2; }));
+
+    // Transactions broadcast by A reach C through B
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_EQ(nodeA.broadcastTransaction(pendingTransaction("Alice", 10.0 + i, 0.1)), Mempool::AddResult::Added);
+    }
+    ASSERT_TRUE(waitFor([&] { return chainC.getMempool().size() == 3; }));
+
+    // One transaction that only A has, paying enough to make it into the block
+    chainA.getMempool().add(pendingTransaction("Alice", 20.0, 5.0));
+
+    // Act: A mines a block and relays it
+    chainA.addBlock(chainA.createBlockTemplate());
+    Block mined = chainA.getLastBlock();
+    ASSERT_GT(mined.getTransactions().size(), 2u);
+    nodeA.relayBlock(mined);
+
+    // Assert: B rebuilt the block, fetching only the private transaction, and C followed
+    ASSERT_TRUE(waitFor([&] { return chainC.getLastBlockHash() == mined.getHash(); }));
+    EXPECT_EQ(chainB.getLastBlockHash(), mined.getHash());
+    Node::Stats stats = nodeB.getStats();
+    EXPECT_EQ(stats.blocksReconstructed, 1u);
+    EXPECT_EQ(stats.blockTransactionRequests, 1u);
+    EXPECT_EQ(stats.fullBlockRequests, 0u);
+    // C never saw the private transaction either, and gets it from the block B now has
+    EXPECT_EQ(nodeC.getStats().blockTransactionRequests, 1u);
+    EXPECT_LT(stats.compactBlockBytesReceived, BlockView::encode(mined).size());
+    EXPECT_TRUE(chainC.isValid());
+}
+
+TEST(NodeTest, TestSyncsHeadersFirstFromSeveralPeers) {
+    // Arrange: two nodes with the same chain, long enough to retarget, and a fresh node connected to both
+    const uint32_t easyPowLimit = 0x207fffff;
+    Blockchain source(easyPowLimit);
+    source.setMiningThreads(1);
+    for (size_t height = 1; height < 2 * Blockchain::retargetWindow + 8; ++height) {
+        // Blocks come a little fast, so the later ones have to meet a harder target than the limit
+        int64_t timestamp = source.getLastBlock().getTimestamp() + source.getTargetBlockSeconds() / 2;
+        source.addBlock(Block({Transaction("Alice", "Carol", 5.0, 0.05, {5.0, 5.0, 5.0})}, source.getLastBlockHash(), timestamp));
+    }
+    ASSERT_NE(source.getNextTarget(), easyPowLimit);
+    std::vector<std::string> records;
+    for (size_t height = 1; height < source.getLength(); ++height) {
+        records.push_back(BlockView::encode(source.getBlock(height)));
+    }
+    Blockchain mirror(easyPowLimit);
+    ASSERT_EQ(mirror.importBlocks(records), records.size());
+    Blockchain fresh(easyPowLimit);
+    Node sourceNode(source);
+    Node mirrorNode(mirror);
+    Node freshNode(fresh);
+    freshNode.connect("127.0.0.1", sourceNode.getPort());
+    freshNode.connect("127.0.0.1", mirrorNode.getPort());
+
+    // A header chain stops at the first header that doesn't link to the one before
+    std::vector<BlockHeader> headers = source.getHeaders(fresh.getLastBlockHash(), 10);
+    ASSERT_EQ(headers.size(), 10u);
+    headers[4].previousHash = headers[3].previousHash;
+    Blockchain::HeaderChain checked = fresh.beginHeaderChain();
+    EXPECT_EQ(fresh.extendHeaderChain(checked, headers), 4u);
+
+    // Act
+    Node::SyncResult result = freshNode.sync(10.0);
+
+    // Assert: every block arrived and connected, with bodies coming from both peers
+    EXPECT_EQ(result.headers, records.size());
+    EXPECT_EQ(result.blocks, records.size());
+    EXPECT_GT(result.blocksPerSecond, 0.0);
+    EXPECT_EQ(fresh.getLastBlockHash(), source.getLastBlockHash());
+    EXPECT_EQ(fresh.getBalance("Carol"), source.getBalance("Carol"));
+    EXPECT_TRUE(fresh.isValid());
+    EXPECT_GT(sourceNode.getStats().bytesSent, 0u);
+    EXPECT_GT(mirrorNode.getStats().bytesSent, 0u);
+}
+
+TEST(NodeTest, TestClosesPeersThatDisconnect) {
+    // Arrange
+    Blockchain chain;
+    Node node(chain);
+    auto openFiles = [] { return std::distance(std::filesystem::directory_iterator("/proc/self/fd"), std::filesystem::directory_iterator()); };
+    auto before = openFiles();
+
+    // Act: peers come and go without sending anything
+    for (int i = 0; i < 20; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(node.getPort());
+        ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)), 0);
+        close(fd);
+    }
+
+    // Assert: the node let go of their sockets
+    EXPECT_TRUE(waitFor([&] { return node.getPeerCount() == 0 && openFiles() == before; }));
+}
+
+TEST(SignatureTest, TestVerifiesSignaturesOnceAcrossMempoolAndBlocks) {
+    // Arrange: a wallet with a key pair signs what it sends, and nobody else can sign for it
+    Wallet alice = Wallet::generate(100.0);
+    Transaction payment = alice.sendMoney(10.0, {"Bob"}).front();
+    Transaction forged(alice.getName(), "Mallory", 5.0, 0.05, {5.0});
+    Transaction altered = payment;
+    altered.setTimestamp(payment.getTimestamp() + 1);
+    EXPECT_TRUE(payment.verifySignature());
+    EXPECT_FALSE(forged.verifySignature());
+    EXPECT_FALSE(altered.verifySignature());
+    EXPECT_THROW(Wallet::generate().sign(forged), std::logic_error);
+
+    // The signature travels in the record, and counts towards the transaction's size
+    std::string record = TransactionView::encode(payment);
+    EXPECT_EQ(payment.getSize(), record.size());
+    Transaction decoded = TransactionView::fromRecord(reinterpret_cast<const unsigned char*>(record.data()), record.size()).toTransaction();
+    EXPECT_TRUE(decoded.verifySignature());
+
+    // A batch keeps its verdicts in order whichever thread checks them
+    std::vector<Transaction> batch;
+    for (int i = 0; i < 100; ++i) {
+        batch.push_back(alice.sendMoney(0.01, {"Bob"}).front());
+    }
+    batch[37] = altered;
+    std::vector<uint8_t> verdicts = SignatureBatchVerifier(batch).verify(4);
+    EXPECT_EQ(std::count(verdicts.begin(), verdicts.end(), 0), 1);
+    EXPECT_EQ(verdicts[37], 0);
+
+    // Both chains fund the wallet from the genesis allocation before signatures are required
+    Blockchain miner(0x207fffff);
+    miner.setMiningThreads(1);
+    miner.addBlock(Block({Transaction("Alice", alice.getName(), 100.0, 0.05, {100.0})}, miner.getLastBlockHash()));
+    Blockchain node(0x207fffff);
+    ASSERT_TRUE(node.submitBlock(miner.getLastBlock()));
+    node.setRequireSignatures(true);
+
+    // Act: the node checks the payment as it enters its mempool, then gets the block that mines it
+    EXPECT_EQ(node.getMempool().add(forged), Mempool::AddResult::BadSignature);
+    EXPECT_EQ(node.getMempool().add(payment), Mempool::AddResult::Added);
+    Metrics::Counter& verified = Metrics::instance().counter("blockchain_signatures_verified_total", "");
+    Metrics::Counter& hits = Metrics::instance().counter("blockchain_signature_cache_hits_total", "");
+    uint64_t verifiedBefore = verified.value();
+    uint64_t hitsBefore = hits.value();
+    miner.getMempool().add(payment);
+    miner.addBlock(miner.createBlockTemplate());
+    bool accepted = node.submitBlock(miner.getLastBlock());
+
+    // Assert: the block was accepted without verifying the payment's signature a second time
+    EXPECT_TRUE(accepted);
+    EXPECT_EQ(verified.value(), verifiedBefore);
+    EXPECT_EQ(hits.value(), hitsBefore + 1);
+    EXPECT_EQ(node.getMempool().size(), 0u);
+
+    // A block carrying an unsigned transaction is rejected
+    miner.getMempool().add(forged);
+    miner.addBlock(miner.createBlockTemplate());
+    EXPECT_FALSE(node.submitBlock(miner.getLastBlock()));
+}
+
+TEST(PruningTest, TestBootstrapsFromSnapshotAndRecentBlocks) {
+    // Arrange: a pruning chain that snapshots every 20 blocks, long enough to retarget
+    const uint32_t easyPowLimit = 0x207fffff;
+    std::string path = (std::filesystem::temp_directory_path() / "blockchain_snapshot_test.dat").string();
+    Blockchain source(easyPowLimit);
+    source.setMiningThreads(1);
+    source.setPruneDepth(8);
+    source.setSnapshotPath(path);
+    source.setSnapshotInterval(20);
+    std::string prunedHash;
+    for (size_t height = 1; height < 45; ++height) {
+        int64_t timestamp = source.getLastBlock().getTimestamp() + source.getTargetBlockSeconds() / 2;
+        source.addBlock(Block({Transaction("Alice", "Carol", 5.0, 0.05, {5.0, 5.0, 5.0})}, source.getLastBlockHash(), timestamp));
+        if (height == 5) {
+            prunedHash = source.getLastBlockHash();
+        }
+    }
+
+    // Old bodies are gone, but their headers still validate
+    EXPECT_EQ(source.getPrunedHeight(), 45u - 8u);
+    EXPECT_THROW(source.getBlock(5), std::out_of_range);
+    EXPECT_FALSE(source.findBlock(prunedHash).has_value());
+    EXPECT_TRUE(source.hasBlock(prunedHash));
+    EXPECT_TRUE(source.isValid());
+
+    // A branch forking below the pruned blocks can't be undone onto, so it's refused
+    Block fork({Transaction("Bob", "Dave", 5.0, 0.05, {5.0, 5.0, 5.0})}, prunedHash);
+    fork.mineBlock(targetFromCompact(easyPowLimit), Wallet("Fork Miner"), 1, 10.0);
+    EXPECT_FALSE(source.submitBlock(fork));
+
+    // Act: a new node starts from the snapshot at height 40 and imports the blocks after it
+    StateSnapshot snapshot = StateSnapshot::read(path);
+    Blockchain fresh(snapshot, easyPowLimit);
+    std::vector<std::string> records;
+    for (size_t height = snapshot.height + 1; height < source.getLength(); ++height) {
+        records.push_back(BlockView::encode(source.getBlock(height)));
+    }
+    size_t accepted = fresh.importBlocks(records);
+
+    // Assert
+    EXPECT_EQ(snapshot.height, 40u);
+    EXPECT_EQ(accepted, records.size());
+    EXPECT_EQ(fresh.getLength(), source.getLength());
+    EXPECT_EQ(fresh.getLastBlockHash(), source.getLastBlockHash());
+    EXPECT_EQ(fresh.getNextTarget(), source.getNextTarget());
+    EXPECT_EQ(fresh.getBalance("Carol"), source.getBalance("Carol"));
+    EXPECT_EQ(fresh.getBalance("Alice"), source.getBalance("Alice"));
+    EXPECT_TRUE(fresh.isValid());
+
+    // A snapshot damaged on disk is rejected by its checksum
+    std::string bytes;
+    {
+        std::ifstream file(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    bytes[bytes.size() / 2] ^= 0x01;
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    }
+    EXPECT_THROW(StateSnapshot::read(path), std::runtime_error);
+    std::filesystem::remove(path);
+}
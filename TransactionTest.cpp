@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
+#include <random>
 #include <vector>
 #include <string>
 #include "Transaction.h"
@@ -107,3 +108,40 @@ TEST(TransactionTest, SplitTransaction) {
         ASSERT_EQ(splitTransactions[i].getSenderSent(), senderSent);
     }
 }
+
+// Test that batch validation returns the same verdict as isValid() for every transaction
+TEST(TransactionTest, BatchValidationMatchesIsValid) {
+    std::mt19937 rng(12345);
+    std::uniform_int_distribution<int> senderDist(0, 49);
+    std::uniform_int_distribution<int> historyDist(0, 7);
+    std::uniform_real_distribution<double> valueDist(0.0, 20.0);
+    std::vector<Transaction> transactions;
+    for (int i = 0; i < 20000; ++i) {
+        std::string sender = "sender" + std::to_string(senderDist(rng));
+        std::string recipient = i % 97 == 0 ? sender : "recipient" + std::to_string(i % 13);
+        std::vector<double> senderSent(historyDist(rng));
+        double base = valueDist(rng);
+        for (auto& sent : senderSent) {
+            // Mix near-constant histories, which pass the variance check, with noisy ones that don't
+            sent = i % 2 == 0 ? base + 0.01 * valueDist(rng) : valueDist(rng);
+        }
+        Transaction transaction(sender, recipient, i % 31 == 0 ? -1.0 : base * (i % 3 == 0 ? 0.5 : 1.05), 0.01, senderSent);
+        if (i % 11 == 0) {
+            transaction.setRecipientList({"recipient" + std::to_string(i % 13), "someone else"});
+        }
+        transactions.push_back(transaction);
+    }
+
+    std::vector<uint8_t> singleThreaded = TransactionBatchValidator(transactions).validate(1);
+    std::vector<uint8_t> multiThreaded = TransactionBatchValidator(transactions).validate(4);
+
+    ASSERT_EQ(singleThreaded.size(), transactions.size());
+    size_t validCount = 0;
+    for (size_t i = 0; i < transactions.size(); ++i) {
+        ASSERT_EQ(singleThreaded[i] != 0, transactions[i].isValid()) << "transaction " << i;
+        ASSERT_EQ(multiThreaded[i], singleThreaded[i]) << "transaction " << i;
+        validCount += singleThreaded[i];
+    }
+    EXPECT_GT(validCount, 0u);
+    EXPECT_LT(validCount, transactions.size());
+}
@@ -117,3 +117,48 @@ TEST(Wallet, ReceiveMoneySingleTransaction) {
     ASSERT_EQ(receiver.GetBalance(), 1500);
     ASSERT_EQ(receiver.GetTransactionHistory().size(), 2);
 }
+
+TEST(Wallet, ReceiveMoneyIgnoresReplayedTransaction) {
+    Wallet receiver("Bob", 0.0);
+    Transaction transaction("Alice", "Bob", 10.0, 0.05);
+    transaction.setDate("2023-04-23 11:00:00");
+
+    receiver.receiveMoney({transaction});
+    receiver.receiveMoney({transaction, transaction});
+
+    // Replays are rejected, but a distinct transaction for the same amount is accepted
+    ASSERT_EQ(receiver.getBalance(), 10.0);
+    ASSERT_EQ(receiver.getTransactionCount(), 1);
+    Transaction another("Alice", "Bob", 10.0, 0.05);
+    another.setDate("2023-04-23 11:00:01");
+    receiver.receiveMoney({another});
+    ASSERT_EQ(receiver.getBalance(), 20.0);
+    ASSERT_EQ(receiver.getTransactionCount(), 2);
+}
+
+TEST(Wallet, TransactionsInRangeAndHistoryPages) {
+    Wallet receiver("Bob", 0.0);
+    std::vector<std::string> dates = {"2023-04-20 09:00:00", "2023-04-21 09:00:00", "2023-04-22 09:00:00", "2023-04-23 09:00:00"};
+    for (size_t i = 0; i < dates.size(); ++i) {
+        Transaction transaction("Alice", "Bob", 1.0 + i, 0.05);
+        transaction.setDate(dates[i]);
+        receiver.receiveMoney({transaction});
+    }
+
+    // Range queries go through the epoch index and include both ends
+    std::vector<Transaction> inRange = receiver.getTransactionsInRange("2023-04-21 09:00:00", "2023-04-22 09:00:00");
+    ASSERT_EQ(inRange.size(), 2);
+    ASSERT_EQ(inRange[0].getAmount(), 2.0);
+    ASSERT_EQ(inRange[1].getAmount(), 3.0);
+    ASSERT_EQ(inRange[0].getTimestamp(), Transaction::parseTimestamp("2023-04-21 09:00:00"));
+
+    // History pages run from the newest receipt backwards
+    std::vector<Transaction> latest = receiver.getTransactionHistory(2);
+    ASSERT_EQ(latest.size(), 2);
+    ASSERT_EQ(latest[0].getAmount(), 4.0);
+    ASSERT_EQ(latest[1].getAmount(), 3.0);
+    std::vector<Transaction> nextPage = receiver.getTransactionHistory(2, 2);
+    ASSERT_EQ(nextPage.size(), 2);
+    ASSERT_EQ(nextPage[0].getAmount(), 2.0);
+    ASSERT_EQ(receiver.getTransactionHistory(-1, 3).size(), 1);
+}
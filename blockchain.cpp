@@ -1,549 +1,5945 @@
 #include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
 #include <ctime>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <numeric>
+#include <optional>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <poll.h>
+#include <set>
+#include <shared_mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BLOCKCHAIN_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+using Hash256 = std::array<unsigned char, SHA256_DIGEST_LENGTH>;
+
+inline std::string toHex(const Hash256& digest) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(digest.size() * 2, '0');
+    for (size_t i = 0; i < digest.size(); ++i) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0x0F];
+    }
+    return hex;
+}
+
+// Whether hex is exactly toHex(digest), without building the string
+inline bool equalsHex(const Hash256& digest, std::string_view hex) {
+    static const char digits[] = "0123456789abcdef";
+    if (hex.size() != digest.size() * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < digest.size(); ++i) {
+        if (hex[2 * i] != digits[digest[i] >> 4] || hex[2 * i + 1] != digits[digest[i] & 0x0F]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline Hash256 sha256Digest(const std::string& str) {
+    Hash256 digest;
+    SHA256_CTX sha256;
+    SHA256_Init(&sha256);
+    SHA256_Update(&sha256, str.c_str(), str.size());
+    SHA256_Final(digest.data(), &sha256);
+    return digest;
+}
+
+inline Hash256 hashFromHex(const std::string& hex) {
+    // Decode a 64 character hex hash, anything else (e.g. the genesis "0") is mapped through SHA-256
+    auto nibble = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    Hash256 digest;
+    if (hex.size() == digest.size() * 2) {
+        bool valid = true;
+        for (size_t i = 0; i < digest.size() && valid; ++i) {
+            int high = nibble(hex[2 * i]);
+            int low = nibble(hex[2 * i + 1]);
+            valid = high >= 0 && low >= 0;
+            digest[i] = static_cast<unsigned char>((high << 4) | low);
+        }
+        if (valid) {
+            return digest;
+        }
+    }
+    return sha256Digest(hex);
+}
+
+// Largest digest that still has `difficulty` leading zero hex digits
+inline Hash256 targetFromDifficulty(int difficulty) {
+    Hash256 target;
+    target.fill(0xFF);
+    difficulty = std::max(0, std::min(difficulty, static_cast<int>(target.size() * 2)));
+    for (int i = 0; i < difficulty; ++i) {
+        target[i / 2] &= (i % 2 == 0) ? 0x0F : 0x00;
+    }
+    return target;
+}
+
+// Targets are kept in the compact form used by Bitcoin's nBits: the top byte is the length of
+// the target in bytes and the low 23 bits are its three most significant bytes. That gives
+// 2^-16 resolution at any size instead of the 16x steps of counting leading zero digits.
+inline Hash256 targetFromCompact(uint32_t compact) {
+    Hash256 target{};
+    int size = static_cast<int>(compact >> 24);
+    uint32_t mantissa = compact & 0x007FFFFF;
+    for (int i = 0; i < 3; ++i) {
+        int position = static_cast<int>(target.size()) - size + i;
+        if (position >= 0 && position < static_cast<int>(target.size())) {
+            target[position] = static_cast<unsigned char>(mantissa >> (8 * (2 - i)));
+        }
+    }
+    return target;
+}
+
+// Compact form of target, rounded down so the result is never easier than target
+inline uint32_t compactFromTarget(const Hash256& target) {
+    size_t first = 0;
+    while (first < target.size() && target[first] == 0) {
+        ++first;
+    }
+    uint32_t size = static_cast<uint32_t>(target.size() - first);
+    uint32_t mantissa = 0;
+    for (size_t i = first; i < first + 3; ++i) {
+        mantissa = (mantissa << 8) | (i < target.size() ? target[i] : 0);
+    }
+    // The top mantissa bit is a sign bit in the nBits format, so move it into the next byte
+    if (mantissa & 0x00800000) {
+        mantissa >>= 8;
+        size++;
+    }
+    return (size << 24) | mantissa;
+}
+
+inline uint32_t compactFromDifficulty(int difficulty) {
+    return compactFromTarget(targetFromDifficulty(difficulty));
+}
+
+// The target as a number, exact since the mantissa has fewer bits than a double
+inline double targetValue(uint32_t compact) {
+    return std::ldexp(static_cast<double>(compact & 0x007FFFFF), 8 * (static_cast<int>(compact >> 24) - 3));
+}
+
+// Compact form of a target given as a number, rounded down
+inline uint32_t compactFromValue(double value) {
+    if (value < 1.0) {
+        return 0;
+    }
+    int exponent;
+    std::frexp(value, &exponent);
+    int size = (exponent + 7) / 8;
+    auto mantissa = static_cast<uint32_t>(std::ldexp(value, -8 * (size - 3)));
+    if (mantissa & 0x00800000) {
+        mantissa >>= 8;
+        size++;
+    }
+    return (static_cast<uint32_t>(size) << 24) | mantissa;
+}
+
+inline bool meetsTarget(const Hash256& digest, const Hash256& target) {
+    return std::memcmp(digest.data(), target.data(), digest.size()) <= 0;
+}
+
+// Hash256 values are already uniformly distributed, so the first bytes make a good hash table key
+struct Hash256Hasher {
+    size_t operator()(const Hash256& hash) const {
+        size_t value;
+        std::memcpy(&value, hash.data(), sizeof(value));
+        return value;
+    }
+};
+
+// SipHash-2-4, a keyed hash that is fast on short inputs. Compact block relay uses it for short
+// transaction ids, keyed by the block so ids can't be ground in advance to collide.
+inline uint64_t sipHash24(uint64_t k0, uint64_t k1, const unsigned char* data, size_t size) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    auto rotate = [](uint64_t x, int bits) { return (x << bits) | (x >> (64 - bits)); };
+    auto round = [&] {
+        v0 += v1; v1 = rotate(v1, 13); v1 ^= v0; v0 = rotate(v0, 32);
+        v2 += v3; v3 = rotate(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotate(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotate(v1, 17); v1 ^= v2; v2 = rotate(v2, 32);
+    };
+    size_t blocksEnd = size - size % 8;
+    for (size_t i = 0; i < blocksEnd; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        v3 ^= word;
+        round();
+        round();
+        v0 ^= word;
+    }
+    uint64_t last = static_cast<uint64_t>(size) << 56;
+    for (size_t i = blocksEnd; i < size; ++i) {
+        last |= static_cast<uint64_t>(data[i]) << (8 * (i - blocksEnd));
+    }
+    v3 ^= last;
+    round();
+    round();
+    v0 ^= last;
+    v2 ^= 0xFF;
+    for (int i = 0; i < 4; ++i) {
+        round();
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Integers in the binary record formats are LEB128 varints, seven bits per byte with the high bit
+// set on every byte but the last. Signed values are zigzag mapped first, so small negative numbers
+// stay short too.
+inline size_t varintSize(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+inline uint64_t zigzagEncode(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t zigzagDecode(uint64_t value) {
+    return static_cast<int64_t>((value >> 1) ^ (~(value & 1) + 1));
+}
+
+inline void appendVarint(std::string& bytes, uint64_t value) {
+    while (value >= 0x80) {
+        bytes.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    bytes.push_back(static_cast<char>(value));
+}
+
+// Cursor over an encoded record. A read past the end returns zeros and sets failed instead of
+// touching memory outside the record, so malformed input from a peer is caught by checking failed
+// once at the end rather than before every field.
+struct ByteReader {
+    const unsigned char* position;
+    const unsigned char* end;
+    bool failed = false;
+
+    ByteReader(const unsigned char* begin, const unsigned char* end) : position(begin), end(end) {}
+
+    bool has(size_t count) {
+        if (failed || static_cast<size_t>(end - position) < count) {
+            failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    uint8_t readU8() { return has(1) ? *position++ : 0; }
+
+    uint32_t readU32() {
+        uint32_t value = 0;
+        if (has(sizeof(value))) {
+            std::memcpy(&value, position, sizeof(value));
+            position += sizeof(value);
+        }
+        return value;
+    }
+
+    double readDouble() {
+        double value = 0.0;
+        if (has(sizeof(value))) {
+            std::memcpy(&value, position, sizeof(value));
+            position += sizeof(value);
+        }
+        return value;
+    }
+
+    uint64_t readVarint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64 && has(1); shift += 7) {
+            uint8_t byte = *position++;
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        failed = true;
+        return 0;
+    }
+
+    int64_t readSignedVarint() { return zigzagDecode(readVarint()); }
+
+    std::string_view readBytes(size_t count) {
+        if (!has(count)) {
+            return std::string_view();
+        }
+        std::string_view bytes(reinterpret_cast<const char*>(position), count);
+        position += count;
+        return bytes;
+    }
+
+    std::string_view readString() { return readBytes(readVarint()); }
+
+    // Skip count items of itemSize bytes, without overflowing on a bogus count
+    void skip(uint64_t count, size_t itemSize) {
+        if (count > static_cast<uint64_t>(end - position) / itemSize) {
+            failed = true;
+            return;
+        }
+        position += count * itemSize;
+    }
+};
+
+// Leveled, structured logging that keeps formatting and I/O off the calling thread. An event is a
+// message literal plus a few typed fields, copied into a slot of a bounded lock-free ring buffer;
+// a background thread formats the events and writes them to the sink. Disabled levels return
+// before anything is copied, and when the ring is full events are dropped and counted rather
+// than blocking the caller.
+class Logger {
+public:
+    enum class Level : uint8_t { Debug, Info, Warning, Error, Off };
+
+    // One key=value pair. Strings are copied into the event when it's logged, so views are safe.
+    struct Field {
+        enum class Type : uint8_t { Int, Double, String };
+
+        Field(const char* key, int64_t value) : key(key), type(Type::Int), intValue(value) {}
+        Field(const char* key, uint64_t value) : key(key), type(Type::Int), intValue(static_cast<int64_t>(value)) {}
+        Field(const char* key, int value) : key(key), type(Type::Int), intValue(value) {}
+        Field(const char* key, double value) : key(key), type(Type::Double), doubleValue(value) {}
+        Field(const char* key, std::string_view value) : key(key), type(Type::String), stringValue(value) {}
+        Field(const char* key, const std::string& value) : key(key), type(Type::String), stringValue(value) {}
+        Field(const char* key, const char* value) : key(key), type(Type::String), stringValue(value) {}
+
+        const char* key;
+        Type type;
+        int64_t intValue = 0;
+        double doubleValue = 0.0;
+        std::string_view stringValue;
+    };
+
+    static constexpr size_t capacity = 8192;
+    static constexpr size_t maxFields = 6;
+    static constexpr size_t textCapacity = 192;
+
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    ~Logger() {
+        m_stop.store(true);
+        m_writer.join();
+    }
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    void setLevel(Level level) { m_level.store(level, std::memory_order_relaxed); }
+    Level getLevel() const { return m_level.load(std::memory_order_relaxed); }
+    bool isEnabled(Level level) const { return level >= m_level.load(std::memory_order_relaxed) && level != Level::Off; }
+
+    // Where formatted lines go, std::clog by default. Call flush() first so earlier events still reach the old sink.
+    void setSink(std::ostream& sink) { m_sink.store(&sink); }
+
+    // Events dropped because the ring buffer was full
+    uint64_t getDroppedCount() const { return m_dropped.load(std::memory_order_relaxed); }
+
+    // message must outlive the event, which in practice means a string literal
+    void log(Level level, const char* message, std::initializer_list<Field> fields = {}) {
+        if (!isEnabled(level)) {
+            return;
+        }
+
+        // Claim a slot, as in Vyukov's bounded MPMC queue
+        size_t position = m_enqueuePosition.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &m_slots[position & (capacity - 1)];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (m_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                position = m_enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+
+        // Copy the event into the slot, truncating strings that don't fit
+        slot->level = level;
+        slot->time = std::chrono::system_clock::now();
+        slot->message = message;
+        slot->fieldCount = 0;
+        size_t textUsed = 0;
+        for (const Field& field : fields) {
+            if (slot->fieldCount == maxFields) {
+                break;
+            }
+            StoredField& stored = slot->fields[slot->fieldCount++];
+            stored.key = field.key;
+            stored.type = field.type;
+            stored.intValue = field.intValue;
+            stored.doubleValue = field.doubleValue;
+            if (field.type == Field::Type::String) {
+                size_t length = std::min(field.stringValue.size(), textCapacity - textUsed);
+                std::memcpy(slot->text + textUsed, field.stringValue.data(), length);
+                stored.textOffset = static_cast<uint16_t>(textUsed);
+                stored.textLength = static_cast<uint16_t>(length);
+                textUsed += length;
+            }
+        }
+        slot->sequence.store(position + 1, std::memory_order_release);
+    }
+
+    // Block until every event logged so far has been written to the sink
+    void flush() {
+        size_t target = m_enqueuePosition.load();
+        while (m_dequeuePosition.load() < target) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        std::lock_guard<std::mutex> lock(m_sinkMutex);
+        m_sink.load()->flush();
+    }
+
+private:
+    struct StoredField {
+        const char* key;
+        Field::Type type;
+        int64_t intValue;
+        double doubleValue;
+        uint16_t textOffset;
+        uint16_t textLength;
+    };
+
+    struct Slot {
+        std::atomic<size_t> sequence;
+        Level level;
+        std::chrono::system_clock::time_point time;
+        const char* message;
+        size_t fieldCount;
+        StoredField fields[maxFields];
+        char text[textCapacity];
+    };
+
+    std::unique_ptr<Slot[]> m_slots;
+    alignas(64) std::atomic<size_t> m_enqueuePosition{0};
+    alignas(64) std::atomic<size_t> m_dequeuePosition{0};
+    std::atomic<uint64_t> m_dropped{0};
+    std::atomic<Level> m_level{Level::Info};
+    std::atomic<std::ostream*> m_sink{&std::clog};
+    std::mutex m_sinkMutex;
+    std::atomic<bool> m_stop{false};
+    std::thread m_writer;
+
+    Logger() : m_slots(new Slot[capacity]) {
+        for (size_t i = 0; i < capacity; ++i) {
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        m_writer = std::thread([this] { run(); });
+    }
+
+    static const char* levelName(Level level) {
+        switch (level) {
+            case Level::Debug: return "DEBUG";
+            case Level::Info: return "INFO";
+            case Level::Warning: return "WARNING";
+            case Level::Error: return "ERROR";
+            default: return "OFF";
+        }
+    }
+
+    // Writer thread: drain whatever is ready, flush once per batch, and sleep briefly when idle
+    void run() {
+        std::string line;
+        for (;;) {
+            bool stopping = m_stop.load();
+            size_t written = 0;
+            {
+                std::lock_guard<std::mutex> lock(m_sinkMutex);
+                std::ostream& sink = *m_sink.load();
+                for (;;) {
+                    size_t position = m_dequeuePosition.load(std::memory_order_relaxed);
+                    Slot& slot = m_slots[position & (capacity - 1)];
+                    if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+                        break;
+                    }
+                    format(slot, line);
+                    sink << line;
+                    slot.sequence.store(position + capacity, std::memory_order_release);
+                    m_dequeuePosition.store(position + 1);
+                    written++;
+                }
+                if (written > 0) {
+                    sink.flush();
+                }
+            }
+            if (stopping && written == 0) {
+                return;
+            }
+            if (written == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    // "2023-04-23 11:00:00.000123 INFO message key=value ..." followed by a newline
+    static void format(const Slot& slot, std::string& line) {
+        std::time_t seconds = std::chrono::system_clock::to_time_t(slot.time);
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(slot.time.time_since_epoch()).count() % 1000000;
+        std::tm time = {};
+        localtime_r(&seconds, &time);
+        std::ostringstream ss;
+        ss << std::put_time(&time, "%Y-%m-%d %H:%M:%S") << '.' << std::setw(6) << std::setfill('0') << micros << std::setfill(' ');
+        ss << ' ' << levelName(slot.level) << ' ' << slot.message;
+        for (size_t i = 0; i < slot.fieldCount; ++i) {
+            const StoredField& field = slot.fields[i];
+            ss << ' ' << field.key << '=';
+            switch (field.type) {
+                case Field::Type::Int: ss << field.intValue; break;
+                case Field::Type::Double: ss << field.doubleValue; break;
+                case Field::Type::String: ss.write(slot.text + field.textOffset, field.textLength); break;
+            }
+        }
+        ss << '\n';
+        line = ss.str();
+    }
+};
+
+// Process-wide counters, gauges and histograms, exported in the Prometheus text format. Counters
+// and histograms are sharded by thread: each thread updates its own cache line, so hot loops like
+// mining never contend, and the shards are only summed when the metrics are read. A metric is
+// registered once by name and lives for the rest of the process, so call sites keep a reference.
+class Metrics {
+public:
+    static constexpr size_t shardCount = 16;
+
+    class Counter {
+    public:
+        void add(uint64_t amount = 1) {
+            m_shards[shardIndex()].value.fetch_add(amount, std::memory_order_relaxed);
+        }
+
+        uint64_t value() const {
+            uint64_t total = 0;
+            for (const auto& shard : m_shards) {
+                total += shard.value.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+    private:
+        struct alignas(64) Shard {
+            std::atomic<uint64_t> value{0};
+        };
+        std::array<Shard, shardCount> m_shards;
+    };
+
+    class Gauge {
+    public:
+        void set(double value) { m_value.store(value, std::memory_order_relaxed); }
+        double value() const { return m_value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<double> m_value{0.0};
+    };
+
+    // Counts observations into buckets with the given upper bounds, plus an implicit +Inf bucket
+    class Histogram {
+    public:
+        explicit Histogram(std::vector<double> bounds) : m_bounds(std::move(bounds)), m_shards(new Shard[shardCount]) {
+            std::sort(m_bounds.begin(), m_bounds.end());
+            for (size_t i = 0; i < shardCount; ++i) {
+                m_shards[i].counts.reset(new std::atomic<uint64_t>[m_bounds.size() + 1]());
+            }
+        }
+
+        void observe(double value) {
+            Shard& shard = m_shards[shardIndex()];
+            size_t bucket = std::lower_bound(m_bounds.begin(), m_bounds.end(), value) - m_bounds.begin();
+            shard.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+            // Threads only share a shard once there are more than shardCount of them, so this rarely loops
+            double sum = shard.sum.load(std::memory_order_relaxed);
+            while (!shard.sum.compare_exchange_weak(sum, sum + value, std::memory_order_relaxed)) {
+            }
+        }
+
+        // Observations at or below each bound, then the total count for +Inf
+        std::vector<uint64_t> getCumulativeCounts() const {
+            std::vector<uint64_t> counts(m_bounds.size() + 1, 0);
+            for (size_t i = 0; i < shardCount; ++i) {
+                for (size_t bucket = 0; bucket < counts.size(); ++bucket) {
+                    counts[bucket] += m_shards[i].counts[bucket].load(std::memory_order_relaxed);
+                }
+            }
+            std::partial_sum(counts.begin(), counts.end(), counts.begin());
+            return counts;
+        }
+
+        double getSum() const {
+            double total = 0.0;
+            for (size_t i = 0; i < shardCount; ++i) {
+                total += m_shards[i].sum.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+        uint64_t getCount() const { return getCumulativeCounts().back(); }
+        const std::vector<double>& getBounds() const { return m_bounds; }
+
+        // Observes the seconds between its construction and destruction
+        class Timer {
+        public:
+            explicit Timer(Histogram& histogram) : m_histogram(histogram), m_start(std::chrono::steady_clock::now()) {}
+            ~Timer() { m_histogram.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count()); }
+
+        private:
+            Histogram& m_histogram;
+            std::chrono::steady_clock::time_point m_start;
+        };
+
+    private:
+        struct alignas(64) Shard {
+            std::atomic<double> sum{0.0};
+            std::unique_ptr<std::atomic<uint64_t>[]> counts;
+        };
+        std::vector<double> m_bounds;
+        std::unique_ptr<Shard[]> m_shards;
+    };
+
+    // Bucket bounds in seconds for latencies from 100us to 10s
+    static std::vector<double> latencyBuckets() {
+        return {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0};
+    }
+
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    // Each returns the metric registered under name, creating it on first use. Asking for an
+    // existing name as a different type throws std::logic_error.
+    Counter& counter(const std::string& name, const std::string& help) {
+        return *getEntry(name, help, Type::Counter, [](Entry& entry) { entry.counter = std::make_unique<Counter>(); }).counter;
+    }
+
+    Gauge& gauge(const std::string& name, const std::string& help) {
+        return *getEntry(name, help, Type::Gauge, [](Entry& entry) { entry.gauge = std::make_unique<Gauge>(); }).gauge;
+    }
+
+    Histogram& histogram(const std::string& name, const std::string& help, std::vector<double> bounds = latencyBuckets()) {
+        return *getEntry(name, help, Type::Histogram, [&](Entry& entry) { entry.histogram = std::make_unique<Histogram>(std::move(bounds)); }).histogram;
+    }
+
+    // Every metric in the Prometheus text exposition format, sorted by name
+    std::string exportText() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::ostringstream ss;
+        ss << std::setprecision(12);
+        for (const auto& [name, entry] : m_entries) {
+            ss << "# HELP " << name << ' ' << entry.help << '\n';
+            switch (entry.type) {
+                case Type::Counter:
+                    ss << "# TYPE " << name << " counter\n" << name << ' ' << entry.counter->value() << '\n';
+                    break;
+                case Type::Gauge:
+                    ss << "# TYPE " << name << " gauge\n" << name << ' ' << entry.gauge->value() << '\n';
+                    break;
+                case Type::Histogram: {
+                    ss << "# TYPE " << name << " histogram\n";
+                    const std::vector<double>& bounds = entry.histogram->getBounds();
+                    std::vector<uint64_t> counts = entry.histogram->getCumulativeCounts();
+                    for (size_t i = 0; i < bounds.size(); ++i) {
+                        ss << name << "_bucket{le=\"" << bounds[i] << "\"} " << counts[i] << '\n';
+                    }
+                    ss << name << "_bucket{le=\"+Inf\"} " << counts.back() << '\n';
+                    ss << name << "_sum " << entry.histogram->getSum() << '\n';
+                    ss << name << "_count " << counts.back() << '\n';
+                    break;
+                }
+            }
+        }
+        return ss.str();
+    }
+
+    // Write exportText to path, e.g. for node_exporter's textfile collector. The text goes to a
+    // temporary file that is then renamed over path, so readers never see a partial export.
+    void writeToFile(const std::string& path) const {
+        std::string temporaryPath = path + ".tmp";
+        {
+            std::ofstream file(temporaryPath, std::ios::trunc);
+            file << exportText();
+            if (!file) {
+                throw std::runtime_error("Failed to write metrics to " + temporaryPath);
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporaryPath, path, error);
+        if (error) {
+            throw std::runtime_error("Failed to replace metrics file " + path);
+        }
+    }
+
+private:
+    enum class Type { Counter, Gauge, Histogram };
+
+    struct Entry {
+        Type type;
+        std::string help;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+
+    mutable std::mutex m_mutex;
+    std::map<std::string, Entry> m_entries;
+
+    Metrics() = default;
+
+    // The entry registered under name. A new entry gets its metric from create before it's inserted,
+    // within the same critical section, so exportText never sees an entry without one.
+    template <typename Create>
+    Entry& getEntry(const std::string& name, const std::string& help, Type type, Create create) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(name);
+        if (it == m_entries.end()) {
+            Entry entry{type, help, nullptr, nullptr, nullptr};
+            create(entry);
+            return m_entries.emplace(name, std::move(entry)).first->second;
+        }
+        if (it->second.type != type) {
+            throw std::logic_error("Metric " + name + " is already registered with another type");
+        }
+        return it->second;
+    }
+
+    // Threads are assigned shards round robin the first time they update a metric
+    static size_t shardIndex() {
+        static std::atomic<size_t> nextShard{0};
+        thread_local size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % shardCount;
+        return shard;
+    }
+};
+
+// Open a TCP socket listening on the loopback interface. Port 0 picks a free port, and port is set
+// to the one actually bound.
+inline int listenOnLoopback(uint16_t& port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create socket");
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    socklen_t length = sizeof(address);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(fd, 16) < 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) < 0) {
+        close(fd);
+        throw std::runtime_error("Failed to listen on port " + std::to_string(port));
+    }
+    port = ntohs(address.sin_port);
+    return fd;
+}
+
+// Serves Metrics::exportText over HTTP on a loopback port, for a Prometheus server to scrape. Every
+// request gets the same page, so requests are read but not parsed.
+class MetricsServer {
+public:
+    // Port 0 picks a free port, see getPort
+    explicit MetricsServer(uint16_t port = 0) : m_port(port) {
+        m_listenFd = listenOnLoopback(m_port);
+        m_thread = std::thread([this] { run(); });
+    }
+
+    ~MetricsServer() {
+        m_stop.store(true);
+        m_thread.join();
+        close(m_listenFd);
+    }
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    uint16_t getPort() const { return m_port; }
+
+private:
+    int m_listenFd;
+    uint16_t m_port;
+    std::atomic<bool> m_stop{false};
+    std::thread m_thread;
+
+    // Accept connections one at a time, waking up regularly to check for shutdown
+    void run() {
+        while (!m_stop.load()) {
+            pollfd listener = {m_listenFd, POLLIN, 0};
+            if (poll(&listener, 1, 100) <= 0) {
+                continue;
+            }
+            int fd = accept(m_listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                continue;
+            }
+            char request[4096];
+            pollfd client = {fd, POLLIN, 0};
+            if (poll(&client, 1, 1000) > 0) {
+                ssize_t ignored = recv(fd, request, sizeof(request), 0);
+                (void) ignored;
+            }
+            std::string body = Metrics::instance().exportText();
+            std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                                   std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+            for (size_t sent = 0; sent < response.size();) {
+                ssize_t written = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (written <= 0) {
+                    break;
+                }
+                sent += static_cast<size_t>(written);
+            }
+            close(fd);
+        }
+    }
+};
+
+// Interns addresses as dense 32-bit ids, so transactions and account state compare and index by
+// integer instead of carrying their own copies of the strings. One process-wide table is shared by
+// every Transaction: interning takes a lock, but an interned address never moves or changes, so
+// getAddress reads it back without one.
+class AddressTable {
+public:
+    static constexpr uint32_t invalidId = std::numeric_limits<uint32_t>::max();
+
+    static AddressTable& global() {
+        static AddressTable table;
+        return table;
+    }
+
+    uint32_t intern(std::string_view address) {
+        {
+            std::shared_lock<std::shared_mutex> lock(m_mutex);
+            uint32_t id = findLocked(address);
+            if (id != invalidId) {
+                return id;
+            }
+        }
+
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        uint32_t id = findLocked(address);
+        if (id != invalidId) {
+            return id;
+        }
+        id = m_size.load(std::memory_order_relaxed);
+        if ((id >> chunkBits) >= maxChunks) {
+            throw std::runtime_error("Address table is full");
+        }
+        std::unique_ptr<std::string[]>& chunk = m_chunks[id >> chunkBits];
+        if (!chunk) {
+            chunk.reset(new std::string[chunkSize]);
+        }
+        chunk[id & (chunkSize - 1)] = std::string(address);
+        if ((static_cast<size_t>(id) + 1) * 2 > m_slots.size()) {
+            grow(id);
+        }
+        insertSlot(id);
+        m_size.store(id + 1, std::memory_order_release);
+        return id;
+    }
+
+    uint32_t find(std::string_view address) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return findLocked(address);
+    }
+
+    const std::string& getAddress(uint32_t id) const {
+        if (id >= m_size.load(std::memory_order_acquire)) {
+            throw std::out_of_range("Unknown address id");
+        }
+        return addressAt(id);
+    }
+
+    size_t size() const { return m_size.load(std::memory_order_acquire); }
+
+private:
+    // Addresses live in fixed-size chunks that are never reallocated, so a reader only races with
+    // the writer on ids it can't have been handed yet
+    static constexpr uint32_t chunkBits = 16;
+    static constexpr uint32_t chunkSize = uint32_t(1) << chunkBits;
+    static constexpr uint32_t maxChunks = uint32_t(1) << (32 - chunkBits);
+
+    std::array<std::unique_ptr<std::string[]>, maxChunks> m_chunks;
+    std::atomic<uint32_t> m_size{0};
+    std::vector<uint32_t> m_slots; // id + 1, or 0 for an empty slot
+    mutable std::shared_mutex m_mutex;
+
+    const std::string& addressAt(uint32_t id) const { return m_chunks[id >> chunkBits][id & (chunkSize - 1)]; }
+
+    uint32_t findLocked(std::string_view address) const {
+        if (m_slots.empty()) {
+            return invalidId;
+        }
+        size_t mask = m_slots.size() - 1;
+        for (size_t slot = std::hash<std::string_view>()(address) & mask; m_slots[slot] != 0; slot = (slot + 1) & mask) {
+            uint32_t id = m_slots[slot] - 1;
+            if (addressAt(id) == address) {
+                return id;
+            }
+        }
+        return invalidId;
+    }
+
+    void insertSlot(uint32_t id) {
+        size_t mask = m_slots.size() - 1;
+        size_t slot = std::hash<std::string_view>()(addressAt(id)) & mask;
+        while (m_slots[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        m_slots[slot] = id + 1;
+    }
+
+    void grow(uint32_t count) {
+        m_slots.assign(std::max<size_t>(16, m_slots.size() * 2), 0);
+        for (uint32_t id = 0; id < count; ++id) {
+            insertSlot(id);
+        }
+    }
+};
+
+// Ed25519 signatures through OpenSSL. Keys and signatures are kept as raw bytes, so they copy and
+// compare like any other value. The address of a key pair is its public key in lowercase hex.
+class Ed25519 {
+public:
+    using PublicKey = std::array<unsigned char, 32>;
+    using PrivateKey = std::array<unsigned char, 32>;
+    using Signature = std::array<unsigned char, 64>;
+
+    static void generate(PrivateKey& privateKey, PublicKey& publicKey) {
+        EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, nullptr);
+        EVP_PKEY* key = nullptr;
+        bool generated = ctx && EVP_PKEY_keygen_init(ctx) == 1 && EVP_PKEY_keygen(ctx, &key) == 1;
+        size_t privateSize = privateKey.size();
+        size_t publicSize = publicKey.size();
+        generated = generated && EVP_PKEY_get_raw_private_key(key, privateKey.data(), &privateSize) == 1 &&
+                    EVP_PKEY_get_raw_public_key(key, publicKey.data(), &publicSize) == 1;
+        EVP_PKEY_free(key);
+        EVP_PKEY_CTX_free(ctx);
+        if (!generated) {
+            throw std::runtime_error("Failed to generate an Ed25519 key pair");
+        }
+    }
+
+    static Signature sign(const PrivateKey& privateKey, const unsigned char* message, size_t size) {
+        EVP_PKEY* key = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, nullptr, privateKey.data(), privateKey.size());
+        EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+        Signature signature;
+        size_t signatureSize = signature.size();
+        bool signedMessage = key && ctx && EVP_DigestSignInit(ctx, nullptr, nullptr, nullptr, key) == 1 &&
+                             EVP_DigestSign(ctx, signature.data(), &signatureSize, message, size) == 1;
+        EVP_MD_CTX_free(ctx);
+        EVP_PKEY_free(key);
+        if (!signedMessage) {
+            throw std::runtime_error("Failed to create an Ed25519 signature");
+        }
+        return signature;
+    }
+
+    static bool verify(const PublicKey& publicKey, const Signature& signature, const unsigned char* message, size_t size) {
+        EVP_PKEY* key = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, nullptr, publicKey.data(), publicKey.size());
+        EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+        bool verified = key && ctx && EVP_DigestVerifyInit(ctx, nullptr, nullptr, nullptr, key) == 1 &&
+                        EVP_DigestVerify(ctx, signature.data(), signature.size(), message, size) == 1;
+        EVP_MD_CTX_free(ctx);
+        EVP_PKEY_free(key);
+        return verified;
+    }
+
+    static std::string addressOf(const PublicKey& publicKey) {
+        return toHex(publicKey);
+    }
+
+    // The public key an address names, or nullopt if it isn't 64 lowercase hex digits
+    static std::optional<PublicKey> publicKeyOf(std::string_view address) {
+        PublicKey key;
+        if (address.size() != 2 * key.size()) {
+            return std::nullopt;
+        }
+        auto nibble = [](char c) { return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1; };
+        for (size_t i = 0; i < key.size(); ++i) {
+            int high = nibble(address[2 * i]);
+            int low = nibble(address[2 * i + 1]);
+            if (high < 0 || low < 0) {
+                return std::nullopt;
+            }
+            key[i] = static_cast<unsigned char>((high << 4) | low);
+        }
+        return key;
+    }
+};
+
+// Summary of the amounts an address has sent: everything the history checks of Transaction::isValid
+// need, in a fixed size however long the history grows
+struct SenderStats {
+    uint64_t count = 0;
+    double total = 0.0;
+    double mean = 0.0;
+    double m2 = 0.0; // Sum of squared deviations from the mean
+    double min = 0.0;
+    double max = 0.0;
+
+    // Add the next amount in O(1), with Welford's update of the mean and variance
+    void add(double amount) {
+        count++;
+        total += amount;
+        double delta = amount - mean;
+        mean += delta / count;
+        m2 += delta * (amount - mean);
+        min = count == 1 ? amount : std::min(min, amount);
+        max = count == 1 ? amount : std::max(max, amount);
+    }
+
+    // Population variance
+    double variance() const { return count > 0 ? m2 / count : 0.0; }
+
+    // Summary of a whole history, computed in two passes as isValid always has, so verdicts on a
+    // transaction's own history stay bit-for-bit the same
+    static SenderStats of(const std::vector<double>& amounts) {
+        SenderStats stats;
+        stats.count = amounts.size();
+        if (amounts.empty()) {
+            return stats;
+        }
+        stats.total = std::accumulate(amounts.begin(), amounts.end(), 0.0);
+        stats.mean = stats.total / stats.count;
+        for (double amount : amounts) {
+            stats.m2 += (amount - stats.mean) * (amount - stats.mean);
+        }
+        stats.min = *std::min_element(amounts.begin(), amounts.end());
+        stats.max = *std::max_element(amounts.begin(), amounts.end());
+        return stats;
+    }
+};
+
+// A transaction keeps its addresses as interned ids, its amounts in fixed-point units and its date as
+// an epoch timestamp. The recipient list and sender history are rarely set, so they live out of line
+// behind a shared pointer and copying a transaction never copies them.
 class Transaction {
 public:
-    Transaction(const std::string& sender, const std::string& recipient, double amount, double fee)
-        : m_sender(sender), m_recipient(recipient), m_amount(amount), m_fee(fee) {}
+    // Amounts are stored as integer multiples of 1e-8
+    static constexpr int64_t unitsPerCoin = 100000000;
+
+    Transaction(const std::string& sender, const std::string& recipient, double amount, double fee)
+        : m_senderId(AddressTable::global().intern(sender)), m_recipientId(AddressTable::global().intern(recipient)),
+          m_amount(toUnits(amount)), m_fee(toUnits(fee)) {}
+
+    Transaction(const std::string& sender, const std::string& recipient, double amount, double fee, std::vector<double> senderSent)
+        : Transaction(sender, recipient, amount, fee) {
+        setSenderSent(std::move(senderSent));
+    }
+
+    // A transaction between addresses that are already interned, e.g. when decoding a block
+    static Transaction fromInterned(uint32_t senderId, uint32_t recipientId, int64_t amountUnits, int64_t feeUnits, int64_t timestamp) {
+        return Transaction(senderId, recipientId, amountUnits, feeUnits, timestamp);
+    }
+
+    const std::string& getSender() const { return AddressTable::global().getAddress(m_senderId); }
+    const std::string& getRecipient() const { return AddressTable::global().getAddress(m_recipientId); }
+    uint32_t getSenderId() const { return m_senderId; }
+    uint32_t getRecipientId() const { return m_recipientId; }
+
+    double getAmount() const { return fromUnits(m_amount); }
+    double getFee() const { return fromUnits(m_fee); }
+    int64_t getAmountUnits() const { return m_amount; }
+    int64_t getFeeUnits() const { return m_fee; }
+
+    static int64_t toUnits(double amount) { return std::llround(amount * unitsPerCoin); }
+    static double fromUnits(int64_t units) { return static_cast<double>(units) / unitsPerCoin; }
+
+    // The "%Y-%m-%d %H:%M:%S" local date, or an empty string if the date was set to something unparsable
+    std::string getDate() const {
+        if (m_timestamp == std::numeric_limits<int64_t>::min()) {
+            return "";
+        }
+        return formatTimestamp(m_timestamp);
+    }
+    void setDate(const std::string& date) { m_timestamp = parseTimestamp(date); }
+
+    // Seconds since the epoch
+    int64_t getTimestamp() const { return m_timestamp; }
+    void setTimestamp(int64_t timestamp) { m_timestamp = timestamp; }
+
+    // Convert a "%Y-%m-%d %H:%M:%S" local date to seconds since the epoch, or the minimum int64_t if it doesn't parse
+    static int64_t parseTimestamp(const std::string& date) {
+        std::tm time = {};
+        std::istringstream ss(date);
+        ss >> std::get_time(&time, "%Y-%m-%d %H:%M:%S");
+        if (ss.fail()) {
+            return std::numeric_limits<int64_t>::min();
+        }
+        time.tm_isdst = -1;
+        return static_cast<int64_t>(std::mktime(&time));
+    }
+
+    const std::vector<std::string>& getRecipientList() const { return m_details ? m_details->recipientList : emptyDetails().recipientList; }
+    void setRecipientList(std::vector<std::string> recipientList) {
+        Details details = m_details ? *m_details : Details();
+        details.recipientList = std::move(recipientList);
+        setDetails(std::move(details));
+    }
+
+    const std::vector<double>& getSenderSent() const { return m_details ? m_details->senderSent : emptyDetails().senderSent; }
+    void setSenderSent(std::vector<double> sent) {
+        Details details = m_details ? *m_details : Details();
+        details.senderSent = std::move(sent);
+        setDetails(std::move(details));
+    }
+
+    // Ed25519 signature of calculateHash by the key the sender address names, if the transaction is signed.
+    // The hash doesn't cover the signature, so signing doesn't change the transaction's id.
+    const std::optional<Ed25519::Signature>& getSignature() const { return m_details ? m_details->signature : emptyDetails().signature; }
+    bool isSigned() const { return getSignature().has_value(); }
+    void setSignature(const Ed25519::Signature& signature) {
+        Details details = m_details ? *m_details : Details();
+        details.signature = signature;
+        setDetails(std::move(details));
+    }
+
+    // Sign with the private key of the sender address. Changing any field afterwards invalidates the signature.
+    void sign(const Ed25519::PrivateKey& privateKey) {
+        Hash256 id = calculateHash();
+        setSignature(Ed25519::sign(privateKey, id.data(), id.size()));
+    }
+
+    // Whether the transaction is signed by the key its sender address names. This is the expensive
+    // check; SignatureCache remembers its results.
+    bool verifySignature() const {
+        const std::optional<Ed25519::Signature>& signature = getSignature();
+        std::optional<Ed25519::PublicKey> publicKey = Ed25519::publicKeyOf(getSender());
+        if (!signature || !publicKey) {
+            return false;
+        }
+        Hash256 id = calculateHash();
+        return Ed25519::verify(*publicKey, *signature, id.data(), id.size());
+    }
+
+    // Exact size of the transaction's standalone record, as written by TransactionView::encode, which
+    // is what counts towards Block::maxBlockSize. It takes O(1): the recipient list and sender
+    // history are measured once, when they're set.
+    size_t getSize() const {
+        size_t addressCount = m_senderId == m_recipientId ? 1 : 2;
+        const std::string& sender = getSender();
+        size_t size = 1 + varintSize(addressCount) + 4 * addressCount + varintSize(sender.size()) + sender.size();
+        if (addressCount == 2) {
+            const std::string& recipient = getRecipient();
+            size += varintSize(recipient.size()) + recipient.size();
+        }
+        size += 2 + varintSize(zigzagEncode(m_amount)) + varintSize(zigzagEncode(m_fee)) + varintSize(zigzagEncode(m_timestamp));
+        size += m_details ? m_details->encodedSize : 3;
+        return size;
+    }
+
+    Hash256 calculateHash() const {
+        // Length-prefixed binary encoding of every field, so different transactions can't collide on
+        // concatenation. The fields are streamed into the digest, so hashing doesn't allocate.
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        updateString(ctx, getSender());
+        updateString(ctx, getRecipient());
+        updateU64(ctx, static_cast<uint64_t>(m_amount));
+        updateU64(ctx, static_cast<uint64_t>(m_fee));
+        updateU64(ctx, static_cast<uint64_t>(m_timestamp));
+        const std::vector<std::string>& recipientList = getRecipientList();
+        updateLength(ctx, recipientList.size());
+        for (const auto& recipient : recipientList) {
+            updateString(ctx, recipient);
+        }
+        const std::vector<double>& senderSent = getSenderSent();
+        updateLength(ctx, senderSent.size());
+        for (const auto& sent : senderSent) {
+            uint64_t bits;
+            std::memcpy(&bits, &sent, sizeof(bits));
+            updateU64(ctx, bits);
+        }
+        Hash256 digest;
+        SHA256_Final(digest.data(), &ctx);
+        return digest;
+    }
+
+    // Summary of getSenderSent, computed once when the history is set
+    const SenderStats& getSenderStats() const { return m_details ? m_details->senderStats : emptyDetails().senderStats; }
+
+    bool isValid() const {
+        return isValid(getSenderStats());
+    }
+
+    // The checks of isValid against a summary of the sender's history, such as the one ChainState
+    // keeps for every address, so their cost doesn't grow with the history
+    bool isValid(const SenderStats& history) const {
+        return isValid(history, history.total);
+    }
+
+    // As above, with the sender's funds given separately rather than taken from the total they have
+    // sent, e.g. their balance on the chain
+    bool isValid(const SenderStats& history, double funds) const {
+        double amount = getAmount();
+        const std::vector<std::string>& recipientList = getRecipientList();
+
+        // Check if the transaction amount is greater than zero
+        if (amount <= 0.0) {
+            return false;
+        }
+
+        // Check if the sender has enough funds to send the transaction amount
+        if (funds < amount) {
+            return false;
+        }
+
+        // Check if the recipient is not the same as the sender
+        if (m_senderId == m_recipientId) {
+            return false;
+        }
+
+        // Check if the recipient is in the recipient list, if any
+        if (!recipientList.empty() && std::find(recipientList.begin(), recipientList.end(), getRecipient()) == recipientList.end()) {
+            return false;
+        }
+
+        // Check for suspicious patterns of transaction amounts from the sender
+        if (history.count >= 3 && history.variance() > 0.1 * history.mean) {
+            return false;
+        }
+
+        // Check for unusual transaction amounts compared to the sender's history
+        if (history.count >= 5) {
+            double threshold = 0.1 * (history.max - history.min) + history.min;
+            if (amount > threshold) {
+                return false;
+            }
+        }
+
+        // All checks passed, the transaction is valid
+        return true;
+    }
+    
+    std::vector<Transaction> splitTransaction(const Transaction& transaction) {
+        std::vector<Transaction> splitTransactions = split(transaction.getSender(), transaction.getRecipientList(), transaction.getAmount(), transaction.getFee());
+
+        // Every part carries the same sender history, so they all share one copy of it
+        if (!transaction.getSenderSent().empty()) {
+            Details details;
+            details.senderSent = transaction.getSenderSent();
+            std::shared_ptr<const Details> history = makeDetails(std::move(details));
+            for (auto& part : splitTransactions) {
+                part.m_details = history;
+            }
+        }
+        return splitTransactions;
+    }
+
+    // One transaction per recipient, sharing amount equally, without building the multi-recipient
+    // transaction first
+    static std::vector<Transaction> split(const std::string& sender, const std::vector<std::string>& recipients, double amount, double fee) {
+        std::vector<Transaction> parts;
+        parts.reserve(recipients.size());
+        double amountPerRecipient = amount / recipients.size();
+        for (const auto& recipient : recipients) {
+            parts.emplace_back(sender, recipient, amountPerRecipient, fee);
+        }
+        return parts;
+    }
+
+    std::string toString() const {
+        std::stringstream ss;
+        ss << "Transaction Details:\n";
+        ss << "Sender: " << getSender() << "\n";
+        ss << "Recipient: " << getRecipient() << "\n";
+        ss << "Amount: " << getAmount() << "\n";
+        ss << "Fee: " << getFee() << "\n";
+        ss << "Date: " << getDate() << "\n";
+        ss << "Recipient List: ";
+        if (getRecipientList().empty()) {
+            ss << "None\n";
+        }
+        else {
+            for (const auto& recipient : getRecipientList()) {
+                ss << recipient << " ";
+            }
+            ss << "\n";
+        }
+        ss << "Sender Sent: ";
+        if (getSenderSent().empty()) {
+            ss << "None\n";
+        }
+        else {
+            for (const auto& sent : getSenderSent()) {
+                ss << sent << " ";
+            }
+            ss << "\n";
+        }
+        return ss.str();
+    }
+
+private:
+    struct Details {
+        std::vector<std::string> recipientList;
+        std::vector<double> senderSent;
+        std::optional<Ed25519::Signature> signature;
+        size_t encodedSize = 0; // Bytes the two lists and the signature take in a transaction record
+        SenderStats senderStats;
+    };
+
+    uint32_t m_senderId;
+    uint32_t m_recipientId;
+    int64_t m_amount;
+    int64_t m_fee;
+    int64_t m_timestamp = std::time(nullptr);
+    std::shared_ptr<const Details> m_details; // Null unless a recipient list, sender history or signature is set
+
+    Transaction(uint32_t senderId, uint32_t recipientId, int64_t amountUnits, int64_t feeUnits, int64_t timestamp)
+        : m_senderId(senderId), m_recipientId(recipientId), m_amount(amountUnits), m_fee(feeUnits), m_timestamp(timestamp) {}
+
+    static const Details& emptyDetails() {
+        static const Details empty;
+        return empty;
+    }
+
+    static std::shared_ptr<const Details> makeDetails(Details details) {
+        details.encodedSize = varintSize(details.recipientList.size()) + varintSize(details.senderSent.size()) + 8 * details.senderSent.size() +
+                              1 + (details.signature ? details.signature->size() : 0);
+        details.senderStats = SenderStats::of(details.senderSent);
+        for (const auto& recipient : details.recipientList) {
+            details.encodedSize += varintSize(recipient.size()) + recipient.size();
+        }
+        return std::make_shared<const Details>(std::move(details));
+    }
+
+    void setDetails(Details details) {
+        if (details.recipientList.empty() && details.senderSent.empty() && !details.signature) {
+            m_details.reset();
+        }
+        else {
+            m_details = makeDetails(std::move(details));
+        }
+    }
+
+    static std::string formatTimestamp(int64_t timestamp) {
+        std::time_t time = static_cast<std::time_t>(timestamp);
+        std::stringstream ss;
+        ss << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S");
+        return ss.str();
+    }
+
+    static void updateLength(SHA256_CTX& ctx, size_t length) {
+        unsigned char bytes[4];
+        for (int i = 0; i < 4; ++i) {
+            bytes[i] = static_cast<unsigned char>(length >> (8 * i));
+        }
+        SHA256_Update(&ctx, bytes, sizeof(bytes));
+    }
+
+    static void updateString(SHA256_CTX& ctx, const std::string& value) {
+        updateLength(ctx, value.size());
+        SHA256_Update(&ctx, value.data(), value.size());
+    }
+
+    static void updateU64(SHA256_CTX& ctx, uint64_t value) {
+        unsigned char bytes[8];
+        for (int i = 0; i < 8; ++i) {
+            bytes[i] = static_cast<unsigned char>(value >> (8 * i));
+        }
+        SHA256_Update(&ctx, bytes, sizeof(bytes));
+    }
+};
+
+// Validates a block's worth of transactions at once, with the same verdicts as Transaction::isValid.
+// Transactions are processed in tiles: the fields the checks need, including the history summary
+// each transaction computed when its history was set, are gathered into small flat arrays, and the
+// checks then run over the arrays. A verdict never depends on another transaction, so threads take
+// contiguous ranges of the batch.
+class TransactionBatchValidator {
+public:
+    // What a transaction's sender is judged by, in place of the history the transaction carries
+    struct SenderHistory {
+        const SenderStats* stats;
+        double funds;
+    };
+
+    explicit TransactionBatchValidator(const std::vector<Transaction>& transactions) : m_transactions(transactions) {}
+
+    // Judge each transaction by the matching entry of histories, e.g. the sender's summary and
+    // balance on the chain, with the verdicts of Transaction::isValid(stats, funds)
+    TransactionBatchValidator(const std::vector<Transaction>& transactions, std::vector<SenderHistory> histories)
+        : m_transactions(transactions), m_histories(std::move(histories)) {}
+
+    // One verdict per transaction, in order: 1 where Transaction::isValid would return true
+    std::vector<uint8_t> validate(size_t threadCount = std::thread::hardware_concurrency()) const {
+        size_t count = m_transactions.size();
+        std::vector<uint8_t> verdicts(count, 0);
+
+        // Small batches aren't worth starting threads for
+        const size_t minTransactionsPerThread = 16384;
+        threadCount = std::min(threadCount, (count + minTransactionsPerThread - 1) / minTransactionsPerThread);
+        threadCount = std::max<size_t>(threadCount, 1);
+        size_t chunkSize = (count + threadCount - 1) / threadCount;
+
+        auto validateChunk = [&](size_t chunk) {
+            size_t end = std::min(count, (chunk + 1) * chunkSize);
+            Tile tile;
+            for (size_t begin = chunk * chunkSize; begin < end; begin += tileSize) {
+                size_t tileCount = std::min(tileSize, end - begin);
+                gather(tile, begin, tileCount);
+                for (size_t i = 0; i < tileCount; ++i) {
+                    verdicts[begin + i] = check(tile, i);
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t chunk = 1; chunk < threadCount; ++chunk) {
+            workers.emplace_back(validateChunk, chunk);
+        }
+        validateChunk(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        return verdicts;
+    }
+
+private:
+    static constexpr size_t tileSize = 256;
+
+    // Structure-of-arrays view of tileSize transactions
+    struct Tile {
+        double amounts[tileSize];
+        uint32_t senders[tileSize];
+        uint32_t recipients[tileSize];
+        uint8_t recipientListed[tileSize];
+        const SenderStats* stats[tileSize];
+        double funds[tileSize];
+    };
+
+    const std::vector<Transaction>& m_transactions;
+    std::vector<SenderHistory> m_histories; // Empty to use each transaction's own history
+
+    void gather(Tile& tile, size_t begin, size_t count) const {
+        for (size_t i = 0; i < count; ++i) {
+            const Transaction& transaction = m_transactions[begin + i];
+            tile.amounts[i] = transaction.getAmount();
+            tile.senders[i] = transaction.getSenderId();
+            tile.recipients[i] = transaction.getRecipientId();
+            const std::vector<std::string>& recipientList = transaction.getRecipientList();
+            tile.recipientListed[i] = recipientList.empty() || std::find(recipientList.begin(), recipientList.end(), transaction.getRecipient()) != recipientList.end();
+            if (m_histories.empty()) {
+                tile.stats[i] = &transaction.getSenderStats();
+                tile.funds[i] = tile.stats[i]->total;
+            } else {
+                tile.stats[i] = m_histories[begin + i].stats;
+                tile.funds[i] = m_histories[begin + i].funds;
+            }
+        }
+    }
+
+    // The checks of Transaction::isValid, in the same order, against the history summary
+    static uint8_t check(const Tile& tile, size_t i) {
+        const SenderStats& stats = *tile.stats[i];
+        double amount = tile.amounts[i];
+        if (amount <= 0.0 || tile.funds[i] < amount || tile.senders[i] == tile.recipients[i] || !tile.recipientListed[i]) {
+            return 0;
+        }
+        if (stats.count >= 3 && stats.variance() > 0.1 * stats.mean) {
+            return 0;
+        }
+        if (stats.count >= 5 && amount > 0.1 * (stats.max - stats.min) + stats.min) {
+            return 0;
+        }
+        return 1;
+    }
+};
+
+// Signatures that have already been verified, so a transaction checked when it entered the mempool
+// isn't checked again when a block with it arrives. Entries are keyed by the transaction id and the
+// signature together, so another signature on the same transaction is still verified. The cache is
+// sharded by key like Metrics, and each shard forgets its oldest entries once it's full.
+class SignatureCache {
+public:
+    explicit SignatureCache(size_t capacity = 1 << 18) : m_shardCapacity(std::max<size_t>(1, capacity / shardCount)) {}
+
+    SignatureCache(const SignatureCache&) = delete;
+    SignatureCache& operator=(const SignatureCache&) = delete;
+
+    // Transaction::verifySignature, answered from the cache when it can be
+    bool verify(const Transaction& transaction) {
+        static Metrics::Counter& hits = Metrics::instance().counter("blockchain_signature_cache_hits_total", "Signature checks answered by the signature cache");
+        static Metrics::Counter& verified = Metrics::instance().counter("blockchain_signatures_verified_total", "Signatures verified with Ed25519");
+        const std::optional<Ed25519::Signature>& signature = transaction.getSignature();
+        if (!signature) {
+            return false;
+        }
+        Hash256 key = keyOf(transaction.calculateHash(), *signature);
+        Shard& shard = m_shards[key[0] % shardCount];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (shard.entries.count(key) != 0) {
+                hits.add();
+                return true;
+            }
+        }
+
+        // Verify without the lock; two threads checking the same signature at once both just insert it
+        verified.add();
+        if (!transaction.verifySignature()) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.entries.insert(key).second) {
+            shard.order.push_back(key);
+            if (shard.order.size() > m_shardCapacity) {
+                shard.entries.erase(shard.order.front());
+                shard.order.pop_front();
+            }
+        }
+        return true;
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (const Shard& shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.entries.size();
+        }
+        return total;
+    }
+
+private:
+    static constexpr size_t shardCount = 16;
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::unordered_set<Hash256, Hash256Hasher> entries;
+        std::deque<Hash256> order; // Oldest first
+    };
+
+    size_t m_shardCapacity;
+    Shard m_shards[shardCount];
+
+    static Hash256 keyOf(const Hash256& id, const Ed25519::Signature& signature) {
+        Hash256 key;
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, id.data(), id.size());
+        SHA256_Update(&ctx, signature.data(), signature.size());
+        SHA256_Final(key.data(), &ctx);
+        return key;
+    }
+};
+
+// Checks the signatures of a batch of transactions, such as a whole block, on several threads.
+// OpenSSL has no batched Ed25519 verification, so each signature is verified on its own and the
+// batch is what gets spread across threads. With a cache, signatures it already holds are skipped
+// and newly verified ones are added to it.
+class SignatureBatchVerifier {
+public:
+    explicit SignatureBatchVerifier(const std::vector<Transaction>& transactions, SignatureCache* cache = nullptr)
+        : m_transactions(transactions), m_cache(cache) {}
+
+    // One verdict per transaction, in order: 1 where the signature is valid
+    std::vector<uint8_t> verify(size_t threadCount = std::thread::hardware_concurrency()) const {
+        size_t count = m_transactions.size();
+        std::vector<uint8_t> verdicts(count, 0);
+
+        // A signature takes tens of microseconds, so a thread pays off for far fewer of them than
+        // for the checks of TransactionBatchValidator
+        const size_t minSignaturesPerThread = 32;
+        threadCount = std::min(threadCount, (count + minSignaturesPerThread - 1) / minSignaturesPerThread);
+        threadCount = std::max<size_t>(threadCount, 1);
+        size_t chunkSize = (count + threadCount - 1) / threadCount;
+
+        auto verifyChunk = [&](size_t chunk) {
+            size_t end = std::min(count, (chunk + 1) * chunkSize);
+            for (size_t i = chunk * chunkSize; i < end; ++i) {
+                const Transaction& transaction = m_transactions[i];
+                verdicts[i] = m_cache ? m_cache->verify(transaction) : transaction.verifySignature();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t chunk = 1; chunk < threadCount; ++chunk) {
+            workers.emplace_back(verifyChunk, chunk);
+        }
+        verifyChunk(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        return verdicts;
+    }
+
+private:
+    const std::vector<Transaction>& m_transactions;
+    SignatureCache* m_cache;
+};
+
+class Wallet {
+public:
+    Wallet(const std::string& name, double balance = 0.0) : m_name(name), m_balance(balance) {}
+
+    // A wallet with a new Ed25519 key pair, named after the key's address. Everything it sends is signed.
+    static Wallet generate(double balance = 0.0) {
+        Ed25519::PrivateKey privateKey;
+        Ed25519::PublicKey publicKey;
+        Ed25519::generate(privateKey, publicKey);
+        Wallet wallet(Ed25519::addressOf(publicKey), balance);
+        wallet.m_privateKey = privateKey;
+        return wallet;
+    }
+
+    bool canSign() const { return m_privateKey.has_value(); }
+
+    // Sign a transaction this wallet sends
+    void sign(Transaction& transaction) const {
+        if (!m_privateKey || transaction.getSender() != m_name) {
+            throw std::logic_error("Wallet " + m_name + " can't sign a transaction from " + transaction.getSender());
+        }
+        transaction.sign(*m_privateKey);
+    }
+
+    std::string getName() const { return m_name; }
+    double getBalance() const { return m_balance; }
+    std::vector<Transaction> getReceivedTransactions() const { return m_receivedTransactions; }
+    std::map<std::string, std::vector<double>> getSenderSentMap() const { return m_senderSentMap; }
+
+    void addFunds(double amount, const std::string& source) {
+        // Add the amount to the wallet balance
+        m_balance += amount;
+
+        // Create a new Transaction object to represent the added funds
+        Transaction transaction(source, m_name, amount, 0.05, {});
+        
+        // Add the transaction to the receivedTransactions list
+        m_receivedIds.insert(transaction.calculateHash());
+        recordReceived(transaction);
+
+        // Log transaction details
+        Logger::instance().log(Logger::Level::Info, "funds added", {{"wallet", m_name}, {"source", transaction.getSender()}, {"amount", transaction.getAmount()}, {"fee", transaction.getFee()}});
+
+        // Check if the transaction has senderSent information and add it to the senderSentMap
+        const std::vector<double>& senderSent = transaction.getSenderSent();
+        if (!senderSent.empty()) {
+            for (size_t i = 0; i < senderSent.size(); i++) {
+                if (i < transaction.getRecipientList().size()) {
+                    m_senderSentMap[transaction.getRecipientList()[i]] += senderSent[i];
+                }
+            }
+        }
+    }
+
+    std::vector<Transaction> sendMoney(double amount, const std::vector<std::string>& recipients) {
+        std::vector<Transaction> transactions;
+        double fee = 0.05;
+
+        // Check if the wallet has enough balance to send the amount
+        if (m_balance < amount) {
+            Logger::instance().log(Logger::Level::Error, "wallet balance is insufficient", {{"wallet", m_name}, {"balance", m_balance}, {"amount", amount}});
+            return transactions;
+        }
+
+        // If there is only one recipient, send the entire amount to that recipient
+        if (recipients.size() == 1) {
+            Transaction transaction(m_name, recipients[0], amount, fee);
+            transactions.push_back(transaction);
+            m_balance -= amount;
+
+            // Log transaction details
+            Logger::instance().log(Logger::Level::Info, "transaction sent", {{"sender", transaction.getSender()}, {"recipient", transaction.getRecipient()}, {"amount", transaction.getAmount()}, {"fee", transaction.getFee()}});
+        }
+        // If there are multiple recipients, split the transaction into multiple transactions
+        else {
+            transactions = Transaction::split(m_name, recipients, amount, fee);
+            for (const auto& t : transactions) {
+                m_balance -= t.getAmount();
+
+                // Log transaction details
+                Logger::instance().log(Logger::Level::Info, "transaction sent", {{"sender", t.getSender()}, {"recipient", t.getRecipient()}, {"amount", t.getAmount()}, {"fee", t.getFee()}});
+            }
+        }
+
+        // Update the senderSent list for each transaction
+        std::vector<double> senderSent;
+        senderSent.reserve(transactions.size());
+        for (const auto& transaction : transactions) {
+            if (transaction.getSender() == m_name) {
+                senderSent.push_back(transaction.getAmount());
+            }
+        }
+        if (!senderSent.empty()) {
+            transactions.back().setSenderSent(std::move(senderSent));
+        }
+
+        // Sign last, since the signature covers every field
+        if (m_privateKey) {
+            for (auto& transaction : transactions) {
+                transaction.sign(*m_privateKey);
+            }
+        }
+
+        return transactions;
+    }
+
+    void receiveMoney(const std::vector<Transaction>& transactions) {
+        // Add money to wallet balance
+        for (const auto& transaction : transactions) {
+            if (transaction.getRecipient() == m_name) {
+                // Check if the transaction has already been processed
+                if (!m_receivedIds.insert(transaction.calculateHash()).second) {
+                    Logger::instance().log(Logger::Level::Warning, "transaction has already been processed", {{"wallet", m_name}, {"sender", transaction.getSender()}, {"amount", transaction.getAmount()}});
+                    continue;
+                }
+                // Add the transaction amount to the balance
+                m_balance += transaction.getAmount();
+                // Add the transaction to the receivedTransactions list
+                recordReceived(transaction);
+
+                Logger::instance().log(Logger::Level::Info, "transaction received", {{"sender", transaction.getSender()}, {"recipient", transaction.getRecipient()}, {"amount", transaction.getAmount()}, {"fee", transaction.getFee()}});
+
+                // Check if the transaction has senderSent information and add it to the senderSentMap
+                const std::vector<double>& senderSent = transaction.getSenderSent();
+                if (!senderSent.empty()) {
+                    for (size_t i = 0; i < senderSent.size(); i++) {
+                        if (i < transaction.getRecipientList().size()) {
+                            m_senderSentMap[transaction.getRecipientList()[i]] += senderSent[i];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<Transaction> getSentTransactions() const {
+        std::vector<Transaction> sentTransactions;
+        for (const auto& [sender, sent] : m_senderSentMap) {
+            for (auto&& amount : sent) {
+                sentTransactions.emplace_back(std::move(sender), m_name, std::move(amount));
+            }
+        }
+        return sentTransactions;
+    }
+
+    std::vector<Transaction> getTransactionsInRange(const std::string& start_date, const std::string& end_date) const {
+        return getTransactionsInRange(Transaction::parseTimestamp(start_date), Transaction::parseTimestamp(end_date));
+    }
+
+    // Received transactions with start <= timestamp <= end, in O(log n + k) through the time index
+    std::vector<Transaction> getTransactionsInRange(int64_t start, int64_t end) const {
+        std::vector<Transaction> transactionsInRange;
+        if (start > end) {
+            return transactionsInRange;
+        }
+        auto first = m_receivedByTime.lower_bound(start);
+        auto last = m_receivedByTime.upper_bound(end);
+        for (auto it = first; it != last; ++it) {
+            transactionsInRange.push_back(m_receivedTransactions[it->second]);
+        }
+        return transactionsInRange;
+    }
+
+    // Most recently received transactions first, skipping the newest offset and returning at most limit (all if negative)
+    std::vector<Transaction> getTransactionHistory(int limit = -1, size_t offset = 0) const {
+        std::vector<Transaction> transactionHistory;
+        if (offset >= m_receivedTransactions.size()) {
+            return transactionHistory;
+        }
+        size_t available = m_receivedTransactions.size() - offset;
+        size_t count = limit >= 0 ? std::min(static_cast<size_t>(limit), available) : available;
+        transactionHistory.reserve(count);
+        for (auto it = m_receivedTransactions.rbegin() + offset; count > 0; ++it, --count) {
+            transactionHistory.push_back(*it);
+        }
+        return transactionHistory;
+    }
+
+    int getTransactionCount() const {
+        return m_receivedTransactions.size();
+    }
+
+    double getTotalAmountSent() const {
+        double total = 0.0;
+        for (const auto& [_, sent] : m_senderSentMap) {
+            for (const auto& amount : sent) {
+                total += amount;
+            }
+        }
+        return total;
+    }
+
+    double getTotalAmountReceived() const {
+        double total = 0.0;
+        for (const auto& transaction : m_receivedTransactions) {
+            total += transaction.getAmount();
+        }
+        return total;
+    }
+
+private:
+    std::string m_name;
+    double m_balance;
+    std::optional<Ed25519::PrivateKey> m_privateKey; // Only set for wallets made by generate
+    std::vector<Transaction> m_receivedTransactions; // vector to store all received transactions
+    std::unordered_set<Hash256, Hash256Hasher> m_receivedIds; // content hashes of m_receivedTransactions, for replay checks
+    std::multimap<int64_t, size_t> m_receivedByTime; // timestamp -> index into m_receivedTransactions
+    std::map<std::string, std::vector<double>> m_senderSentMap; // map to store the amount sent by each sender
+
+    // Append to the received history and index it by timestamp
+    void recordReceived(const Transaction& transaction) {
+        m_receivedByTime.emplace(transaction.getTimestamp(), m_receivedTransactions.size());
+        m_receivedTransactions.push_back(transaction);
+    }
+};
+
+// Multi-buffer SHA-256 compression: applies one 64-byte chunk to many independent hash states at
+// once. AVX-512 handles 16 lanes and AVX2 8 lanes per pass, chosen at runtime from what the CPU
+// supports, with leftovers (and CPUs without either) going through the same rounds one block at a time.
+class Sha256MultiBuffer {
+public:
+    enum class Kernel { Scalar = 0, Avx2 = 1, Avx512 = 2 };
+
+    static constexpr size_t maxLanes = 16;
+
+    static constexpr uint32_t initialState[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    static bool isSupported(Kernel kernel) {
+        return kernel <= widestKernel();
+    }
+
+    static Kernel getKernel() { return selectedKernel(); }
+
+    // Force a specific kernel, e.g. to compare implementations in tests. Unsupported kernels are ignored.
+    static void setKernel(Kernel kernel) {
+        if (isSupported(kernel)) {
+            selectedKernel() = kernel;
+        }
+    }
+
+    // states holds count consecutive 8-word states, blocks holds one 64-byte chunk pointer per state
+    static void compress(uint32_t* states, const unsigned char* const* blocks, size_t count) {
+        size_t i = 0;
+#ifdef BLOCKCHAIN_X86_SIMD
+        Kernel kernel = selectedKernel();
+        if (kernel == Kernel::Avx512) {
+            for (; i + 16 <= count; i += 16) {
+                compressAvx512(states + 8 * i, blocks + i);
+            }
+        }
+        if (kernel >= Kernel::Avx2) {
+            for (; i + 8 <= count; i += 8) {
+                compressAvx2(states + 8 * i, blocks + i);
+            }
+        }
+#endif
+        for (; i < count; ++i) {
+            compressScalar(states + 8 * i, blocks[i]);
+        }
+    }
+
+    static void compressScalar(uint32_t* state, const unsigned char* block) {
+        auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+        uint32_t w[64];
+        for (int t = 0; t < 16; ++t) {
+            w[t] = loadBigEndian(block + 4 * t);
+        }
+        for (int t = 16; t < 64; ++t) {
+            uint32_t s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+            uint32_t s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int t = 0; t < 64; ++t) {
+            uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + roundConstants[t] + w[t];
+            uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+    static void storeDigest(const uint32_t* state, unsigned char* out) {
+        for (int i = 0; i < 8; ++i) {
+            out[4 * i] = static_cast<unsigned char>(state[i] >> 24);
+            out[4 * i + 1] = static_cast<unsigned char>(state[i] >> 16);
+            out[4 * i + 2] = static_cast<unsigned char>(state[i] >> 8);
+            out[4 * i + 3] = static_cast<unsigned char>(state[i]);
+        }
+    }
+
+private:
+    static constexpr uint32_t roundConstants[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    static uint32_t loadBigEndian(const unsigned char* p) {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+    }
+
+    static Kernel widestKernel() {
+#ifdef BLOCKCHAIN_X86_SIMD
+        static const Kernel widest = [] {
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f")) {
+                return Kernel::Avx512;
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                return Kernel::Avx2;
+            }
+            return Kernel::Scalar;
+        }();
+        return widest;
+#else
+        return Kernel::Scalar;
+#endif
+    }
+
+    static Kernel& selectedKernel() {
+        static Kernel kernel = widestKernel();
+        return kernel;
+    }
+
+#ifdef BLOCKCHAIN_X86_SIMD
+    // The AVX kernels mirror compressScalar with one lane per message. They are compiled with
+    // per-function target attributes so the rest of the file doesn't need -mavx2 / -mavx512f.
+#define SHA256_MB_ROUNDS(VEC, ADD, XOR, AND, ANDNOT, ROTR, SHR, SET1, SUFFIX)                                  \
+    VEC w[64];                                                                                                 \
+    for (int t = 0; t < 16; ++t) {                                                                             \
+        w[t] = loadWords##SUFFIX(blocks, 4 * t);                                                               \
+    }                                                                                                          \
+    for (int t = 16; t < 64; ++t) {                                                                            \
+        VEC s0 = XOR(XOR(ROTR(w[t - 15], 7), ROTR(w[t - 15], 18)), SHR(w[t - 15], 3));                         \
+        VEC s1 = XOR(XOR(ROTR(w[t - 2], 17), ROTR(w[t - 2], 19)), SHR(w[t - 2], 10));                          \
+        w[t] = ADD(ADD(w[t - 16], s0), ADD(w[t - 7], s1));                                                     \
+    }                                                                                                          \
+    VEC v[8];                                                                                                  \
+    for (int j = 0; j < 8; ++j) {                                                                              \
+        v[j] = loadStates##SUFFIX(states, j);                                                                  \
+    }                                                                                                          \
+    VEC a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];                        \
+    for (int t = 0; t < 64; ++t) {                                                                             \
+        VEC s1 = XOR(XOR(ROTR(e, 6), ROTR(e, 11)), ROTR(e, 25));                                               \
+        VEC ch = XOR(AND(e, f), ANDNOT(e, g));                                                                 \
+        VEC t1 = ADD(ADD(ADD(h, s1), ADD(ch, SET1(static_cast<int>(roundConstants[t])))), w[t]);               \
+        VEC s0 = XOR(XOR(ROTR(a, 2), ROTR(a, 13)), ROTR(a, 22));                                               \
+        VEC maj = XOR(XOR(AND(a, b), AND(a, c)), AND(b, c));                                                   \
+        VEC t2 = ADD(s0, maj);                                                                                 \
+        h = g;                                                                                                 \
+        g = f;                                                                                                 \
+        f = e;                                                                                                 \
+        e = ADD(d, t1);                                                                                        \
+        d = c;                                                                                                 \
+        c = b;                                                                                                 \
+        b = a;                                                                                                 \
+        a = ADD(t1, t2);                                                                                       \
+    }                                                                                                          \
+    VEC out[8] = {a, b, c, d, e, f, g, h};                                                                     \
+    for (int j = 0; j < 8; ++j) {                                                                              \
+        storeStates##SUFFIX(states, j, ADD(v[j], out[j]));                                                     \
+    }
+
+#define SHA256_AVX2_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+#define SHA256_MB_LANE_HELPERS(TARGET, VEC, LANES, LOAD, STORE, SUFFIX)                                        \
+    __attribute__((target(TARGET))) static VEC loadWords##SUFFIX(const unsigned char* const* lanes, int offset) { \
+        alignas(64) uint32_t words[LANES];                                                                     \
+        for (int lane = 0; lane < LANES; ++lane) {                                                             \
+            words[lane] = loadBigEndian(lanes[lane] + offset);                                                 \
+        }                                                                                                      \
+        return LOAD(reinterpret_cast<const VEC*>(words));                                                      \
+    }                                                                                                          \
+    __attribute__((target(TARGET))) static VEC loadStates##SUFFIX(const uint32_t* states, int word) {          \
+        alignas(64) uint32_t words[LANES];                                                                     \
+        for (int lane = 0; lane < LANES; ++lane) {                                                             \
+            words[lane] = states[8 * lane + word];                                                             \
+        }                                                                                                      \
+        return LOAD(reinterpret_cast<const VEC*>(words));                                                      \
+    }                                                                                                          \
+    __attribute__((target(TARGET))) static void storeStates##SUFFIX(uint32_t* states, int word, VEC value) {   \
+        alignas(64) uint32_t words[LANES];                                                                     \
+        STORE(reinterpret_cast<VEC*>(words), value);                                                           \
+        for (int lane = 0; lane < LANES; ++lane) {                                                             \
+            states[8 * lane + word] = words[lane];                                                             \
+        }                                                                                                      \
+    }
+
+    SHA256_MB_LANE_HELPERS("avx2", __m256i, 8, _mm256_load_si256, _mm256_store_si256, Avx2)
+    SHA256_MB_LANE_HELPERS("avx512f", __m512i, 16, _mm512_load_si512, _mm512_store_si512, Avx512)
+
+    __attribute__((target("avx2"))) static void compressAvx2(uint32_t* states, const unsigned char* const* blocks) {
+        SHA256_MB_ROUNDS(__m256i, _mm256_add_epi32, _mm256_xor_si256, _mm256_and_si256, _mm256_andnot_si256,
+                         SHA256_AVX2_ROTR, _mm256_srli_epi32, _mm256_set1_epi32, Avx2)
+    }
+
+    __attribute__((target("avx512f"))) static void compressAvx512(uint32_t* states, const unsigned char* const* blocks) {
+        SHA256_MB_ROUNDS(__m512i, _mm512_add_epi32, _mm512_xor_si512, _mm512_and_si512, _mm512_andnot_si512,
+                         _mm512_ror_epi32, _mm512_srli_epi32, _mm512_set1_epi32, Avx512)
+    }
+
+#undef SHA256_AVX2_ROTR
+#undef SHA256_MB_LANE_HELPERS
+#undef SHA256_MB_ROUNDS
+#endif
+};
+
+// Bump allocator for the scratch memory of assembling, mining and importing a block. Individual
+// deallocations are ignored; a Scope hands back everything allocated since it was opened in one
+// step. Chunks are kept once allocated, so a warmed-up arena serves later blocks without touching
+// the global heap.
+class BlockArena : public std::pmr::memory_resource {
+public:
+    explicit BlockArena(size_t chunkSize = 256 * 1024) : m_chunkSize(chunkSize) {}
+
+    BlockArena(const BlockArena&) = delete;
+    BlockArena& operator=(const BlockArena&) = delete;
+
+    // Each thread's own arena, for scratch buffers that don't outlive the call using them
+    static BlockArena& local() {
+        thread_local BlockArena arena;
+        return arena;
+    }
+
+    // Releases everything allocated from the arena while the scope was open. Scopes must nest.
+    class Scope {
+    public:
+        explicit Scope(BlockArena& arena) : m_arena(arena), m_chunk(arena.m_current), m_used(arena.m_used) {}
+        ~Scope() {
+            m_arena.m_current = m_chunk;
+            m_arena.m_used = m_used;
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        BlockArena& m_arena;
+        size_t m_chunk;
+        size_t m_used;
+    };
+
+    // Total bytes held in chunks, whether in use or not
+    size_t getCapacity() const {
+        size_t capacity = 0;
+        for (const auto& chunk : m_chunks) {
+            capacity += chunk.size;
+        }
+        return capacity;
+    }
+
+private:
+    struct Chunk {
+        std::unique_ptr<unsigned char[]> data;
+        size_t size;
+    };
+
+    size_t m_chunkSize;
+    std::vector<Chunk> m_chunks;
+    size_t m_current = 0;
+    size_t m_used = 0;
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        // Try the current chunk, then any later ones that are already allocated, before adding another
+        for (; m_current < m_chunks.size(); ++m_current, m_used = 0) {
+            Chunk& chunk = m_chunks[m_current];
+            size_t offset = (reinterpret_cast<uintptr_t>(chunk.data.get()) + m_used + alignment - 1) & ~(uintptr_t(alignment) - 1);
+            offset -= reinterpret_cast<uintptr_t>(chunk.data.get());
+            if (offset + bytes <= chunk.size) {
+                m_used = offset + bytes;
+                return chunk.data.get() + offset;
+            }
+        }
+        size_t size = std::max(m_chunkSize, bytes + alignment);
+        m_chunks.push_back(Chunk{std::unique_ptr<unsigned char[]>(new unsigned char[size]), size});
+        m_used = 0;
+        return do_allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void*, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+
+// Fixed-layout binary block header. The fields that don't change while mining fill exactly the
+// first 64-byte SHA-256 chunk, so the nonce only ever touches the final chunk.
+struct BlockHeader {
+    static constexpr size_t serializedSize = 88;
+
+    Hash256 previousHash{};
+    Hash256 merkleRoot{};
+    int64_t timestamp = 0;
+    double reward = 0.0;
+    uint64_t nonce = 0;
+
+    std::array<unsigned char, serializedSize> serialize() const {
+        std::array<unsigned char, serializedSize> bytes;
+        uint64_t rewardBits;
+        std::memcpy(&rewardBits, &reward, sizeof(rewardBits));
+        std::copy(previousHash.begin(), previousHash.end(), bytes.begin());
+        std::copy(merkleRoot.begin(), merkleRoot.end(), bytes.begin() + 32);
+        writeLittleEndian(bytes.data() + 64, static_cast<uint64_t>(timestamp));
+        writeLittleEndian(bytes.data() + 72, rewardBits);
+        writeLittleEndian(bytes.data() + 80, nonce);
+        return bytes;
+    }
+
+    static BlockHeader deserialize(const unsigned char* bytes) {
+        BlockHeader header;
+        uint64_t rewardBits = readLittleEndian(bytes + 72);
+        std::copy(bytes, bytes + 32, header.previousHash.begin());
+        std::copy(bytes + 32, bytes + 64, header.merkleRoot.begin());
+        header.timestamp = static_cast<int64_t>(readLittleEndian(bytes + 64));
+        std::memcpy(&header.reward, &rewardBits, sizeof(rewardBits));
+        header.nonce = readLittleEndian(bytes + 80);
+        return header;
+    }
+
+    static void writeLittleEndian(unsigned char* out, uint64_t value) {
+        for (int i = 0; i < 8; ++i) {
+            out[i] = static_cast<unsigned char>(value >> (8 * i));
+        }
+    }
+
+    static uint64_t readLittleEndian(const unsigned char* in) {
+        uint64_t value = 0;
+        for (int i = 0; i < 8; ++i) {
+            value |= static_cast<uint64_t>(in[i]) << (8 * i);
+        }
+        return value;
+    }
+};
+
+// Hashes a header for many nonces, reusing the SHA-256 midstate of the first 64 bytes
+class HeaderHasher {
+public:
+    explicit HeaderHasher(const BlockHeader& header) : m_bytes(header.serialize()) {
+        SHA256_Init(&m_midstate);
+        SHA256_Update(&m_midstate, m_bytes.data(), 64);
+
+        // The same midstate as raw words plus the padded final chunk, for the multi-buffer kernel
+        std::copy(std::begin(Sha256MultiBuffer::initialState), std::end(Sha256MultiBuffer::initialState), m_midstateWords);
+        Sha256MultiBuffer::compressScalar(m_midstateWords, m_bytes.data());
+        m_finalChunk = paddedFinalChunk(m_bytes);
+    }
+
+    Hash256 hash(uint64_t nonce) const {
+        std::array<unsigned char, BlockHeader::serializedSize - 64> tail;
+        std::copy(m_bytes.begin() + 64, m_bytes.end(), tail.begin());
+        BlockHeader::writeLittleEndian(tail.data() + 16, nonce);
+
+        Hash256 digest;
+        SHA256_CTX sha256 = m_midstate;
+        SHA256_Update(&sha256, tail.data(), tail.size());
+        SHA256_Final(digest.data(), &sha256);
+        return digest;
+    }
+
+    // Hash the header for each of the given nonces, Sha256MultiBuffer::maxLanes at a time
+    void hashBatch(const uint64_t* nonces, size_t count, Hash256* digests) const {
+        const size_t lanes = Sha256MultiBuffer::maxLanes;
+        std::array<unsigned char, 64> chunks[lanes];
+        const unsigned char* chunkPointers[lanes];
+        uint32_t states[lanes * 8];
+
+        for (size_t i = 0; i < lanes; ++i) {
+            chunks[i] = m_finalChunk;
+            chunkPointers[i] = chunks[i].data();
+        }
+
+        for (size_t offset = 0; offset < count; offset += lanes) {
+            size_t batch = std::min(lanes, count - offset);
+            for (size_t i = 0; i < batch; ++i) {
+                BlockHeader::writeLittleEndian(chunks[i].data() + 16, nonces[offset + i]);
+                std::copy(m_midstateWords, m_midstateWords + 8, states + 8 * i);
+            }
+            Sha256MultiBuffer::compress(states, chunkPointers, batch);
+            for (size_t i = 0; i < batch; ++i) {
+                Sha256MultiBuffer::storeDigest(states + 8 * i, digests[offset + i].data());
+            }
+        }
+    }
+
+    // Hash complete headers (two chunks each), e.g. when re-validating a whole chain
+    static std::vector<Hash256> hashHeaders(const std::vector<BlockHeader>& headers) {
+        std::vector<Hash256> digests(headers.size());
+        hashHeaders(headers.data(), headers.size(), digests.data());
+        return digests;
+    }
+
+    // Hash count complete headers into digests. The message buffers come from the thread's BlockArena.
+    static void hashHeaders(const BlockHeader* headers, size_t count, Hash256* digests) {
+        BlockArena& arena = BlockArena::local();
+        BlockArena::Scope scope(arena);
+        std::pmr::vector<std::array<unsigned char, 128>> messages(count, &arena);
+        std::pmr::vector<const unsigned char*> chunkPointers(count, &arena);
+        std::pmr::vector<uint32_t> states(count * 8, &arena);
+
+        for (size_t i = 0; i < count; ++i) {
+            auto bytes = headers[i].serialize();
+            std::copy(bytes.begin(), bytes.begin() + 64, messages[i].begin());
+            auto finalChunk = paddedFinalChunk(bytes);
+            std::copy(finalChunk.begin(), finalChunk.end(), messages[i].begin() + 64);
+            std::copy(std::begin(Sha256MultiBuffer::initialState), std::end(Sha256MultiBuffer::initialState), states.begin() + 8 * i);
+        }
+        for (size_t chunk = 0; chunk < 2; ++chunk) {
+            for (size_t i = 0; i < count; ++i) {
+                chunkPointers[i] = messages[i].data() + 64 * chunk;
+            }
+            Sha256MultiBuffer::compress(states.data(), chunkPointers.data(), count);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            Sha256MultiBuffer::storeDigest(states.data() + 8 * i, digests[i].data());
+        }
+    }
+
+private:
+    std::array<unsigned char, BlockHeader::serializedSize> m_bytes;
+    SHA256_CTX m_midstate;
+    uint32_t m_midstateWords[8];
+    std::array<unsigned char, 64> m_finalChunk;
+
+    static std::array<unsigned char, 64> paddedFinalChunk(const std::array<unsigned char, BlockHeader::serializedSize>& bytes) {
+        // Last 24 header bytes, the 0x80 terminator and the 704-bit message length
+        std::array<unsigned char, 64> chunk{};
+        std::copy(bytes.begin() + 64, bytes.end(), chunk.begin());
+        chunk[BlockHeader::serializedSize - 64] = 0x80;
+        const uint64_t bitLength = BlockHeader::serializedSize * 8;
+        for (int i = 0; i < 8; ++i) {
+            chunk[63 - i] = static_cast<unsigned char>(bitLength >> (8 * i));
+        }
+        return chunk;
+    }
+};
+
+// Sibling hashes from a leaf up to the root of a MerkleTree. Levels where the leaf's ancestor was
+// promoted have no sibling, which the verifier works out from the number of leaves.
+struct MerkleProof {
+    size_t index = 0;
+    size_t leafCount = 0;
+    std::vector<Hash256> siblings;
+};
+
+// Merkle tree over transaction hashes. Every level is kept, so appending or replacing a leaf only
+// re-hashes the path from that leaf to the root. An odd node at the end of a level moves up
+// unchanged rather than being paired with itself, so [a, b, c] and [a, b, c, c] have different
+// roots. Leaves and inner nodes are hashed with different leading tags, so an inner node can't be
+// passed off as a leaf in a proof.
+class MerkleTree {
+public:
+    MerkleTree() = default;
+
+    explicit MerkleTree(const std::vector<Hash256>& leaves) : MerkleTree(leaves.data(), leaves.size()) {}
+
+    // Build every level bottom-up, hashing each node once
+    MerkleTree(const Hash256* leaves, size_t count) {
+        if (count == 0) {
+            return;
+        }
+        m_levels.emplace_back(count);
+        for (size_t i = 0; i < count; ++i) {
+            m_levels[0][i] = hashLeaf(leaves[i]);
+        }
+        while (m_levels.back().size() > 1) {
+            const auto& nodes = m_levels.back();
+            std::vector<Hash256> parents((nodes.size() + 1) / 2);
+            for (size_t parent = 0; parent < parents.size(); ++parent) {
+                parents[parent] = parentOf(nodes, 2 * parent);
+            }
+            m_levels.push_back(std::move(parents));
+        }
+    }
+
+    // The root a tree of these leaves would have, without keeping its levels. The scratch comes
+    // from memory, e.g. a BlockArena.
+    static Hash256 computeRoot(const Hash256* leaves, size_t count, std::pmr::memory_resource* memory) {
+        if (count == 0) {
+            return Hash256{};
+        }
+        std::pmr::vector<Hash256> nodes(count, memory);
+        for (size_t i = 0; i < count; ++i) {
+            nodes[i] = hashLeaf(leaves[i]);
+        }
+        // Each parent overwrites a node already consumed, so one buffer holds every level in turn
+        for (size_t width = count; width > 1; width = (width + 1) / 2) {
+            for (size_t parent = 0; 2 * parent < width; ++parent) {
+                size_t left = 2 * parent;
+                nodes[parent] = left + 1 < width ? hashNode(nodes[left], nodes[left + 1]) : nodes[left];
+            }
+        }
+        return nodes[0];
+    }
+
+    // A tree that only knows its root, e.g. for a block whose transactions have been pruned
+    static MerkleTree fromRoot(const Hash256& root) {
+        MerkleTree tree;
+        tree.m_levels.push_back({root});
+        return tree;
+    }
+
+    size_t size() const { return m_levels.empty() ? 0 : m_levels[0].size(); }
+
+    Hash256 getRoot() const {
+        return m_levels.empty() ? Hash256{} : m_levels.back()[0];
+    }
+
+    void append(const Hash256& leaf) {
+        if (m_levels.empty()) {
+            m_levels.emplace_back();
+        }
+        m_levels[0].push_back(hashLeaf(leaf));
+        updatePath(m_levels[0].size() - 1);
+    }
+
+    void replace(size_t index, const Hash256& leaf) {
+        if (index >= size()) {
+            throw std::out_of_range("Merkle leaf index out of range");
+        }
+        m_levels[0][index] = hashLeaf(leaf);
+        updatePath(index);
+    }
+
+    MerkleProof getProof(size_t index) const {
+        if (index >= size()) {
+            throw std::out_of_range("Merkle leaf index out of range");
+        }
+        MerkleProof proof;
+        proof.index = index;
+        proof.leafCount = size();
+        for (size_t level = 0; level + 1 < m_levels.size(); ++level) {
+            const auto& nodes = m_levels[level];
+            if (index % 2 == 1) {
+                proof.siblings.push_back(nodes[index - 1]);
+            } else if (index + 1 < nodes.size()) {
+                proof.siblings.push_back(nodes[index + 1]);
+            }
+            index /= 2;
+        }
+        return proof;
+    }
+
+    static bool verifyProof(const Hash256& leaf, const MerkleProof& proof, const Hash256& root) {
+        if (proof.index >= proof.leafCount) {
+            return false;
+        }
+        Hash256 current = hashLeaf(leaf);
+        size_t index = proof.index;
+        size_t used = 0;
+        for (size_t width = proof.leafCount; width > 1; width = (width + 1) / 2, index /= 2) {
+            if (index % 2 == 0 && index + 1 == width) {
+                continue; // Promoted without a sibling
+            }
+            if (used == proof.siblings.size()) {
+                return false;
+            }
+            const Hash256& sibling = proof.siblings[used++];
+            current = (index % 2 == 0) ? hashNode(current, sibling) : hashNode(sibling, current);
+        }
+        return used == proof.siblings.size() && current == root;
+    }
+
+private:
+    static constexpr unsigned char leafTag = 0x00;
+    static constexpr unsigned char nodeTag = 0x01;
+
+    std::vector<std::vector<Hash256>> m_levels;
+
+    static Hash256 hashLeaf(const Hash256& leaf) {
+        Hash256 digest;
+        SHA256_CTX sha256;
+        SHA256_Init(&sha256);
+        SHA256_Update(&sha256, &leafTag, 1);
+        SHA256_Update(&sha256, leaf.data(), leaf.size());
+        SHA256_Final(digest.data(), &sha256);
+        return digest;
+    }
+
+    static Hash256 hashNode(const Hash256& left, const Hash256& right) {
+        Hash256 digest;
+        SHA256_CTX sha256;
+        SHA256_Init(&sha256);
+        SHA256_Update(&sha256, &nodeTag, 1);
+        SHA256_Update(&sha256, left.data(), left.size());
+        SHA256_Update(&sha256, right.data(), right.size());
+        SHA256_Final(digest.data(), &sha256);
+        return digest;
+    }
+
+    // Parent of the node at an even index: the hash of the pair, or the node itself if it's the last
+    static Hash256 parentOf(const std::vector<Hash256>& nodes, size_t left) {
+        return left + 1 < nodes.size() ? hashNode(nodes[left], nodes[left + 1]) : nodes[left];
+    }
+
+    void updatePath(size_t index) {
+        for (size_t level = 0; m_levels[level].size() > 1; ++level) {
+            if (level + 1 == m_levels.size()) {
+                m_levels.emplace_back();
+            }
+            const auto& nodes = m_levels[level];
+            auto& parents = m_levels[level + 1];
+            size_t parent = index / 2;
+            Hash256 hash = parentOf(nodes, parent * 2);
+            if (parent == parents.size()) {
+                parents.push_back(hash);
+            } else {
+                parents[parent] = hash;
+            }
+            index = parent;
+        }
+    }
+};
+
+class Block {
+public:
+    Block(std::vector<Transaction> transactions, const std::string& previousHash, int64_t timestamp = std::time(nullptr))
+    : m_transactions(std::move(transactions)), m_previousHash(previousHash), m_nonce(0), m_reward(50.0), m_timestamp(timestamp) {
+        rebuildMerkleTree();
+    }
+
+    // Restore a block that has already been mined, e.g. when loading it from a BlockStore
+    Block(std::vector<Transaction> transactions, const std::string& previousHash, int64_t timestamp, uint64_t nonce, double reward, const std::string& hash)
+    : m_transactions(std::move(transactions)), m_previousHash(previousHash), m_hash(hash), m_nonce(nonce), m_reward(reward), m_timestamp(timestamp) {
+        rebuildMerkleTree();
+    }
+
+    // A block known only by its header, e.g. one restored from a StateSnapshot. It's pruned from the start.
+    static Block fromHeader(const BlockHeader& header, const std::string& previousHash, const std::string& hash) {
+        Block block({}, previousHash, header.timestamp, header.nonce, header.reward, hash);
+        block.m_merkleTree = MerkleTree::fromRoot(header.merkleRoot);
+        block.m_pruned = true;
+        return block;
+    }
+
+    // Add a transaction while the block is being assembled, updating the Merkle root in O(log n)
+    void addTransaction(const Transaction& transaction) {
+        m_transactions.push_back(transaction);
+        m_merkleTree.append(transaction.calculateHash());
+    }
+
+    void replaceTransaction(size_t index, const Transaction& transaction) {
+        if (index >= m_transactions.size()) {
+            throw std::out_of_range("Transaction index out of range");
+        }
+        m_transactions[index] = transaction;
+        m_merkleTree.replace(index, transaction.calculateHash());
+    }
+
+    Hash256 getMerkleRoot() const { return m_merkleTree.getRoot(); }
+
+    // Proof that the transaction at index is part of this block, checkable with MerkleTree::verifyProof
+    MerkleProof getMerkleProof(size_t index) const { return m_merkleTree.getProof(index); }
+
+    BlockHeader getHeader() const {
+        BlockHeader header;
+        header.previousHash = hashFromHex(m_previousHash);
+        header.merkleRoot = m_merkleTree.getRoot();
+        header.timestamp = m_timestamp;
+        header.reward = m_reward;
+        header.nonce = m_nonce;
+        return header;
+    }
+
+    std::string calculateHash() const {
+        return toHex(calculateDigest(m_nonce));
+    }
+
+    Hash256 calculateDigest(uint64_t nonce) const {
+        return HeaderHasher(getHeader()).hash(nonce);
+    }
+
+    const std::string& getLastBlockHash() const {
+        return m_previousHash;
+    }
+
+    // Largest total transaction size, as reported by Transaction::getSize, that a block may hold
+    static constexpr size_t maxBlockSize = 1000;
+
+    // Hash rate achieved by a single mining thread during the last mineBlock call
+    struct ThreadMiningStats {
+        uint64_t hashes = 0;
+        double seconds = 0.0;
+        double hashesPerSecond = 0.0;
+    };
+
+    // How long mineBlock searches before giving up, unless told otherwise
+    static constexpr double defaultMiningSeconds = 600.0;
+
+    void mineBlock(int difficulty, const Wallet& minerWallet) {
+        mineBlock(difficulty, minerWallet, std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    // Mine to a target of `difficulty` leading zero hex digits, in compact form like the chain's targets
+    void mineBlock(int difficulty, const Wallet& minerWallet, unsigned int threadCount) {
+        mineBlock(targetFromCompact(compactFromDifficulty(difficulty)), minerWallet, threadCount, defaultMiningSeconds);
+    }
+
+    // Search for a nonce whose header hash is at most target, giving up after maxSeconds. Returns
+    // false if none was found, leaving the block unmined.
+    bool mineBlock(const Hash256& target, const Wallet& minerWallet, unsigned int threadCount, double maxSeconds) {
+        static Metrics::Counter& hashAttempts = Metrics::instance().counter("blockchain_hash_attempts_total", "Block header hashes computed while mining");
+        static Metrics::Gauge& hashRate = Metrics::instance().gauge("blockchain_hash_rate", "Hashes per second over all threads in the last mineBlock call");
+        auto startTime = std::chrono::high_resolution_clock::now();
+        threadCount = std::max(1u, threadCount);
+
+        // Pay the reward to the miner in the first transaction, so the block hash commits to it. The
+        // search only needs the root, so the reward joins the block once a nonce is found and a
+        // search that runs out of time leaves the block as it was. All scratch, down to the list of
+        // workers, comes from the arena, so the search itself stays off the heap apart from starting
+        // extra threads. A successful search does allocate, for what the block keeps: the reward's
+        // slot, the new Merkle tree and the hash string.
+        BlockArena& arena = BlockArena::local();
+        BlockArena::Scope scope(arena);
+        Transaction reward(minerWallet.getName(), minerWallet.getName(), m_reward, 0.0);
+        std::pmr::vector<Hash256> leaves(&arena);
+        leaves.reserve(m_transactions.size() + 1);
+        leaves.push_back(reward.calculateHash());
+        for (const auto& transaction : m_transactions) {
+            leaves.push_back(transaction.calculateHash());
+        }
+        BlockHeader header = getHeader();
+        header.merkleRoot = MerkleTree::computeRoot(leaves.data(), leaves.size(), &arena);
+        HeaderHasher hasher(header);
+
+        // Thread t searches the nonces t, t + threadCount, t + 2 * threadCount, ... so the slices
+        // never overlap. The lowest winning nonce is kept, which makes the result independent of
+        // the number of threads and identical to a sequential search starting at zero.
+        const uint64_t notFound = std::numeric_limits<uint64_t>::max();
+        std::atomic<uint64_t> bestNonce(notFound);
+        std::atomic<bool> timedOut(false);
+        std::pmr::vector<ThreadMiningStats> stats(threadCount, &arena);
+        std::pmr::vector<std::thread> workers(&arena);
+        workers.reserve(threadCount);
+
+        auto searchSlice = [&](unsigned int threadIndex) {
+            ThreadMiningStats& threadStats = stats[threadIndex];
+            const size_t batchSize = Sha256MultiBuffer::maxLanes;
+            uint64_t nonces[batchSize];
+            Hash256 digests[batchSize];
+            uint64_t batches = 0;
+
+            // Each batch hashes the next batchSize nonces of this thread's slice in one multi-buffer pass
+            for (uint64_t first = threadIndex; first < bestNonce.load(std::memory_order_relaxed); first += batchSize * threadCount) {
+                // Check if it's time to give up, but only every 64 batches to keep the clock out of the hot loop
+                if ((batches++ & 0x3F) == 0) {
+                    if (timedOut.load(std::memory_order_relaxed)) {
+                        break;
+                    }
+                    auto currentTime = std::chrono::high_resolution_clock::now();
+                    double timeElapsed = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - startTime).count() / 1000.0;
+                    if (timeElapsed > maxSeconds) {
+                        timedOut.store(true, std::memory_order_relaxed);
+                        break;
+                    }
+                }
+
+                for (size_t i = 0; i < batchSize; ++i) {
+                    nonces[i] = first + i * threadCount;
+                }
+                hasher.hashBatch(nonces, batchSize, digests);
+                threadStats.hashes += batchSize;
+                hashAttempts.add(batchSize);
+
+                // Publish the lowest matching nonce if it beats the best one found so far, the other threads stop once they pass it
+                auto match = std::find_if(digests, digests + batchSize, [&](const Hash256& digest) { return meetsTarget(digest, target); });
+                if (match != digests + batchSize) {
+                    uint64_t nonce = nonces[match - digests];
+                    uint64_t current = bestNonce.load(std::memory_order_relaxed);
+                    while (nonce < current && !bestNonce.compare_exchange_weak(current, nonce, std::memory_order_relaxed)) {
+                    }
+                    break;
+                }
+            }
+            threadStats.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+            threadStats.hashesPerSecond = threadStats.seconds > 0.0 ? threadStats.hashes / threadStats.seconds : 0.0;
+        };
+
+        for (unsigned int i = 1; i < threadCount; ++i) {
+            workers.emplace_back(searchSlice, i);
+        }
+        searchSlice(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        m_miningStats.assign(stats.begin(), stats.end());
+        uint64_t hashes = 0;
+        for (const auto& threadStats : m_miningStats) {
+            hashes += threadStats.hashes;
+        }
+        double miningSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+        hashRate.set(miningSeconds > 0.0 ? hashes / miningSeconds : 0.0);
+
+        // Check if a matching hash was found and the block size is within the limit
+        uint64_t winningNonce = bestNonce.load();
+        if (winningNonce != notFound && calculateBlockSize() + reward.getSize() <= maxBlockSize) {
+            m_transactions.insert(m_transactions.begin(), std::move(reward));
+            m_merkleTree = MerkleTree(leaves.data(), leaves.size());
+            m_nonce = winningNonce;
+            m_hash = calculateHash();
+            Logger::instance().log(Logger::Level::Info, "block mined", {{"hash", m_hash}, {"nonce", m_nonce}, {"transactions", m_transactions.size()}});
+            for (size_t i = 0; i < m_miningStats.size(); ++i) {
+                Logger::instance().log(Logger::Level::Debug, "mining thread", {{"thread", i}, {"hashesPerSecond", m_miningStats[i].hashesPerSecond}});
+            }
+            return true;
+        }
+
+        // If we get here, the time limit was exceeded. The chain retargets from block timestamps, so
+        // there's nothing to adjust here.
+        Logger::instance().log(Logger::Level::Warning, "block mining failed", {{"hashes", hashes}, {"maxSeconds", maxSeconds}});
+        return false;
+    }
+
+    const std::vector<Transaction>& getTransactions() const { return m_transactions; }
+    const std::string& getPreviousHash() const { return m_previousHash; }
+    const std::string& getHash() const { return m_hash; }
+    double getReward() const { return m_reward; }
+    uint64_t getNonce() const { return m_nonce; }
+    int64_t getTimestamp() const { return m_timestamp; }
+    size_t getBlockSize() const { return calculateBlockSize(); }
+    std::vector<ThreadMiningStats> getMiningStats() const { return m_miningStats; }
+
+    // Free the transactions of a block deep enough in the chain that nothing reads them any more.
+    // The Merkle tree shrinks to its root, so the header and hash stay the same; proofs can't be
+    // made from a pruned block.
+    void pruneTransactions() {
+        Hash256 root = getMerkleRoot();
+        std::vector<Transaction>().swap(m_transactions);
+        std::vector<ThreadMiningStats>().swap(m_miningStats);
+        m_merkleTree = MerkleTree::fromRoot(root);
+        m_pruned = true;
+    }
+
+    bool isPruned() const { return m_pruned; }
+
+private:
+    std::vector<Transaction> m_transactions;
+    std::string m_previousHash;
+    std::string m_hash;
+    uint64_t m_nonce;
+    double m_reward;
+    int64_t m_timestamp;
+    std::vector<ThreadMiningStats> m_miningStats;
+    MerkleTree m_merkleTree;
+    bool m_pruned = false;
+
+    void rebuildMerkleTree() {
+        BlockArena& arena = BlockArena::local();
+        BlockArena::Scope scope(arena);
+        std::pmr::vector<Hash256> leaves(&arena);
+        leaves.reserve(m_transactions.size());
+        for (const auto& transaction : m_transactions) {
+            leaves.push_back(transaction.calculateHash());
+        }
+        m_merkleTree = MerkleTree(leaves.data(), leaves.size());
+    }
+
+    size_t calculateBlockSize() const {
+        size_t size = 0;
+        for (const auto& transaction : m_transactions) {
+            size += transaction.getSize();
+        }
+        return size;
+    }
+
+    double calculateTotalFee() const {
+        double totalFee = 0.0;
+
+        // Create a lambda function to calculate the fee for a single transaction
+        auto calculateTransactionFee = [] (const Transaction& t) {
+            return t.getFee();
+        };
+
+        // Use a range-based loop to calculate the fee for each transaction and add it to the total
+        for (const auto& transaction : m_transactions) {
+            totalFee += calculateTransactionFee(transaction);
+        }
+
+        // Return the total fee collected from all transactions in the block
+        return totalFee;
+    }
+};
+
+// Pool of validated transactions waiting to be mined. Transactions are indexed by id, by sender
+// and by fee density (fee per byte of Transaction::getSize), so block templates are filled from
+// the best paying transactions without sorting the whole pool. When the memory cap is exceeded
+// the lowest fee density transactions are evicted first.
+class Mempool {
+public:
+    enum class AddResult { Added, Duplicate, Invalid, FeeTooLow, BadSignature, TooLarge };
+
+    explicit Mempool(size_t maxMemoryBytes = 64 * 1024 * 1024) : m_maxMemoryBytes(maxMemoryBytes) {}
+
+    // Only accept signed transactions from now on, verifying their signatures through cache, or
+    // accept unsigned ones again if cache is null
+    void requireSignatures(SignatureCache* cache) { m_signatureCache = cache; }
+
+    // Judge transactions with check, e.g. against their sender's history on the chain, rather than
+    // with Transaction::isValid and the history they carry. An empty check restores isValid.
+    void setTransactionCheck(std::function<bool(const Transaction&)> check) { m_check = std::move(check); }
+
+    AddResult add(const Transaction& transaction) {
+        return add(transaction, m_check ? m_check(transaction) : transaction.isValid());
+    }
+
+    // Add a transaction whose check has already been run, with valid its outcome, e.g. for a caller
+    // holding a lock the check would take
+    AddResult add(const Transaction& transaction, bool valid) {
+        Hash256 id = transaction.calculateHash();
+        if (!valid) {
+            return AddResult::Invalid;
+        }
+        if (m_signatureCache && !m_signatureCache->verify(transaction)) {
+            return AddResult::BadSignature;
+        }
+
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        if (m_byId.count(id) != 0) {
+            return AddResult::Duplicate;
+        }
+
+        Entry entry{transaction, transaction.getSize(), 0.0, m_nextSequence++};
+        entry.feeRate = transaction.getFee() / static_cast<double>(entry.size);
+        size_t memory = memoryUsage(entry);
+
+        if (memory > m_maxMemoryBytes) {
+            return AddResult::TooLarge;
+        }
+
+        // Make room by evicting strictly cheaper transactions, but only once it is clear that
+        // evicting them frees enough, so a rejected transaction leaves the pool untouched
+        if (m_memoryBytes + memory > m_maxMemoryBytes) {
+            size_t needed = m_memoryBytes + memory - m_maxMemoryBytes;
+            size_t freed = 0;
+            size_t evictions = 0;
+            for (auto it = m_byFeeRate.rbegin(); it != m_byFeeRate.rend() && freed < needed; ++it) {
+                if (it->feeRate >= entry.feeRate) {
+                    break;
+                }
+                freed += memoryUsage(m_byId.at(it->id));
+                ++evictions;
+            }
+            if (freed < needed) {
+                return AddResult::FeeTooLow;
+            }
+            for (; evictions > 0; --evictions) {
+                // Copied, since removing the transaction frees the key
+                FeeKey cheapest = *m_byFeeRate.rbegin();
+                removeLocked(cheapest.id);
+            }
+        }
+
+        m_byFeeRate.insert(FeeKey{entry.feeRate, entry.sequence, id});
+        m_bySender[transaction.getSender()].insert(id);
+        m_byId.emplace(id, std::move(entry));
+        m_memoryBytes += memory;
+        updateSizeGauge();
+        return AddResult::Added;
+    }
+
+    bool remove(const Hash256& id) {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        bool removed = removeLocked(id);
+        updateSizeGauge();
+        return removed;
+    }
+
+    // Drop the transactions a newly connected block has confirmed
+    void removeForBlock(const Block& block) {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        for (const auto& transaction : block.getTransactions()) {
+            removeLocked(transaction.calculateHash());
+        }
+        updateSizeGauge();
+    }
+
+    bool contains(const Hash256& id) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_byId.count(id) != 0;
+    }
+
+    std::optional<Transaction> get(const Hash256& id) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        auto it = m_byId.find(id);
+        if (it == m_byId.end()) {
+            return std::nullopt;
+        }
+        return it->second.transaction;
+    }
+
+    // Call function(id, transaction) for every pending transaction, holding the pool's shared lock
+    template <typename Function>
+    void forEach(Function function) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        for (const auto& [id, entry] : m_byId) {
+            function(id, entry.transaction);
+        }
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_byId.size();
+    }
+
+    size_t getMemoryUsage() const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_memoryBytes;
+    }
+
+    std::vector<Transaction> getBySender(const std::string& sender) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        std::vector<Transaction> transactions;
+        auto it = m_bySender.find(sender);
+        if (it != m_bySender.end()) {
+            for (const auto& id : it->second) {
+                transactions.push_back(m_byId.at(id).transaction);
+            }
+        }
+        return transactions;
+    }
+
+    // Pick transactions in fee density order until maxBytes is used up. Transactions that don't fit
+    // are skipped, but the scan gives up after maxConsecutiveMisses of them so a nearly full block
+    // doesn't walk the whole pool.
+    std::vector<Transaction> selectTransactions(size_t maxBytes) const {
+        const size_t maxConsecutiveMisses = 1000;
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        std::vector<Transaction> selected;
+        size_t usedBytes = 0;
+        size_t misses = 0;
+        for (const auto& key : m_byFeeRate) {
+            const Entry& entry = m_byId.at(key.id);
+            if (usedBytes + entry.size > maxBytes) {
+                if (++misses >= maxConsecutiveMisses) {
+                    break;
+                }
+                continue;
+            }
+            misses = 0;
+            usedBytes += entry.size;
+            selected.push_back(entry.transaction);
+        }
+        return selected;
+    }
+
+    // Block on top of previousHash holding the best paying transactions that fit, leaving room for the mining reward
+    Block buildBlockTemplate(const std::string& previousHash, const std::string& minerName) const {
+        size_t rewardSize = Transaction(minerName, minerName, 0.0, 0.0).getSize();
+        size_t available = Block::maxBlockSize > rewardSize ? Block::maxBlockSize - rewardSize : 0;
+        return Block(selectTransactions(available), previousHash);
+    }
+
+private:
+    struct Entry {
+        Transaction transaction;
+        size_t size;
+        double feeRate;
+        uint64_t sequence;
+    };
+
+    // Highest fee density first, oldest first among equal fee densities
+    struct FeeKey {
+        double feeRate;
+        uint64_t sequence;
+        Hash256 id;
+
+        bool operator<(const FeeKey& other) const {
+            if (feeRate != other.feeRate) {
+                return feeRate > other.feeRate;
+            }
+            return sequence < other.sequence;
+        }
+    };
+
+    size_t m_maxMemoryBytes;
+    size_t m_memoryBytes = 0;
+    SignatureCache* m_signatureCache = nullptr;
+    std::function<bool(const Transaction&)> m_check;
+    uint64_t m_nextSequence = 0;
+    std::unordered_map<Hash256, Entry, Hash256Hasher> m_byId;
+    std::unordered_map<std::string, std::unordered_set<Hash256, Hash256Hasher>> m_bySender;
+    std::set<FeeKey> m_byFeeRate;
+    mutable std::shared_mutex m_mutex;
+
+    // A node runs one mempool, so the gauge simply follows whichever pool changed last
+    void updateSizeGauge() const {
+        static Metrics::Gauge& transactions = Metrics::instance().gauge("blockchain_mempool_transactions", "Transactions waiting in the mempool");
+        static Metrics::Gauge& bytes = Metrics::instance().gauge("blockchain_mempool_bytes", "Estimated memory used by the mempool");
+        transactions.set(static_cast<double>(m_byId.size()));
+        bytes.set(static_cast<double>(m_memoryBytes));
+    }
+
+    static size_t memoryUsage(const Entry& entry) {
+        // Encoded size plus a rough allowance for the node and index overhead
+        return entry.size + sizeof(Entry) + sizeof(FeeKey) + 128;
+    }
+
+    bool removeLocked(const Hash256& id) {
+        auto it = m_byId.find(id);
+        if (it == m_byId.end()) {
+            return false;
+        }
+        const Entry& entry = it->second;
+        m_byFeeRate.erase(FeeKey{entry.feeRate, entry.sequence, id});
+        auto sender = m_bySender.find(entry.transaction.getSender());
+        if (sender != m_bySender.end()) {
+            sender->second.erase(id);
+            if (sender->second.empty()) {
+                m_bySender.erase(sender);
+            }
+        }
+        m_memoryBytes -= memoryUsage(entry);
+        m_byId.erase(it);
+        return true;
+    }
+};
+
+inline void appendU32(std::string& bytes, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        bytes.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+inline void appendDouble(std::string& bytes, double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; ++i) {
+        bytes.push_back(static_cast<char>(bits >> (8 * i)));
+    }
+}
+
+inline void appendString(std::string& bytes, std::string_view value) {
+    appendVarint(bytes, value.size());
+    bytes.append(value.data(), value.size());
+}
+
+// The addresses a record refers to by index. Each distinct address is stored once:
+//   varint count | u32 offset[count] | str address...
+// where each offset is from the start of the record, so any address is found in O(1).
+class AddressListView {
+public:
+    AddressListView() = default;
+
+    // Parse the list at the reader's position, leaving the reader just past it
+    AddressListView(ByteReader& reader, const unsigned char* record) : m_record(record), m_end(reader.end) {
+        m_count = reader.readVarint();
+        m_offsets = reader.position;
+        reader.skip(m_count, 4);
+        for (size_t i = 0; i < m_count && !reader.failed; ++i) {
+            reader.readString();
+        }
+        m_failed = reader.failed;
+    }
+
+    size_t size() const { return m_count; }
+
+    std::string_view get(size_t index) const {
+        if (index >= m_count) {
+            return std::string_view();
+        }
+        uint32_t offset;
+        std::memcpy(&offset, m_offsets + 4 * index, sizeof(offset));
+        if (offset >= static_cast<size_t>(m_end - m_record)) {
+            return std::string_view();
+        }
+        ByteReader reader(m_record + offset, m_end);
+        return reader.readString();
+    }
+
+    // Every entry was inside the record and every offset points inside it
+    bool isWellFormed() const {
+        if (m_failed) {
+            return false;
+        }
+        for (size_t i = 0; i < m_count; ++i) {
+            uint32_t offset;
+            std::memcpy(&offset, m_offsets + 4 * i, sizeof(offset));
+            if (offset >= static_cast<size_t>(m_end - m_record)) {
+                return false;
+            }
+            ByteReader reader(m_record + offset, m_end);
+            reader.readString();
+            if (reader.failed) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Append a list to bytes, where the record being built started at recordStart
+    static void encode(std::string& bytes, size_t recordStart, const std::vector<std::string_view>& addresses) {
+        appendVarint(bytes, addresses.size());
+        size_t offsetTable = bytes.size();
+        bytes.resize(bytes.size() + 4 * addresses.size());
+        for (size_t i = 0; i < addresses.size(); ++i) {
+            uint32_t offset = static_cast<uint32_t>(bytes.size() - recordStart);
+            std::memcpy(&bytes[offsetTable + 4 * i], &offset, sizeof(offset));
+            appendString(bytes, addresses[i]);
+        }
+    }
+
+private:
+    const unsigned char* m_record = nullptr;
+    const unsigned char* m_end = nullptr;
+    const unsigned char* m_offsets = nullptr;
+    size_t m_count = 0;
+    bool m_failed = false;
+};
+
+// Read-only view of one encoded transaction. Strings point into the record.
+//   varint senderIndex | varint recipientIndex | svarint amountUnits | svarint feeUnits |
+//   svarint timestamp | varint recipientCount | str recipientList[recipientCount] |
+//   varint sentCount | f64 senderSent[sentCount] | str signature
+// The indexes refer to the address list of the enclosing record, the signature is empty for an
+// unsigned transaction and the 64 bytes of Transaction::getSignature otherwise, str is a varint length followed
+// by the bytes, svarint is a zigzag varint, and f64 is little-endian. A transaction on its own,
+// e.g. as relayed between nodes, is the record
+//   u8 version | address list | transaction
+// whose size Transaction::getSize reports.
+class TransactionView {
+public:
+    TransactionView(const unsigned char* data, const unsigned char* end, const AddressListView& addresses) : m_addresses(addresses) {
+        ByteReader reader(data, end);
+        m_senderIndex = reader.readVarint();
+        m_recipientIndex = reader.readVarint();
+        m_amountUnits = reader.readSignedVarint();
+        m_feeUnits = reader.readSignedVarint();
+        m_timestamp = reader.readSignedVarint();
+        m_recipientCount = reader.readVarint();
+        m_recipientList = reader.position;
+        for (size_t i = 0; i < m_recipientCount && !reader.failed; ++i) {
+            reader.readString();
+        }
+        m_sentCount = reader.readVarint();
+        m_senderSent = reader.position;
+        reader.skip(m_sentCount, 8);
+        m_signature = reader.readString();
+        m_end = reader.end;
+        m_failed = reader.failed || m_senderIndex >= addresses.size() || m_recipientIndex >= addresses.size() ||
+                   (!m_signature.empty() && m_signature.size() != std::tuple_size<Ed25519::Signature>::value);
+    }
+
+    // View of a standalone transaction record, as produced by encode
+    static TransactionView fromRecord(const unsigned char* data, size_t size) {
+        ByteReader reader(data, data + size);
+        bool versionMatches = reader.readU8() == formatVersion;
+        AddressListView addresses(reader, data);
+        TransactionView view(reader.position, reader.end, addresses);
+        view.m_failed = view.m_failed || reader.failed || !versionMatches || !addresses.isWellFormed();
+        return view;
+    }
+
+    static constexpr uint8_t formatVersion = 6;
+
+    // Every field was inside the record and the address indexes are in range
+    bool isWellFormed() const { return !m_failed; }
+
+    std::string_view getSender() const { return m_addresses.get(m_senderIndex); }
+    std::string_view getRecipient() const { return m_addresses.get(m_recipientIndex); }
+    size_t getSenderIndex() const { return m_senderIndex; }
+    size_t getRecipientIndex() const { return m_recipientIndex; }
+    int64_t getAmountUnits() const { return m_amountUnits; }
+    int64_t getFeeUnits() const { return m_feeUnits; }
+    double getAmount() const { return Transaction::fromUnits(m_amountUnits); }
+    double getFee() const { return Transaction::fromUnits(m_feeUnits); }
+    int64_t getTimestamp() const { return m_timestamp; }
+
+    size_t getRecipientCount() const { return m_recipientCount; }
+    std::string_view getRecipientListEntry(size_t index) const {
+        ByteReader reader(m_recipientList, m_end);
+        for (size_t i = 0; i < index; ++i) {
+            reader.readString();
+        }
+        return reader.readString();
+    }
+
+    size_t getSenderSentCount() const { return m_sentCount; }
+    double getSenderSent(size_t index) const {
+        double value;
+        std::memcpy(&value, m_senderSent + 8 * index, sizeof(value));
+        return value;
+    }
+
+    bool isSigned() const { return !m_signature.empty(); }
+
+    // Build a Transaction, looking addresses up by the ids they were interned as
+    Transaction toTransaction(const std::vector<uint32_t>& addressIds) const {
+        Transaction transaction = Transaction::fromInterned(addressIds[m_senderIndex], addressIds[m_recipientIndex], m_amountUnits, m_feeUnits, m_timestamp);
+        if (m_sentCount > 0) {
+            std::vector<double> senderSent(m_sentCount);
+            std::memcpy(senderSent.data(), m_senderSent, 8 * m_sentCount);
+            transaction.setSenderSent(std::move(senderSent));
+        }
+        if (m_recipientCount > 0) {
+            std::vector<std::string> recipientList;
+            recipientList.reserve(m_recipientCount);
+            ByteReader reader(m_recipientList, m_end);
+            for (size_t i = 0; i < m_recipientCount; ++i) {
+                recipientList.emplace_back(reader.readString());
+            }
+            transaction.setRecipientList(std::move(recipientList));
+        }
+        if (isSigned()) {
+            Ed25519::Signature signature;
+            std::memcpy(signature.data(), m_signature.data(), signature.size());
+            transaction.setSignature(signature);
+        }
+        return transaction;
+    }
+
+    Transaction toTransaction() const {
+        return toTransaction({AddressTable::global().intern(getSender()), AddressTable::global().intern(getRecipient())});
+    }
+
+    static std::string encode(const Transaction& transaction) {
+        std::string bytes;
+        bytes.reserve(transaction.getSize());
+        bytes.push_back(static_cast<char>(formatVersion));
+        bool selfPayment = transaction.getSenderId() == transaction.getRecipientId();
+        std::vector<std::string_view> addresses{transaction.getSender()};
+        if (!selfPayment) {
+            addresses.push_back(transaction.getRecipient());
+        }
+        AddressListView::encode(bytes, 0, addresses);
+        encode(bytes, transaction, 0, selfPayment ? 0 : 1);
+        return bytes;
+    }
+
+    // Append the transaction with its addresses at the given indexes of the enclosing record's list
+    static void encode(std::string& bytes, const Transaction& transaction, uint32_t senderIndex, uint32_t recipientIndex) {
+        appendVarint(bytes, senderIndex);
+        appendVarint(bytes, recipientIndex);
+        appendVarint(bytes, zigzagEncode(transaction.getAmountUnits()));
+        appendVarint(bytes, zigzagEncode(transaction.getFeeUnits()));
+        appendVarint(bytes, zigzagEncode(transaction.getTimestamp()));
+        const std::vector<std::string>& recipientList = transaction.getRecipientList();
+        appendVarint(bytes, recipientList.size());
+        for (const auto& recipient : recipientList) {
+            appendString(bytes, recipient);
+        }
+        const std::vector<double>& senderSent = transaction.getSenderSent();
+        appendVarint(bytes, senderSent.size());
+        for (double sent : senderSent) {
+            appendDouble(bytes, sent);
+        }
+        const std::optional<Ed25519::Signature>& signature = transaction.getSignature();
+        appendString(bytes, signature ? std::string_view(reinterpret_cast<const char*>(signature->data()), signature->size()) : std::string_view());
+    }
+
+private:
+    AddressListView m_addresses;
+    uint64_t m_senderIndex;
+    uint64_t m_recipientIndex;
+    int64_t m_amountUnits;
+    int64_t m_feeUnits;
+    int64_t m_timestamp;
+    uint64_t m_recipientCount;
+    const unsigned char* m_recipientList;
+    uint64_t m_sentCount;
+    const unsigned char* m_senderSent;
+    std::string_view m_signature;
+    const unsigned char* m_end;
+    bool m_failed;
+};
+
+// Read-only view of an encoded block, as kept by BlockStore and sent between nodes:
+//   u8 version | hash previousHash | hash hash | svarint timestamp | f64 reward | varint nonce |
+//   u8 merkleRoot[32] | address list | varint transactionCount | u32 transactionOffset[transactionCount] | transactions...
+// Every address the transactions use is stored once in the block's list, and the offsets are from
+// the start of the record so any transaction can be reached without walking the others. A hash is
+// a u8 tag and then either the 32 bytes of a hex digest, or a str for anything else, such as the
+// genesis block's previous hash. The Merkle root lets the header be read without the transactions;
+// toBlock recomputes it from them, so a record whose root doesn't match fails the hash check.
+class BlockView {
+public:
+    BlockView(const unsigned char* data, size_t size) : m_data(data), m_size(size) {
+        ByteReader reader(data, data + size);
+        m_version = reader.readU8();
+        m_previousHash = reader.position;
+        skipHash(reader);
+        m_hash = reader.position;
+        skipHash(reader);
+        m_timestamp = reader.readSignedVarint();
+        m_reward = reader.readDouble();
+        m_nonce = reader.readVarint();
+        m_merkleRoot = reader.position;
+        reader.skip(1, SHA256_DIGEST_LENGTH);
+        m_addresses = AddressListView(reader, data);
+        m_transactionCount = reader.readVarint();
+        m_transactionOffsets = reader.position;
+        reader.skip(m_transactionCount, 4);
+        m_failed = reader.failed;
+    }
+
+    static constexpr uint8_t formatVersion = TransactionView::formatVersion;
+
+    const unsigned char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+    uint8_t getVersion() const { return m_version; }
+    std::string getPreviousHash() const { return readHash(m_previousHash); }
+    std::string getHash() const { return readHash(m_hash); }
+    int64_t getTimestamp() const { return m_timestamp; }
+    double getReward() const { return m_reward; }
+    uint64_t getNonce() const { return m_nonce; }
+    const AddressListView& getAddresses() const { return m_addresses; }
+
+    // The header as recorded, without decoding any transaction
+    BlockHeader getHeader() const {
+        BlockHeader header;
+        header.previousHash = hashFromHex(getPreviousHash());
+        if (!m_failed) {
+            std::memcpy(header.merkleRoot.data(), m_merkleRoot, header.merkleRoot.size());
+        }
+        header.timestamp = m_timestamp;
+        header.reward = m_reward;
+        header.nonce = m_nonce;
+        return header;
+    }
+
+    size_t getTransactionCount() const { return m_transactionCount; }
+    TransactionView getTransaction(size_t index) const {
+        uint32_t offset;
+        std::memcpy(&offset, m_transactionOffsets + 4 * index, sizeof(offset));
+        return TransactionView(m_data + std::min<size_t>(offset, m_size), m_data + m_size, m_addresses);
+    }
+
+    // Check the whole record before trusting it, e.g. when it came from a peer: the version is
+    // current and every field of every transaction lies inside the record
+    bool isWellFormed() const {
+        if (m_failed || m_version != formatVersion || !m_addresses.isWellFormed()) {
+            return false;
+        }
+        for (size_t i = 0; i < m_transactionCount; ++i) {
+            if (!getTransaction(i).isWellFormed()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Block toBlock() const {
+        // Intern each address once for the whole block rather than once per use
+        std::vector<uint32_t> addressIds(m_addresses.size());
+        for (size_t i = 0; i < addressIds.size(); ++i) {
+            addressIds[i] = AddressTable::global().intern(m_addresses.get(i));
+        }
+        std::vector<Transaction> transactions;
+        transactions.reserve(m_transactionCount);
+        for (size_t i = 0; i < m_transactionCount; ++i) {
+            transactions.push_back(getTransaction(i).toTransaction(addressIds));
+        }
+        return Block(std::move(transactions), getPreviousHash(), m_timestamp, m_nonce, m_reward, getHash());
+    }
+
+    static std::string encode(const Block& block) {
+        const std::vector<Transaction>& transactions = block.getTransactions();
+        std::string bytes;
+        bytes.reserve(128 + block.getBlockSize());
+        bytes.push_back(static_cast<char>(formatVersion));
+        appendHash(bytes, block.getPreviousHash());
+        appendHash(bytes, block.getHash());
+        appendVarint(bytes, zigzagEncode(block.getTimestamp()));
+        appendDouble(bytes, block.getReward());
+        appendVarint(bytes, block.getNonce());
+        Hash256 merkleRoot = block.getMerkleRoot();
+        bytes.append(reinterpret_cast<const char*>(merkleRoot.data()), merkleRoot.size());
+
+        // Number the addresses in order of first use
+        std::vector<std::string_view> addresses;
+        std::unordered_map<uint32_t, uint32_t> indexes;
+        auto indexOf = [&](uint32_t id, const std::string& address) {
+            auto [it, inserted] = indexes.try_emplace(id, static_cast<uint32_t>(addresses.size()));
+            if (inserted) {
+                addresses.push_back(address);
+            }
+            return it->second;
+        };
+        std::vector<std::pair<uint32_t, uint32_t>> transactionIndexes;
+        transactionIndexes.reserve(transactions.size());
+        for (const auto& transaction : transactions) {
+            uint32_t sender = indexOf(transaction.getSenderId(), transaction.getSender());
+            uint32_t recipient = indexOf(transaction.getRecipientId(), transaction.getRecipient());
+            transactionIndexes.emplace_back(sender, recipient);
+        }
+        AddressListView::encode(bytes, 0, addresses);
+
+        appendVarint(bytes, transactions.size());
+        size_t offsetTable = bytes.size();
+        bytes.resize(bytes.size() + 4 * transactions.size());
+        for (size_t i = 0; i < transactions.size(); ++i) {
+            uint32_t offset = static_cast<uint32_t>(bytes.size());
+            std::memcpy(&bytes[offsetTable + 4 * i], &offset, sizeof(offset));
+            TransactionView::encode(bytes, transactions[i], transactionIndexes[i].first, transactionIndexes[i].second);
+        }
+        return bytes;
+    }
+
+private:
+    static constexpr uint8_t digestTag = 0;
+    static constexpr uint8_t stringTag = 1;
+
+    const unsigned char* m_data;
+    size_t m_size;
+    uint8_t m_version;
+    const unsigned char* m_previousHash;
+    const unsigned char* m_hash;
+    int64_t m_timestamp;
+    double m_reward;
+    uint64_t m_nonce;
+    const unsigned char* m_merkleRoot;
+    AddressListView m_addresses;
+    uint64_t m_transactionCount;
+    const unsigned char* m_transactionOffsets;
+    bool m_failed;
+
+    std::string readHash(const unsigned char* field) const {
+        ByteReader reader(field, m_data + m_size);
+        if (reader.readU8() == digestTag) {
+            Hash256 digest{};
+            std::string_view bytes = reader.readBytes(digest.size());
+            std::memcpy(digest.data(), bytes.data(), bytes.size());
+            return toHex(digest);
+        }
+        return std::string(reader.readString());
+    }
+
+    static void skipHash(ByteReader& reader) {
+        if (reader.readU8() == digestTag) {
+            reader.skip(1, SHA256_DIGEST_LENGTH);
+        } else {
+            reader.readString();
+        }
+    }
+
+    static void appendHash(std::string& bytes, const std::string& hash) {
+        bool isDigest = hash.size() == 2 * SHA256_DIGEST_LENGTH &&
+                        std::all_of(hash.begin(), hash.end(), [](char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+        if (isDigest) {
+            bytes.push_back(static_cast<char>(digestTag));
+            Hash256 digest = hashFromHex(hash);
+            bytes.append(reinterpret_cast<const char*>(digest.data()), digest.size());
+        } else {
+            bytes.push_back(static_cast<char>(stringTag));
+            appendString(bytes, hash);
+        }
+    }
+};
+
+// Append-only on-disk block storage. Records go into numbered segment files, and a separate index
+// file holds one fixed-size (segment, offset, size) entry per height, so reopening a store only
+// reads the index. Each segment is mapped once at its maximum size, so views handed out by get()
+// stay valid while the store is open, even as more blocks are appended. Pruning deletes whole
+// segments from the oldest; the index keeps their entries so heights don't shift.
+class BlockStore {
+public:
+    static constexpr size_t defaultSegmentSize = 128 * 1024 * 1024;
+
+    explicit BlockStore(const std::string& directory, size_t maxSegmentSize = defaultSegmentSize)
+        : m_directory(directory), m_maxSegmentSize(maxSegmentSize) {
+        std::filesystem::create_directories(m_directory);
+        openIndex();
+    }
+
+    ~BlockStore() {
+        for (auto& segment : m_segments) {
+            if (segment.mapping != MAP_FAILED) {
+                munmap(segment.mapping, m_maxSegmentSize);
+            }
+            if (segment.fd >= 0) {
+                close(segment.fd);
+            }
+        }
+        if (m_indexFd >= 0) {
+            close(m_indexFd);
+        }
+    }
+
+    BlockStore(const BlockStore&) = delete;
+    BlockStore& operator=(const BlockStore&) = delete;
+
+    size_t size() const {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_index.size();
+    }
+
+    // Lowest height whose record is still on disk
+    size_t getFirstHeight() const {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return firstHeight();
+    }
+
+    // Zero-copy access to the block at the given height
+    BlockView get(size_t height) const {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (height >= m_index.size()) {
+            throw std::out_of_range("Block height out of range");
+        }
+        const IndexEntry& entry = m_index[height];
+        if (entry.segment < m_firstSegment) {
+            throw std::out_of_range("Block at height " + std::to_string(height) + " has been pruned");
+        }
+        // A corrupt index mustn't send reads past the data, or past the mapping
+        const Segment& stored = segment(entry.segment);
+        if (entry.offset > stored.fileSize || entry.size > stored.fileSize - entry.offset) {
+            throw std::runtime_error("Block index entry for height " + std::to_string(height) + " lies outside its segment");
+        }
+        const unsigned char* base = static_cast<const unsigned char*>(stored.mapping);
+        return BlockView(base + entry.offset, entry.size);
+    }
+
+    size_t append(const Block& block) {
+        std::string record = BlockView::encode(block);
+        if (record.size() > m_maxSegmentSize) {
+            throw std::length_error("Block record is larger than a store segment");
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        IndexEntry entry{};
+        entry.size = static_cast<uint32_t>(record.size());
+        if (!m_index.empty()) {
+            const IndexEntry& last = m_index.back();
+            entry.segment = last.segment;
+            entry.offset = last.offset + last.size;
+        }
+        if (entry.offset + record.size() > m_maxSegmentSize) {
+            entry.segment++;
+            entry.offset = 0;
+        }
+
+        // Write the record and flush it to disk before its index entry, so a crash never leaves an
+        // entry without data
+        Segment& target = segment(entry.segment);
+        writeAll(target.fd, record.data(), record.size(), entry.offset);
+        if (fdatasync(target.fd) != 0) {
+            throw std::runtime_error("Failed to flush block segment");
+        }
+        target.fileSize = std::max<uint64_t>(target.fileSize, entry.offset + record.size());
+        writeAll(m_indexFd, &entry, sizeof(entry), sizeof(IndexEntry) * m_index.size());
+        m_index.push_back(entry);
+        return m_index.size() - 1;
+    }
+
+    // Drop every block at or above height, e.g. when the active chain is rolled back
+    void truncate(size_t height) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (height >= m_index.size()) {
+            return;
+        }
+        m_index.resize(height);
+        if (ftruncate(m_indexFd, sizeof(IndexEntry) * height) != 0) {
+            throw std::runtime_error("Failed to truncate block index");
+        }
+    }
+
+    // Delete the segments that hold nothing but blocks below height. The segment being appended to
+    // always stays. Views into a deleted segment must not be used afterwards.
+    void prune(size_t height) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_index.empty()) {
+            return;
+        }
+        uint32_t keep = m_index[std::min(height, m_index.size() - 1)].segment;
+        for (; m_firstSegment < keep; ++m_firstSegment) {
+            if (m_firstSegment < m_segments.size()) {
+                Segment& segment = m_segments[m_firstSegment];
+                if (segment.mapping != MAP_FAILED) {
+                    munmap(segment.mapping, m_maxSegmentSize);
+                    segment.mapping = MAP_FAILED;
+                }
+                if (segment.fd >= 0) {
+                    close(segment.fd);
+                    segment.fd = -1;
+                }
+            }
+            std::error_code error;
+            std::filesystem::remove(segmentPath(m_firstSegment), error);
+            if (error) {
+                throw std::runtime_error("Failed to delete block segment " + segmentPath(m_firstSegment));
+            }
+        }
+    }
+
+private:
+    struct IndexEntry {
+        uint32_t segment;
+        uint32_t size;
+        uint64_t offset;
+    };
+
+    struct Segment {
+        int fd = -1;
+        void* mapping = MAP_FAILED;
+        uint64_t fileSize = 0; // Bytes written, at most the size mapped
+    };
+
+    std::string m_directory;
+    size_t m_maxSegmentSize;
+    int m_indexFd = -1;
+    std::vector<IndexEntry> m_index;
+    uint32_t m_firstSegment = 0; // Segments below it have been pruned
+    mutable std::vector<Segment> m_segments;
+    mutable std::mutex m_mutex;
+
+    void openIndex() {
+        std::string path = m_directory + "/index.dat";
+        m_indexFd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (m_indexFd < 0) {
+            throw std::runtime_error("Failed to open block index " + path);
+        }
+
+        // A torn write can leave a partial entry at the end, which is simply dropped
+        struct stat info;
+        fstat(m_indexFd, &info);
+        size_t count = static_cast<size_t>(info.st_size) / sizeof(IndexEntry);
+        m_index.resize(count);
+        if (count > 0 && pread(m_indexFd, m_index.data(), count * sizeof(IndexEntry), 0) != static_cast<ssize_t>(count * sizeof(IndexEntry))) {
+            throw std::runtime_error("Failed to read block index " + path);
+        }
+        if (static_cast<size_t>(info.st_size) != count * sizeof(IndexEntry) && ftruncate(m_indexFd, count * sizeof(IndexEntry)) != 0) {
+            throw std::runtime_error("Failed to repair block index " + path);
+        }
+
+        // Segments pruned in an earlier run are missing from the front
+        while (!m_index.empty() && m_firstSegment < m_index.back().segment && !std::filesystem::exists(segmentPath(m_firstSegment))) {
+            m_firstSegment++;
+        }
+    }
+
+    size_t firstHeight() const {
+        auto it = std::lower_bound(m_index.begin(), m_index.end(), m_firstSegment, [](const IndexEntry& entry, uint32_t segment) { return entry.segment < segment; });
+        return static_cast<size_t>(it - m_index.begin());
+    }
+
+    std::string segmentPath(uint32_t number) const {
+        std::ostringstream path;
+        path << m_directory << "/blk" << std::setw(5) << std::setfill('0') << number << ".dat";
+        return path.str();
+    }
+
+    Segment& segment(uint32_t number) const {
+        if (number >= m_segments.size()) {
+            m_segments.resize(number + 1);
+        }
+        Segment& segment = m_segments[number];
+        if (segment.fd < 0) {
+            std::string path = segmentPath(number);
+            segment.fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            if (segment.fd < 0) {
+                throw std::runtime_error("Failed to open block segment " + path);
+            }
+            segment.mapping = mmap(nullptr, m_maxSegmentSize, PROT_READ, MAP_SHARED, segment.fd, 0);
+            if (segment.mapping == MAP_FAILED) {
+                throw std::runtime_error("Failed to map block segment " + path);
+            }
+            struct stat info;
+            fstat(segment.fd, &info);
+            segment.fileSize = std::min<uint64_t>(static_cast<uint64_t>(info.st_size), m_maxSegmentSize);
+        }
+        return segment;
+    }
+
+    static void writeAll(int fd, const void* data, size_t size, uint64_t offset) {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+            if (written <= 0) {
+                throw std::runtime_error("Failed to write to block store");
+            }
+            bytes += written;
+            size -= static_cast<size_t>(written);
+            offset += static_cast<uint64_t>(written);
+        }
+    }
+};
+
+// Account balances derived from the blocks on the active chain. Accounts live in a flat vector
+// indexed by interned address id, so validation looks balances up in O(1) without allocating.
+// Every applied block records the account states it overwrote, which undoBlock puts back, until
+// pruneUndo drops the records of blocks too deep to be rolled back.
+class ChainState {
+public:
+    struct AccountState {
+        double balance = 0.0;
+        uint64_t sentCount = 0;
+        uint64_t receivedCount = 0;
+        SenderStats sent; // Amounts of every transaction sent so far
+    };
+
+    double getBalance(std::string_view address) const {
+        uint32_t id = AddressTable::global().find(address);
+        return id < m_accounts.size() ? m_accounts[id].balance : 0.0;
+    }
+
+    const AccountState* getAccount(std::string_view address) const {
+        uint32_t id = AddressTable::global().find(address);
+        return id < m_accounts.size() ? &m_accounts[id] : nullptr;
+    }
+
+    // Number of blocks applied, genesis included
+    size_t getHeight() const { return m_prunedHeight + m_undo.size(); }
+
+    // Blocks below this height can no longer be undone
+    size_t getPrunedHeight() const { return m_prunedHeight; }
+
+    // The same accounts with nothing to undo, e.g. for a StateSnapshot
+    ChainState withoutUndo() const {
+        ChainState state;
+        state.m_accounts = m_accounts;
+        state.m_prunedHeight = getHeight();
+        return state;
+    }
+
+    // Forget how to undo the blocks below height
+    void pruneUndo(size_t height) {
+        for (; m_prunedHeight < height && !m_undo.empty(); ++m_prunedHeight) {
+            m_undo.pop_front();
+        }
+    }
+
+    // Every account with any activity, for a StateSnapshot:
+    //   varint accountCount | (str address | f64 balance | varint sentCount | varint receivedCount |
+    //   varint sent.count | f64 sent.total | f64 sent.mean | f64 sent.m2 | f64 sent.min | f64 sent.max)[accountCount]
+    void encode(std::string& bytes) const {
+        auto isActive = [](const AccountState& account) { return account.balance != 0.0 || account.sentCount > 0 || account.receivedCount > 0; };
+        appendVarint(bytes, std::count_if(m_accounts.begin(), m_accounts.end(), isActive));
+        for (size_t id = 0; id < m_accounts.size(); ++id) {
+            const AccountState& account = m_accounts[id];
+            if (!isActive(account)) {
+                continue;
+            }
+            appendString(bytes, AddressTable::global().getAddress(static_cast<uint32_t>(id)));
+            appendDouble(bytes, account.balance);
+            appendVarint(bytes, account.sentCount);
+            appendVarint(bytes, account.receivedCount);
+            appendVarint(bytes, account.sent.count);
+            appendDouble(bytes, account.sent.total);
+            appendDouble(bytes, account.sent.mean);
+            appendDouble(bytes, account.sent.m2);
+            appendDouble(bytes, account.sent.min);
+            appendDouble(bytes, account.sent.max);
+        }
+    }
+
+    // Replace the state with accounts written by encode after height blocks had been applied. None
+    // of those blocks can be undone. Returns false if the accounts are malformed.
+    bool decode(ByteReader& reader, size_t height) {
+        std::vector<AccountState> accounts;
+        uint64_t count = reader.readVarint();
+        for (uint64_t i = 0; i < count && !reader.failed; ++i) {
+            uint32_t id = AddressTable::global().intern(reader.readString());
+            if (id >= accounts.size()) {
+                accounts.resize(id + 1);
+            }
+            AccountState& account = accounts[id];
+            account.balance = reader.readDouble();
+            account.sentCount = reader.readVarint();
+            account.receivedCount = reader.readVarint();
+            account.sent.count = reader.readVarint();
+            account.sent.total = reader.readDouble();
+            account.sent.mean = reader.readDouble();
+            account.sent.m2 = reader.readDouble();
+            account.sent.min = reader.readDouble();
+            account.sent.max = reader.readDouble();
+        }
+        if (reader.failed) {
+            return false;
+        }
+        m_accounts = std::move(accounts);
+        m_undo.clear();
+        m_prunedHeight = height;
+        return true;
+    }
+
+    // The genesis block creates its coins: recipients are credited without debiting the senders
+    void applyGenesis(const Block& block) {
+        const std::vector<Transaction>& transactions = block.getTransactions();
+        applyTransfers(transactions.size(), true, [&](size_t i) { return transferOf(transactions[i]); });
+    }
+
+    void applyGenesis(const BlockView& view) {
+        std::vector<uint32_t> addressIds = internAddresses(view);
+        applyTransfers(view.getTransactionCount(), true, [&](size_t i) { return transferOf(view.getTransaction(i), addressIds); });
+    }
+
+    // Check that every sender can cover amount plus fee, counting earlier transactions in the same block
+    bool validateBlock(const Block& block) const {
+        // Scratch space is per thread, so readers holding a shared lock on the chain can validate concurrently
+        thread_local std::vector<double> pendingDebit;
+        thread_local std::vector<uint32_t> touched;
+
+        const std::vector<Transaction>& transactions = block.getTransactions();
+        bool valid = true;
+        touched.clear();
+        for (size_t i = 0; i < transactions.size() && valid; ++i) {
+            const Transaction& transaction = transactions[i];
+            if (isReward(transactions, i)) {
+                valid = transaction.getAmount() == block.getReward();
+                continue;
+            }
+            if (transaction.getAmount() <= 0.0 || transaction.getFee() < 0.0) {
+                valid = false;
+                break;
+            }
+            uint32_t sender = transaction.getSenderId();
+            if (sender >= m_accounts.size()) {
+                valid = false;
+                break;
+            }
+            if (pendingDebit.size() < m_accounts.size()) {
+                pendingDebit.resize(m_accounts.size(), 0.0);
+            }
+            double debit = transaction.getAmount() + transaction.getFee();
+            if (pendingDebit[sender] == 0.0) {
+                touched.push_back(sender);
+            }
+            pendingDebit[sender] += debit;
+            valid = pendingDebit[sender] <= m_accounts[sender].balance;
+        }
+
+        // Reset the scratch space for the next call
+        for (uint32_t id : touched) {
+            pendingDebit[id] = 0.0;
+        }
+        return valid;
+    }
+
+    // Transaction::isValid, judged against the sender's history on the chain rather than the one
+    // the transaction carries, and against their balance rather than the total they have sent.
+    // Reading the account's summary takes O(1) however busy the sender is.
+    bool checkTransaction(const Transaction& transaction) const {
+        TransactionBatchValidator::SenderHistory history = historyOf(transaction.getSenderId());
+        return transaction.isValid(*history.stats, history.funds);
+    }
+
+    // checkTransaction for every transaction in block but a leading mining reward, as one batch
+    bool checkTransactions(const Block& block, size_t threadCount) const {
+        const std::vector<Transaction>& transactions = block.getTransactions();
+        std::vector<TransactionBatchValidator::SenderHistory> histories;
+        histories.reserve(transactions.size());
+        for (const auto& transaction : transactions) {
+            histories.push_back(historyOf(transaction.getSenderId()));
+        }
+        std::vector<uint8_t> verdicts = TransactionBatchValidator(transactions, std::move(histories)).validate(threadCount);
+        for (size_t i = 0; i < verdicts.size(); ++i) {
+            if (!verdicts[i] && !isReward(transactions, i)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Apply the block's transfers. Each account touched is saved to the undo log first, summary
+    // included, so undoBlock reverses the summaries along with the balances.
+    void applyBlock(const Block& block) {
+        const std::vector<Transaction>& transactions = block.getTransactions();
+        applyTransfers(transactions.size(), false, [&](size_t i) { return transferOf(transactions[i]); });
+    }
+
+    // The same for a block read in place, e.g. from a BlockStore being reopened, without building
+    // its transactions
+    void applyBlock(const BlockView& view) {
+        std::vector<uint32_t> addressIds = internAddresses(view);
+        applyTransfers(view.getTransactionCount(), false, [&](size_t i) { return transferOf(view.getTransaction(i), addressIds); });
+    }
+
+    // Revert the most recently applied block
+    void undoBlock() {
+        if (m_undo.empty()) {
+            return;
+        }
+        const std::vector<UndoEntry>& undo = m_undo.back();
+        for (auto it = undo.rbegin(); it != undo.rend(); ++it) {
+            m_accounts[it->id] = it->previous;
+        }
+        m_undo.pop_back();
+    }
+
+private:
+    struct UndoEntry {
+        uint32_t id;
+        AccountState previous;
+    };
+
+    std::vector<AccountState> m_accounts;
+    std::deque<std::vector<UndoEntry>> m_undo; // For the blocks from m_prunedHeight up
+    size_t m_prunedHeight = 0;
+
+    struct Transfer {
+        uint32_t sender;
+        uint32_t recipient;
+        double amount;
+        double fee;
+    };
+
+    // The mining reward is the first transaction, paid from the miner to themselves
+    static bool isReward(const std::vector<Transaction>& transactions, size_t index) {
+        return index == 0 && transactions[0].getSenderId() == transactions[0].getRecipientId();
+    }
+
+    // An address the chain hasn't seen has sent nothing and holds nothing
+    TransactionBatchValidator::SenderHistory historyOf(uint32_t sender) const {
+        static const SenderStats none;
+        if (sender >= m_accounts.size()) {
+            return {&none, 0.0};
+        }
+        return {&m_accounts[sender].sent, m_accounts[sender].balance};
+    }
+
+    static Transfer transferOf(const Transaction& transaction) {
+        return Transfer{transaction.getSenderId(), transaction.getRecipientId(), transaction.getAmount(), transaction.getFee()};
+    }
+
+    static Transfer transferOf(const TransactionView& transaction, const std::vector<uint32_t>& addressIds) {
+        return Transfer{addressIds[transaction.getSenderIndex()], addressIds[transaction.getRecipientIndex()], transaction.getAmount(), transaction.getFee()};
+    }
+
+    // Intern each of the block's addresses once rather than once per use
+    static std::vector<uint32_t> internAddresses(const BlockView& view) {
+        std::vector<uint32_t> addressIds(view.getAddresses().size());
+        for (size_t i = 0; i < addressIds.size(); ++i) {
+            addressIds[i] = AddressTable::global().intern(view.getAddresses().get(i));
+        }
+        return addressIds;
+    }
+
+    // Apply count transfers, where at(i) gives the ith. Genesis transfers only credit their
+    // recipients; otherwise a leading self-payment is the mining reward, which also collects the fees.
+    template<typename At>
+    void applyTransfers(size_t count, bool genesis, At at) {
+        std::vector<UndoEntry> undo;
+        if (genesis) {
+            for (size_t i = 0; i < count; ++i) {
+                Transfer transfer = at(i);
+                credit(account(transfer.recipient, undo), transfer.amount);
+            }
+            m_undo.push_back(std::move(undo));
+            return;
+        }
+        bool hasReward = count > 0 && at(0).sender == at(0).recipient;
+        double fees = 0.0;
+        for (size_t i = hasReward ? 1 : 0; i < count; ++i) {
+            fees += at(i).fee;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            Transfer transfer = at(i);
+            if (i == 0 && hasReward) {
+                // The miner collects the reward plus every fee in the block
+                credit(account(transfer.recipient, undo), transfer.amount + fees);
+                continue;
+            }
+            AccountState& sender = account(transfer.sender, undo);
+            sender.balance -= transfer.amount + transfer.fee;
+            sender.sentCount++;
+            sender.sent.add(transfer.amount);
+            credit(account(transfer.recipient, undo), transfer.amount);
+        }
+        m_undo.push_back(std::move(undo));
+    }
+
+    AccountState& account(uint32_t id, std::vector<UndoEntry>& undo) {
+        if (id >= m_accounts.size()) {
+            m_accounts.resize(id + 1);
+        }
+        undo.push_back(UndoEntry{id, m_accounts[id]});
+        return m_accounts[id];
+    }
+
+    static void credit(AccountState& account, double amount) {
+        account.balance += amount;
+        account.receivedCount++;
+    }
+};
+
+// Tree of every block the chain has accepted, keyed by hash. Nodes live in a deque and are never
+// removed, so a Node pointer is a stable handle. Each node links to its parent and records its
+// height, the compact target it was mined to, and the cumulative work of the branch ending in it;
+// the best tip is the node with the most work, and ties go to the branch seen first.
+class BlockIndex {
+public:
+    struct Node {
+        Block block;
+        Node* parent;
+        size_t height;
+        uint32_t target;
+        double chainWork;
+        bool inStore = false; // Only the header is in memory; the body is in the BlockStore at height
+        bool invalid = false; // The block or one of its ancestors failed validation against the chain state
+    };
+
+    // Expected number of hashes needed to find a digest at or below a compact target
+    static double blockWork(uint32_t target) {
+        return std::ldexp(1.0, 256) / (targetValue(target) + 1.0);
+    }
+
+    // Add a block under the indexed block its previous hash names, or the genesis block to an empty
+    // index. Returns nullptr if the parent is unknown or the block is already indexed.
+    Node* insert(Block block, uint32_t target) {
+        Node* parent = m_nodes.empty() ? nullptr : find(block.getPreviousHash());
+        if (!m_nodes.empty() && !parent) {
+            return nullptr;
+        }
+        return insert(std::move(block), target, parent);
+    }
+
+    // Add a block under an explicitly chosen parent
+    Node* insert(Block block, uint32_t target, Node* parent) {
+        double work = blockWork(target) + (parent ? parent->chainWork : 0.0);
+        return insert(Node{std::move(block), parent, parent ? parent->height + 1 : 0, target, work});
+    }
+
+    // Add the first block of an index that starts from a StateSnapshot rather than from genesis
+    Node* insertRoot(Block block, uint32_t target, size_t height, double chainWork) {
+        return insert(Node{std::move(block), nullptr, height, target, chainWork});
+    }
+
+    Node* find(const std::string& hash) const {
+        auto it = m_byHash.find(hash);
+        return it == m_byHash.end() ? nullptr : it->second;
+    }
+
+    Node* getBestTip() const { return m_bestTip; }
+    size_t size() const { return m_nodes.size(); }
+
+    // Exclude node and everything built on it from the best tip. Parents are indexed before their
+    // children, so one pass in insertion order reaches every descendant.
+    void markInvalid(Node* node) {
+        node->invalid = true;
+        m_bestTip = nullptr;
+        for (Node& candidate : m_nodes) {
+            if (candidate.parent && candidate.parent->invalid) {
+                candidate.invalid = true;
+            }
+            if (!candidate.invalid && (!m_bestTip || candidate.chainWork > m_bestTip->chainWork)) {
+                m_bestTip = &candidate;
+            }
+        }
+    }
+
+    // Last block shared by the branches ending in a and b, in O(distance to it)
+    static Node* findCommonAncestor(Node* a, Node* b) {
+        while (a->height > b->height) {
+            a = a->parent;
+        }
+        while (b->height > a->height) {
+            b = b->parent;
+        }
+        while (a != b) {
+            a = a->parent;
+            b = b->parent;
+        }
+        return a;
+    }
+
+private:
+    std::deque<Node> m_nodes;
+    std::unordered_map<std::string, Node*> m_byHash;
+    Node* m_bestTip = nullptr;
+
+    Node* insert(Node candidate) {
+        if (find(candidate.block.getHash())) {
+            return nullptr;
+        }
+        m_nodes.push_back(std::move(candidate));
+        Node* node = &m_nodes.back();
+        m_byHash[node->block.getHash()] = node;
+        node->invalid = node->parent && node->parent->invalid;
+        if (!node->invalid && (!m_bestTip || node->chainWork > m_bestTip->chainWork)) {
+            m_bestTip = node;
+        }
+        return node;
+    }
+};
+
+// Chain state as of one block on the active chain, from which a node can start instead of replaying
+// every block since genesis. The file is written with encode:
+//   u8 version | varint height | f64 chainWork | varint blockCount | block[blockCount] | accounts | u8 checksum[32]
+// where the blocks are the snapshot's tip and up to retargetWindow ancestors, oldest first, each as
+// str hash | str previousHash | u8 header[88] | varint target, so the targets of the blocks that
+// follow can be computed. chainWork is that of the oldest block, the accounts are as written by
+// ChainState::encode, and the checksum is SHA-256 of everything before it.
+struct StateSnapshot {
+    struct BlockEntry {
+        std::string hash;
+        std::string previousHash;
+        BlockHeader header;
+        uint32_t target = 0;
+    };
+
+    static constexpr uint8_t formatVersion = 1;
+
+    size_t height = 0; // Of the tip
+    double chainWork = 0.0;
+    std::vector<BlockEntry> blocks;
+    ChainState state;
+
+    std::string encode() const {
+        std::string bytes;
+        bytes.push_back(static_cast<char>(formatVersion));
+        appendVarint(bytes, height);
+        appendDouble(bytes, chainWork);
+        appendVarint(bytes, blocks.size());
+        for (const auto& block : blocks) {
+            appendString(bytes, block.hash);
+            appendString(bytes, block.previousHash);
+            auto header = block.header.serialize();
+            bytes.append(reinterpret_cast<const char*>(header.data()), header.size());
+            appendVarint(bytes, block.target);
+        }
+        state.encode(bytes);
+        Hash256 checksum = sha256Digest(bytes);
+        bytes.append(reinterpret_cast<const char*>(checksum.data()), checksum.size());
+        return bytes;
+    }
+
+    // Throws std::runtime_error if the checksum doesn't match or the contents are malformed
+    static StateSnapshot decode(const std::string& bytes) {
+        Hash256 checksum{};
+        if (bytes.size() < checksum.size()) {
+            throw std::runtime_error("State snapshot is truncated");
+        }
+        std::string contents = bytes.substr(0, bytes.size() - checksum.size());
+        std::memcpy(checksum.data(), bytes.data() + contents.size(), checksum.size());
+        if (sha256Digest(contents) != checksum) {
+            throw std::runtime_error("State snapshot checksum does not match");
+        }
+
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(contents.data());
+        ByteReader reader(data, data + contents.size());
+        if (reader.readU8() != formatVersion) {
+            throw std::runtime_error("State snapshot uses an unknown format version");
+        }
+        StateSnapshot snapshot;
+        snapshot.height = reader.readVarint();
+        snapshot.chainWork = reader.readDouble();
+        uint64_t blockCount = reader.readVarint();
+        for (uint64_t i = 0; i < blockCount && !reader.failed; ++i) {
+            BlockEntry block;
+            block.hash = std::string(reader.readString());
+            block.previousHash = std::string(reader.readString());
+            std::string_view header = reader.readBytes(BlockHeader::serializedSize);
+            if (reader.failed) {
+                break;
+            }
+            block.header = BlockHeader::deserialize(reinterpret_cast<const unsigned char*>(header.data()));
+            block.target = static_cast<uint32_t>(reader.readVarint());
+            snapshot.blocks.push_back(std::move(block));
+        }
+        if (reader.failed || snapshot.blocks.empty() || snapshot.blocks.size() > snapshot.height + 1 ||
+            !snapshot.state.decode(reader, snapshot.height + 1) || reader.position != reader.end) {
+            throw std::runtime_error("State snapshot is malformed");
+        }
+        return snapshot;
+    }
+
+    // Write to a temporary file that is then renamed over path, so a crash never leaves a torn snapshot
+    void write(const std::string& path) const {
+        std::string temporaryPath = path + ".tmp";
+        {
+            std::string bytes = encode();
+            std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+            file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+            if (!file) {
+                throw std::runtime_error("Failed to write state snapshot to " + temporaryPath);
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporaryPath, path, error);
+        if (error) {
+            throw std::runtime_error("Failed to replace state snapshot " + path);
+        }
+    }
+
+    static StateSnapshot read(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Failed to open state snapshot " + path);
+        }
+        std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        return decode(bytes);
+    }
+};
+
+class Blockchain {
+public:
+    Blockchain() : m_powLimit(compactFromDifficulty(4)), m_miningThreads(std::max(1u, std::thread::hardware_concurrency())), m_minerWallet(Wallet("Miner Wallet", 1000000.0)) {
+        checkMempoolAgainstState();
+        createGenesisBlock();
+    }
+
+    // In-memory chain with a custom proof of work limit, e.g. an easy one for test networks and
+    // synthetic workloads where mining should take no time
+    explicit Blockchain(uint32_t powLimit) : m_powLimit(powLimit), m_miningThreads(std::max(1u, std::thread::hardware_concurrency())), m_minerWallet(Wallet("Miner Wallet", 1000000.0)) {
+        checkMempoolAgainstState();
+        createGenesisBlock();
+    }
+
+    // Open a chain persisted in storeDirectory, creating it with a genesis block if it doesn't exist
+    // yet. Reopening indexes each stored block by the header in its record and replays balances
+    // from the mapped transactions, so no Block is built; bodies are read back when asked for.
+    // Snapshots are written to snapshot.dat in the same directory. A store whose oldest blocks were
+    // pruned starts from it, and any other store takes its balances from it if it matches, so only
+    // the blocks after it are replayed. Blocks up to the snapshot can't be reorganised away then.
+    explicit Blockchain(const std::string& storeDirectory, size_t maxSegmentSize = BlockStore::defaultSegmentSize)
+        : m_powLimit(compactFromDifficulty(4)), m_miningThreads(std::max(1u, std::thread::hardware_concurrency())), m_minerWallet(Wallet("Miner Wallet", 1000000.0)),
+          m_store(std::make_unique<BlockStore>(storeDirectory, maxSegmentSize)), m_snapshotPath(storeDirectory + "/snapshot.dat") {
+        checkMempoolAgainstState();
+        if (m_store->size() == 0) {
+            createGenesisBlock();
+            m_store->append(m_chain.back()->block);
+            keepInStore(m_chain.back());
+            return;
+        }
+        size_t firstStored = m_store->getFirstHeight();
+        if (m_store->get(firstStored).getVersion() != BlockView::formatVersion) {
+            throw std::runtime_error("Block store " + storeDirectory + " uses format version " + std::to_string(m_store->get(firstStored).getVersion()) +
+                                     ", expected " + std::to_string(BlockView::formatVersion));
+        }
+
+        std::optional<StateSnapshot> snapshot;
+        if (firstStored > 0 || std::filesystem::exists(m_snapshotPath)) {
+            snapshot = StateSnapshot::read(m_snapshotPath);
+            bool covered = snapshot->height < m_store->size() && snapshot->height + 1 >= firstStored;
+            bool matches = covered && (snapshot->height < firstStored || m_store->get(snapshot->height).getHash() == snapshot->blocks.back().hash);
+            if (!matches && firstStored > 0) {
+                throw std::runtime_error("Block store " + storeDirectory + " has been pruned past its snapshot");
+            }
+            if (!matches) {
+                snapshot.reset();
+            }
+        }
+        size_t height = 0;
+        if (snapshot && firstStored > 0) {
+            // The blocks below the first stored one are only known from the snapshot
+            restoreSnapshot(*snapshot);
+            m_prunedHeight = std::max(firstStored, m_baseHeight);
+            for (size_t stored = m_prunedHeight; stored <= snapshot->height; ++stored) {
+                m_chain[stored]->inStore = true;
+            }
+            height = snapshot->height + 1;
+        } else if (snapshot) {
+            m_state = snapshot->state;
+            m_snapshotHeight = snapshot->height;
+        }
+
+        m_chain.reserve(m_store->size());
+        for (; height < m_store->size(); ++height) {
+            BlockView view = m_store->get(height);
+            BlockIndex::Node* parent = m_chain.empty() ? nullptr : m_chain.back();
+            if (parent && view.getPreviousHash() != parent->block.getHash()) {
+                throw std::runtime_error("Block store " + storeDirectory + " doesn't link at height " + std::to_string(height));
+            }
+            // Targets aren't stored; they follow from the timestamps just as when the blocks were accepted
+            Block header = Block::fromHeader(view.getHeader(), view.getPreviousHash(), view.getHash());
+            BlockIndex::Node* node = m_index.insert(std::move(header), parent ? nextTarget(parent) : m_powLimit, parent);
+            if (!node) {
+                throw std::runtime_error("Block store " + storeDirectory + " holds a block twice at height " + std::to_string(height));
+            }
+            node->inStore = true;
+            m_chain.push_back(node);
+            if (snapshot && height <= snapshot->height) {
+                continue;
+            }
+            if (height == 0) {
+                m_state.applyGenesis(view);
+            } else {
+                m_state.applyBlock(view);
+            }
+        }
+    }
+
+    // Start from a snapshot instead of replaying from genesis, e.g. one written by another node.
+    // Blocks that follow it are added as usual; none below it can be reorganised away.
+    explicit Blockchain(const StateSnapshot& snapshot, uint32_t powLimit = compactFromDifficulty(4))
+        : m_powLimit(powLimit), m_miningThreads(std::max(1u, std::thread::hardware_concurrency())), m_minerWallet(Wallet("Miner Wallet", 1000000.0)) {
+        checkMempoolAgainstState();
+        restoreSnapshot(snapshot);
+    }
+
+    // Zero-copy access to a persisted block, or nullptr when the chain has no store
+    const BlockStore* getStore() const { return m_store.get(); }
+
+    // Keep the bodies of only the last keepBlocks blocks on the active chain; only those can be
+    // reorganised away. Older blocks keep their headers, so the chain still validates and serves
+    // headers to syncing peers, and a store-backed chain deletes the stored blocks its latest
+    // snapshot covers. Zero, the default, keeps the full history, as archive nodes need.
+    void setPruneDepth(size_t keepBlocks) {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        m_pruneDepth = keepBlocks;
+        if (m_pruneDepth > 0) {
+            prune();
+        }
+    }
+
+    size_t getPruneDepth() const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_pruneDepth;
+    }
+
+    // Blocks below this height on the active chain have been pruned
+    size_t getPrunedHeight() const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_prunedHeight;
+    }
+
+    // Write a snapshot each time the active chain reaches a multiple of blocks, to the store
+    // directory or the path given to setSnapshotPath. Zero turns periodic snapshots off.
+    void setSnapshotInterval(size_t blocks) {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        m_snapshotInterval = blocks;
+    }
+
+    void setSnapshotPath(const std::string& path) {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        m_snapshotPath = path;
+    }
+
+    // Write a snapshot of the active tip to path now
+    void writeSnapshot(const std::string& path) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        makeSnapshot().write(path);
+    }
+
+    // Balance of an address according to the blocks on the active chain
+    double getBalance(const std::string& address) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_state.getBalance(address);
+    }
+
+    // Transaction::isValid against the sender's history on the active chain
+    bool checkTransaction(const Transaction& transaction) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_state.checkTransaction(transaction);
+    }
+
+    // Check that every spend in block is covered by the balances at the current tip
+    bool hasSufficientFunds(const Block& block) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_state.validateBlock(block);
+    }
+
+    // Require every transaction but a block's mining reward to be signed by its sender, in the mempool
+    // and in blocks received from other nodes
+    void setRequireSignatures(bool require) {
+        m_requireSignatures = require;
+        m_mempool.requireSignatures(require ? &m_signatureCache : nullptr);
+    }
+    bool getRequireSignatures() const { return m_requireSignatures; }
+
+    // Check the signatures of every transaction in block but a leading mining reward, spread over
+    // the validation threads. Signatures verified when their transactions entered the mempool come
+    // from the cache, so for a block built from gossiped transactions there's little left to check.
+    bool hasValidSignatures(const Block& block) const {
+        const std::vector<Transaction>& transactions = block.getTransactions();
+        std::vector<uint8_t> verdicts = SignatureBatchVerifier(transactions, &m_signatureCache).verify(m_validationThreads);
+        for (size_t i = 0; i < verdicts.size(); ++i) {
+            bool isReward = i == 0 && transactions[0].getSenderId() == transactions[0].getRecipientId();
+            if (!verdicts[i] && !isReward) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const SignatureCache& getSignatureCache() const { return m_signatureCache; }
+
+    // Check every transaction in block against its sender's history and balance at the current
+    // tip, as checkTransaction does, splitting them into contiguous ranges checked on up to
+    // m_validationThreads threads. The mining reward pays the miner themselves, so it's exempt.
+    bool hasValidTransactions(const Block& block) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_state.checkTransactions(block, m_validationThreads);
+    }
+
+    Mempool& getMempool() { return m_mempool; }
+    const Mempool& getMempool() const { return m_mempool; }
+
+    // Next block to mine: the best paying pending transactions on top of the current tip
+    Block createBlockTemplate() const {
+        return m_mempool.buildBlockTemplate(getLastBlockHash(), m_minerWallet.getName());
+    }
+
+    void setMiningThreads(unsigned int threadCount) { m_miningThreads = std::max(1u, threadCount); }
+    unsigned int getMiningThreads() const { return m_miningThreads; }
+
+    size_t getLength() const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_chain.size();
+    }
+
+    Block getLastBlock() const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return loadBlock(m_chain.back());
+    }
+
+    std::string getLastBlockHash() const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_chain.back()->block.getHash();
+    }
+
+    // Number of blocks indexed, including those on branches that aren't active
+    size_t getIndexedBlockCount() const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_index.size();
+    }
+
+    // Mine a block and add it to the chain. Returns false if its previous hash matches no indexed
+    // block, if no nonce was found within 4 target intervals, or if the chain rejects it.
+    bool addBlock(Block block) {
+        // Index it under its parent, which is normally the tip but may be on another branch
+        BlockIndex::Node* parent;
+        Hash256 target;
+        {
+            std::shared_lock<std::shared_mutex> lock(m_mutex);
+            parent = m_index.find(block.getPreviousHash());
+            if (!parent) {
+                Logger::instance().log(Logger::Level::Warning, "block has an unknown parent", {{"previousHash", block.getPreviousHash()}});
+                return false;
+            }
+            target = targetFromCompact(nextTarget(parent));
+        }
+
+        // Mine the new block without holding the lock, so readers aren't blocked while it runs.
+        // Index nodes are never removed, so parent stays valid.
+        if (!block.mineBlock(target, m_minerWallet, m_miningThreads, 4.0 * m_targetBlockSeconds)) {
+            return false;
+        }
+
+        static Metrics::Histogram& importSeconds = Metrics::instance().histogram("blockchain_block_import_seconds", "Time addBlock takes to connect a mined block, including the wait for the chain lock");
+        Metrics::Histogram::Timer timer(importSeconds);
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        return acceptBlock(std::move(block), parent);
+    }
+
+    // Compact target that a block extending the active tip has to meet
+    uint32_t getNextTarget() const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return nextTarget(m_chain.back());
+    }
+
+    // Easiest target any block may have; also the target of the first retargetWindow blocks
+    uint32_t getPowLimit() const { return m_powLimit; }
+
+    // Block interval the retargeting aims for
+    void setTargetBlockSeconds(int64_t seconds) { m_targetBlockSeconds = std::max<int64_t>(1, seconds); }
+    int64_t getTargetBlockSeconds() const { return m_targetBlockSeconds; }
+
+    // Number of recent blocks whose timestamps set the next target
+    static constexpr size_t retargetWindow = 16;
+
+    // Subsidy every block pays its miner. Blocks carry it in their headers, but a block claiming
+    // any other amount is rejected, so peers can't mint coins by raising it.
+    static constexpr double blockReward = 50.0;
+
+    // 2023-04-23 00:00:00 UTC
+    static constexpr int64_t genesisTimestamp = 1682208000;
+
+    // Add a block that has already been mined, e.g. one received from another node. It may extend
+    // any indexed block; if its branch ends up with the most work the chain reorganises onto it.
+    bool submitBlock(const Block& block) {
+        // Check the block on its own before taking the lock
+        if (!checkBlock(block)) {
+            return false;
+        }
+
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        BlockIndex::Node* parent = m_index.find(block.getPreviousHash());
+        if (!parent) {
+            Logger::instance().log(Logger::Level::Warning, "block has an unknown parent", {{"hash", block.getHash()}, {"previousHash", block.getPreviousHash()}});
+            return false;
+        }
+        return acceptBlock(block, parent);
+    }
 
-    Transaction(const std::string& sender, const std::string& recipient, double amount, double fee, const std::vector<double>& senderSent)
-        : m_sender(sender), m_recipient(recipient), m_amount(amount), m_fee(fee), m_senderSent(senderSent) {}
+    // Import blocks encoded with BlockView::encode, e.g. as received from a peer, in chain order.
+    // Decoding, the checks of checkBlock and hash verification run in parallel without the chain
+    // lock; connecting the blocks that passed is the only step that holds it. Returns the number of
+    // blocks accepted.
+    size_t importBlocks(const std::vector<std::string>& records) {
+        // Stages 1-3: decode, stateless checks and proof of work, in parallel chunks
+        std::vector<std::unique_ptr<Block>> decoded(records.size());
+        const size_t minRecordsPerThread = 16;
+        size_t threadCount = std::min<size_t>(m_validationThreads, (records.size() + minRecordsPerThread - 1) / minRecordsPerThread);
+        threadCount = std::max<size_t>(threadCount, 1);
+        size_t chunkSize = (records.size() + threadCount - 1) / threadCount;
 
-    std::string getSender() const { return m_sender; }
-    std::string getRecipient() const { return m_recipient; }
-    double getAmount() const { return m_amount; }
-    double getFee() const { return m_fee; }
+        auto processChunk = [&](size_t chunk) {
+            size_t end = std::min(records.size(), (chunk + 1) * chunkSize);
+            for (size_t i = chunk * chunkSize; i < end; ++i) {
+                const std::string& record = records[i];
+                BlockView view(reinterpret_cast<const unsigned char*>(record.data()), record.size());
+                if (!view.isWellFormed()) {
+                    continue;
+                }
+                auto block = std::make_unique<Block>(view.toBlock());
+                if (checkBlock(*block)) {
+                    decoded[i] = std::move(block);
+                }
+            }
+        };
 
-    std::string getDate() const { return m_date; }
-    void setDate(const std::string& date) { m_date = date; }
+        std::vector<std::thread> workers;
+        for (size_t chunk = 1; chunk < threadCount; ++chunk) {
+            workers.emplace_back(processChunk, chunk);
+        }
+        processChunk(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
 
-    std::vector<std::string> getRecipientList() const { return m_recipientList; }
-    void setRecipientList(const std::vector<std::string>& recipientList) { m_recipientList = recipientList; }
+        // Stage 4: connect in order under the exclusive lock
+        std::vector<Block> checked;
+        checked.reserve(decoded.size());
+        for (auto& block : decoded) {
+            if (block) {
+                checked.push_back(std::move(*block));
+            }
+        }
+        return connectCheckedBlocks(std::move(checked));
+    }
 
-    std::vector<double> getSenderSent() const { return m_senderSent; }
-    void setSenderSent(const std::vector<double>& sent) { m_senderSent = sent; }
+    // Connect blocks that already passed checkBlock, e.g. bodies checked out of order during sync,
+    // in the order given. A block whose parent was rejected is rejected too, since its parent never
+    // gets indexed. Returns the number of blocks accepted.
+    size_t connectCheckedBlocks(std::vector<Block> blocks) {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        size_t accepted = 0;
+        for (auto& block : blocks) {
+            BlockIndex::Node* parent = m_index.find(block.getPreviousHash());
+            if (parent && acceptBlock(std::move(block), parent)) {
+                accepted++;
+            }
+        }
+        return accepted;
+    }
 
-    bool isValid() const {
-        // Check if the transaction amount is greater than zero
-        if (m_amount <= 0.0) {
-            return false;
+    // Headers of blocks that haven't been downloaded yet, continuing the active chain from the block
+    // it had as tip when the sync began. Each one has been checked to link to the one before and to
+    // meet the target retargeting sets for its height, so bodies can be fetched and checked against
+    // their hashes in any order.
+    struct HeaderChain {
+        std::string baseHash;        // Block the first header builds on
+        size_t baseHeight = 0;
+        std::vector<int64_t> baseTimestamps; // Of the base block and up to retargetWindow ancestors, oldest first
+        std::vector<uint32_t> baseTargets;
+        std::vector<BlockHeader> headers;
+        std::vector<Hash256> hashes;
+        std::vector<uint32_t> targets;
+
+        size_t size() const { return headers.size(); }
+        std::string getLastHash() const { return hashes.empty() ? baseHash : toHex(hashes.back()); }
+    };
+
+    // Start a header chain on the active tip
+    HeaderChain beginHeaderChain() const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        HeaderChain chain;
+        const BlockIndex::Node* base = m_chain.back();
+        chain.baseHash = base->block.getHash();
+        chain.baseHeight = base->height;
+        for (const BlockIndex::Node* node = base; node && chain.baseTimestamps.size() <= retargetWindow; node = node->parent) {
+            chain.baseTimestamps.insert(chain.baseTimestamps.begin(), node->block.getTimestamp());
+            chain.baseTargets.insert(chain.baseTargets.begin(), node->target);
         }
+        return chain;
+    }
 
-        // Check if the sender has enough funds to send the transaction amount
-        double totalSent = std::accumulate(m_senderSent.begin(), m_senderSent.end(), 0.0);
-        if (totalSent < m_amount) {
-            return false;
+    // Check headers received from a peer and append the ones that continue chain. Checking stops
+    // at the first header that doesn't link or lacks the proof of work. Returns the number appended.
+    size_t extendHeaderChain(HeaderChain& chain, const std::vector<BlockHeader>& headers) const {
+        std::vector<Hash256> digests = HeaderHasher::hashHeaders(headers);
+        auto at = [&](size_t height) {
+            size_t firstHeader = chain.baseHeight + 1;
+            if (height >= firstHeader) {
+                return std::make_pair(chain.headers[height - firstHeader].timestamp, chain.targets[height - firstHeader]);
+            }
+            size_t index = chain.baseTimestamps.size() - 1 - (chain.baseHeight - height);
+            return std::make_pair(chain.baseTimestamps[index], chain.baseTargets[index]);
+        };
+        Hash256 previous = hashFromHex(chain.getLastHash());
+        for (size_t i = 0; i < headers.size(); ++i) {
+            uint32_t target = nextTarget(chain.baseHeight + chain.size(), at);
+            if (headers[i].previousHash != previous || !meetsTarget(digests[i], targetFromCompact(target))) {
+                Logger::instance().log(Logger::Level::Warning, "header does not continue the chain", {{"height", chain.baseHeight + chain.size() + 1}});
+                return i;
+            }
+            chain.headers.push_back(headers[i]);
+            chain.hashes.push_back(digests[i]);
+            chain.targets.push_back(target);
+            previous = digests[i];
         }
+        return headers.size();
+    }
 
-        // Check if the recipient is not the same as the sender
-        if (m_sender == m_recipient) {
-            return false;
+    // Headers of up to count blocks following the block named hash on the active chain, for a peer
+    // that's syncing. Empty if that block isn't on the active chain.
+    std::vector<BlockHeader> getHeaders(const std::string& hash, size_t count) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        std::vector<BlockHeader> headers;
+        BlockIndex::Node* node = m_index.find(hash);
+        if (!node || node->height >= m_chain.size() || m_chain[node->height] != node) {
+            return headers;
+        }
+        size_t end = std::min(m_chain.size(), node->height + 1 + count);
+        headers.reserve(end - node->height - 1);
+        for (size_t height = node->height + 1; height < end; ++height) {
+            headers.push_back(m_chain[height]->block.getHeader());
         }
+        return headers;
+    }
 
-        // Check if the recipient is in the recipient list, if any
-        if (!m_recipientList.empty() && std::find(m_recipientList.begin(), m_recipientList.end(), m_recipient) == m_recipientList.end()) {
-            return false;
+    // Block at height on the active chain
+    Block getBlock(size_t height) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        if (height >= m_chain.size()) {
+            throw std::out_of_range("Block height out of range");
+        }
+        if (height < m_prunedHeight || !m_chain[height]) {
+            throw std::out_of_range("Block at height " + std::to_string(height) + " has been pruned");
         }
+        return loadBlock(m_chain[height]);
+    }
 
-        // Check for suspicious patterns of transaction amounts from the sender
-        int numTransactions = m_senderSent.size();
-        if (numTransactions >= 3) {
-            double avgSent = totalSent / numTransactions;
-            double variance = 0.0;
-            for (const auto& sent : m_senderSent) {
-                variance += (sent - avgSent) * (sent - avgSent);
-            }
-            variance /= numTransactions;
-            if (variance > 0.1 * avgSent) {
+    // Whether a block is indexed, on the active chain or any other branch
+    bool hasBlock(const std::string& hash) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_index.find(hash) != nullptr;
+    }
+
+    // Block named hash, unless it's unknown or has been pruned
+    std::optional<Block> findBlock(const std::string& hash) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        BlockIndex::Node* node = m_index.find(hash);
+        if (!node || (node->block.isPruned() && !node->inStore)) {
+            return std::nullopt;
+        }
+        return loadBlock(node);
+    }
+
+    // Checks that need nothing but the block itself: the stored hash matches the header and meets
+    // the proof of work limit, the transactions fit the size limit, only a leading reward pays
+    // itself, and the signatures are valid if they're required. The target for the block's height
+    // is checked once its parent is known, and the transactions against the state it builds on.
+    bool checkBlock(const Block& block) const {
+        Hash256 digest = block.calculateDigest(block.getNonce());
+        if (!equalsHex(digest, block.getHash()) || !meetsTarget(digest, targetFromCompact(m_powLimit))) {
+            Logger::instance().log(Logger::Level::Warning, "block has an invalid proof of work", {{"hash", block.getHash()}});
+            return false;
+        }
+        if (block.getBlockSize() > Block::maxBlockSize) {
+            Logger::instance().log(Logger::Level::Warning, "block is too large", {{"hash", block.getHash()}, {"size", block.getBlockSize()}});
+            return false;
+        }
+        if (!hasValidReward(block)) {
+            Logger::instance().log(Logger::Level::Warning, "block pays a reward other than the subsidy", {{"hash", block.getHash()}, {"reward", block.getReward()}});
+            return false;
+        }
+        const std::vector<Transaction>& transactions = block.getTransactions();
+        for (size_t i = 0; i < transactions.size(); ++i) {
+            const Transaction& transaction = transactions[i];
+            if (transaction.getAmountUnits() <= 0 || transaction.getFeeUnits() < 0) {
+                Logger::instance().log(Logger::Level::Warning, "block has an invalid transaction", {{"hash", block.getHash()}, {"index", i}});
                 return false;
             }
         }
+        if (m_requireSignatures && !hasValidSignatures(block)) {
+            Logger::instance().log(Logger::Level::Warning, "block has an invalid signature", {{"hash", block.getHash()}});
+            return false;
+        }
+        return true;
+    }
+
+    bool isValid() const {
+        return validateFrom(1);
+    }
+
+    // Validate blocks from the given height to the tip. Blocks below height are trusted, as are
+    // those a chain started from a snapshot never saw. Pruned blocks are checked by their headers.
+    bool validateFrom(size_t height) const {
+        static Metrics::Histogram& validationSeconds = Metrics::instance().histogram("blockchain_validation_seconds", "Time spent validating the chain in isValid and validateNewBlocks");
+        Metrics::Histogram::Timer timer(validationSeconds);
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+
+        size_t begin = std::max<size_t>(height, m_baseHeight + 1);
+        if (begin >= m_chain.size()) {
+            return true;
+        }
 
-        // Check for unusual transaction amounts compared to the sender's history
-        if (numTransactions >= 5) {
-            double minSent = *std::min_element(m_senderSent.begin(), m_senderSent.end());
-            double maxSent = *std::max_element(m_senderSent.begin(), m_senderSent.end());
-            double threshold = 0.1 * (maxSent - minSent) + minSent;
-            if (m_amount > threshold) {
+        // First pass: recompute the block hashes in parallel
+        size_t firstInvalidHash = findFirstInvalidHash(begin, m_chain.size());
+
+        // Second pass: check the links between consecutive blocks
+        for (size_t i = begin; i < m_chain.size(); ++i) {
+            const Block& currentBlock = m_chain[i]->block;
+            const Block& previousBlock = m_chain[i-1]->block;
+
+            // Check if the current block's hash is valid
+            if (i == firstInvalidHash) {
+                Logger::instance().log(Logger::Level::Warning, "block hash is invalid", {{"height", i}});
+                return false;
+            }
+
+            // Check if the previous hash of the current block matches the hash of the previous block
+            if (currentBlock.getLastBlockHash() != previousBlock.getHash()) {
+                Logger::instance().log(Logger::Level::Warning, "block previous hash is invalid", {{"height", i}});
+                return false;
+            }
+
+            // Check if the block meets the target retargeting set for its height
+            if (!meetsTarget(hashFromHex(currentBlock.getHash()), targetFromCompact(m_chain[i]->target))) {
+                Logger::instance().log(Logger::Level::Warning, "block does not meet its target", {{"height", i}});
                 return false;
             }
         }
 
-        // All checks passed, the transaction is valid
+        // The chain is valid if all checks pass, so later calls only need to look at newer blocks.
+        // Concurrent validations hold the shared lock, so they all store the same height.
+        if (begin <= m_validatedHeight.load()) {
+            m_validatedHeight.store(m_chain.size());
+        }
         return true;
     }
-    
-    std::vector<Transaction> splitTransaction(const Transaction& transaction) {
-        std::vector<Transaction> splitTransactions;
-        double amountPerRecipient = transaction.getAmount() / transaction.getRecipientList().size();
-        for (const auto& recipient : transaction.getRecipientList()) {
-            splitTransactions.emplace_back(transaction.getSender(), recipient, amountPerRecipient, transaction.getSenderSent());
-        }
-        return splitTransactions;
+
+    // Validate only the blocks added since the last successful validation
+    bool validateNewBlocks() const {
+        return validateFrom(m_validatedHeight.load());
     }
 
-    std::string toString() const {
-        std::stringstream ss;
-        ss << "Transaction Details:\n";
-        ss << "Sender: " << m_sender << "\n";
-        ss << "Recipient: " << m_recipient << "\n";
-        ss << "Amount: " << m_amount << "\n";
-        ss << "Fee: " << m_fee << "\n";
-        ss << "Date: " << m_date << "\n";
-        ss << "Recipient List: ";
-        if (m_recipientList.empty()) {
-            ss << "None\n";
+    size_t getValidatedHeight() const {
+        return m_validatedHeight.load();
+    }
+
+    void setValidationThreads(unsigned int threadCount) { m_validationThreads = std::max(1u, threadCount); }
+
+    void printChain() const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        for (const BlockIndex::Node* node : m_chain) {
+            if (!node) {
+                continue;
+            }
+            Block block = loadBlock(node);
+            std::cout << "Block " << node->height << std::endl;
+            std::cout << "Hash: " << block.getHash() << std::endl;
+            std::cout << "Previous hash: " << block.getPreviousHash() << std::endl;
+            std::cout << "Reward: " << block.getReward() << std::endl;
+            std::cout << "Transactions:" << std::endl;
+            for (const auto& transaction : block.getTransactions()) {
+                std::cout << "  Sender: " << transaction.getSender() << std::endl;
+                std::cout << "  Recipient: " << transaction.getRecipient() << std::endl;
+                std::cout << "  Amount: " << transaction.getAmount() << std::endl;
+                std::cout << "  Sender sent: ";
+                for (const auto& sent : transaction.getSenderSent()) {
+                    std::cout << sent << " ";
+                }
+                std::cout << std::endl;
+            }
+            std::cout << std::endl;
         }
-        else {
-            for (const auto& recipient : m_recipientList) {
-                ss << recipient << " ";
+    }
+
+private:
+    uint32_t m_powLimit;
+    int64_t m_targetBlockSeconds = 600;
+    unsigned int m_miningThreads;
+    Wallet m_minerWallet;
+    BlockIndex m_index;
+    std::vector<BlockIndex::Node*> m_chain; // The active branch of m_index, indexed by height; null below m_baseHeight
+    size_t m_baseHeight = 0;                // Lowest height indexed, above zero when started from a snapshot
+    size_t m_pruneDepth = 0;
+    size_t m_prunedHeight = 0;              // Active blocks below it have had their transactions pruned
+    std::unique_ptr<BlockStore> m_store;
+    std::string m_snapshotPath;
+    size_t m_snapshotInterval = 0;
+    std::optional<size_t> m_snapshotHeight; // Of the latest snapshot written or restored
+    Mempool m_mempool;
+    mutable SignatureCache m_signatureCache;
+    bool m_requireSignatures = false;
+    ChainState m_state;
+    // Readers share the lock; only connecting blocks and reorgs take it exclusively
+    mutable std::shared_mutex m_mutex;
+    mutable std::atomic<size_t> m_validatedHeight{1};
+    unsigned int m_validationThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    // Returns the lowest height in [begin, end) whose stored hash doesn't match its header, or end
+    size_t findFirstInvalidHash(size_t begin, size_t end) const {
+        // Small ranges aren't worth starting threads for
+        const size_t minBlocksPerThread = 256;
+        size_t threadCount = std::min<size_t>(m_validationThreads, (end - begin + minBlocksPerThread - 1) / minBlocksPerThread);
+        threadCount = std::max<size_t>(threadCount, 1);
+        size_t chunkSize = (end - begin + threadCount - 1) / threadCount;
+        BlockArena& arena = BlockArena::local();
+        BlockArena::Scope scope(arena);
+        std::pmr::vector<size_t> firstInvalid(threadCount, end, &arena);
+
+        auto checkChunk = [&](size_t chunk) {
+            size_t chunkBegin = begin + chunk * chunkSize;
+            size_t chunkEnd = std::min(end, chunkBegin + chunkSize);
+            if (chunkBegin >= chunkEnd) {
+                return;
             }
-            ss << "\n";
+            // Scratch space comes from the thread's arena, so revalidating doesn't touch the heap
+            BlockArena& arena = BlockArena::local();
+            BlockArena::Scope scope(arena);
+            std::pmr::vector<BlockHeader> headers(&arena);
+            headers.reserve(chunkEnd - chunkBegin);
+            for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+                headers.push_back(m_chain[i]->block.getHeader());
+            }
+            std::pmr::vector<Hash256> digests(headers.size(), &arena);
+            HeaderHasher::hashHeaders(headers.data(), headers.size(), digests.data());
+            for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+                if (hashFromHex(m_chain[i]->block.getHash()) != digests[i - chunkBegin]) {
+                    firstInvalid[chunk] = i;
+                    return;
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t chunk = 1; chunk < threadCount; ++chunk) {
+            workers.emplace_back(checkChunk, chunk);
         }
-        ss << "Sender Sent: ";
-        if (m_senderSent.empty()) {
-            ss << "None\n";
+        checkChunk(0);
+        for (auto& worker : workers) {
+            worker.join();
         }
-        else {
-            for (const auto& sent : m_senderSent) {
-                ss << sent << " ";
+        return *std::min_element(firstInvalid.begin(), firstInvalid.end());
+    }
+
+    // Target for the child of parent. It's the average target of the last retargetWindow blocks,
+    // scaled by how long they actually took against how long they should have taken, so block
+    // times settle on m_targetBlockSeconds. The timespan is clamped to a factor of four either way
+    // so skewed timestamps can't swing it further, and it never gets easier than the limit.
+    uint32_t nextTarget(const BlockIndex::Node* parent) const {
+        const BlockIndex::Node* window[retargetWindow + 1];
+        const BlockIndex::Node* node = parent;
+        for (size_t i = 0; i <= retargetWindow && node; ++i, node = node->parent) {
+            window[i] = node;
+        }
+        return nextTarget(parent->height, [&](size_t height) {
+            const BlockIndex::Node* ancestor = window[parent->height - height];
+            return std::make_pair(ancestor->block.getTimestamp(), ancestor->target);
+        });
+    }
+
+    // The same for a parent at parentHeight, where at(height) gives the timestamp and target of
+    // the block at that height on the parent's branch
+    template<typename Ancestor>
+    uint32_t nextTarget(size_t parentHeight, Ancestor at) const {
+        if (parentHeight < retargetWindow) {
+            return at(parentHeight).second;
+        }
+        double targetSum = 0.0;
+        for (size_t i = 0; i < retargetWindow; ++i) {
+            targetSum += targetValue(at(parentHeight - i).second);
+        }
+        double expectedSeconds = static_cast<double>(retargetWindow * m_targetBlockSeconds);
+        double actualSeconds = static_cast<double>(at(parentHeight).first - at(parentHeight - retargetWindow).first);
+        actualSeconds = std::max(expectedSeconds / 4.0, std::min(actualSeconds, expectedSeconds * 4.0));
+        double target = targetSum / retargetWindow * (actualSeconds / expectedSeconds);
+        return compactFromValue(std::min(target, targetValue(m_powLimit)));
+    }
+
+    // Index a mined block and, if its branch now has the most work, make that branch active
+    bool acceptBlock(Block block, BlockIndex::Node* parent) {
+        if (parent->invalid) {
+            Logger::instance().log(Logger::Level::Warning, "block builds on an invalid block", {{"hash", block.getHash()}});
+            return false;
+        }
+        // Blocks whose undo records are gone can't be undone, so a branch forking below them could
+        // never become active
+        size_t undoHeight = m_state.getPrunedHeight();
+        if (parent != m_chain.back() && undoHeight > 0 && BlockIndex::findCommonAncestor(m_chain.back(), parent)->height + 1 < undoHeight) {
+            Logger::instance().log(Logger::Level::Warning, "block forks below the pruned height", {{"hash", block.getHash()}, {"prunedHeight", undoHeight}});
+            return false;
+        }
+        uint32_t target = nextTarget(parent);
+        if (!meetsTarget(hashFromHex(block.getHash()), targetFromCompact(target))) {
+            Logger::instance().log(Logger::Level::Warning, "block does not meet its target", {{"hash", block.getHash()}, {"target", static_cast<uint64_t>(target)}});
+            return false;
+        }
+        // The state is at the tip, so a block extending it can have its transactions and spends
+        // checked right away. Blocks on other branches are checked as switchToFork connects them.
+        if (parent == m_chain.back() && !checkAgainstState(block)) {
+            return false;
+        }
+        BlockIndex::Node* node = m_index.insert(std::move(block), target, parent);
+        if (!node) {
+            Logger::instance().log(Logger::Level::Debug, "block is already known");
+            return false;
+        }
+
+        BlockIndex::Node* bestTip = m_index.getBestTip();
+        if (bestTip == m_chain.back()) {
+            // The block went onto a side branch that doesn't have more work yet
+            return true;
+        }
+        if (bestTip->parent == m_chain.back()) {
+            connectBlock(bestTip);
+            return true;
+        }
+        switchToFork(bestTip);
+        return !node->invalid;
+    }
+
+    // Checks of a block against the state at its parent, which has to be the tip: every transaction
+    // passes checkTransaction and every spend is covered
+    bool checkAgainstState(const Block& block) const {
+        if (!hasValidReward(block)) {
+            Logger::instance().log(Logger::Level::Warning, "block pays a reward other than the subsidy", {{"hash", block.getHash()}, {"reward", block.getReward()}});
+            return false;
+        }
+        if (!m_state.checkTransactions(block, m_validationThreads)) {
+            Logger::instance().log(Logger::Level::Warning, "block has a transaction its sender's history doesn't allow", {{"hash", block.getHash()}});
+            return false;
+        }
+        if (!m_state.validateBlock(block)) {
+            Logger::instance().log(Logger::Level::Warning, "block spends more than its senders hold", {{"hash", block.getHash()}});
+            return false;
+        }
+        return true;
+    }
+
+    // The header claims blockReward, and a leading self-payment, which is the mining reward, pays
+    // exactly that. Any other leading self-payment would credit its sender without debiting them.
+    static bool hasValidReward(const Block& block) {
+        if (block.getReward() != blockReward) {
+            return false;
+        }
+        const std::vector<Transaction>& transactions = block.getTransactions();
+        bool hasReward = !transactions.empty() && transactions[0].getSenderId() == transactions[0].getRecipientId();
+        return !hasReward || transactions[0].getAmount() == blockReward;
+    }
+
+    void connectBlock(BlockIndex::Node* node) {
+        m_chain.push_back(node);
+        if (m_store) {
+            m_store->append(node->block);
+        }
+        m_state.applyBlock(node->block);
+        m_mempool.removeForBlock(node->block);
+        if (m_store) {
+            keepInStore(node);
+        }
+        if (m_snapshotInterval > 0 && !m_snapshotPath.empty() && node->height % m_snapshotInterval == 0) {
+            writeSnapshot();
+        }
+        if (m_pruneDepth > 0) {
+            prune();
+        }
+    }
+
+    // Prune the active blocks more than m_pruneDepth below the tip, and the stored blocks up to the
+    // latest snapshot, since reopening the store starts from it
+    void prune() {
+        size_t height = m_chain.size() > m_pruneDepth ? m_chain.size() - m_pruneDepth : 0;
+        for (; m_prunedHeight < height; ++m_prunedHeight) {
+            if (m_chain[m_prunedHeight]) {
+                m_chain[m_prunedHeight]->block.pruneTransactions();
+                m_chain[m_prunedHeight]->inStore = false;
             }
-            ss << "\n";
         }
-        return ss.str();
+        m_state.pruneUndo(m_prunedHeight);
+        if (m_store && m_snapshotHeight) {
+            m_store->prune(std::min(m_prunedHeight, *m_snapshotHeight + 1));
+        }
     }
 
-private:
-    std::string m_sender;
-    std::string m_recipient;
-    double m_amount;
-    double m_fee;
-    std::string m_date = getTimeStamp();
-    std::vector<std::string> m_recipientList;
-    std::vector<double> m_senderSent;
-
-    std::string getTimeStamp() const {
-        std::time_t currentTime = std::time(nullptr);
-        std::stringstream ss;
-        ss << std::put_time(std::localtime(&currentTime), "%Y-%m-%d %H:%M:%S");
-        return ss.str();
+    // Once a block is in the store only its header stays in memory; loadBlock reads the body back
+    static void keepInStore(BlockIndex::Node* node) {
+        node->block.pruneTransactions();
+        node->inStore = true;
     }
-};
 
-class Wallet {
-public:
-    Wallet(const std::string& name, double balance = 0.0) : m_name(name), m_balance(balance) {}
+    // Body of an indexed block, read back from the store if only its header is in memory
+    Block loadBlock(const BlockIndex::Node* node) const {
+        return node->inStore ? m_store->get(node->height).toBlock() : node->block;
+    }
 
-    std::string getName() const { return m_name; }
-    double getBalance() const { return m_balance; }
-    std::vector<Transaction> getReceivedTransactions() const { return m_receivedTransactions; }
-    std::map<std::string, std::vector<double>> getSenderSentMap() const { return m_senderSentMap; }
+    // The active tip and the ancestors its children's targets depend on, with the balances
+    StateSnapshot makeSnapshot() const {
+        StateSnapshot snapshot;
+        snapshot.height = m_chain.size() - 1;
+        for (const BlockIndex::Node* node = m_chain.back(); node && snapshot.blocks.size() <= retargetWindow; node = node->parent) {
+            snapshot.blocks.push_back({node->block.getHash(), node->block.getPreviousHash(), node->block.getHeader(), node->target});
+            snapshot.chainWork = node->chainWork;
+        }
+        std::reverse(snapshot.blocks.begin(), snapshot.blocks.end());
+        snapshot.state = m_state.withoutUndo();
+        return snapshot;
+    }
 
-    void addFunds(double amount, const std::string& source) {
-        // Add the amount to the wallet balance
-        m_balance += amount;
+    // Write a snapshot of the active tip to m_snapshotPath. A failure is logged rather than thrown,
+    // since the block that triggered it has been connected either way.
+    void writeSnapshot() {
+        static Metrics::Counter& snapshots = Metrics::instance().counter("blockchain_snapshots_written_total", "State snapshots written");
+        try {
+            makeSnapshot().write(m_snapshotPath);
+            m_snapshotHeight = m_chain.size() - 1;
+            snapshots.add();
+            Logger::instance().log(Logger::Level::Info, "state snapshot written", {{"height", *m_snapshotHeight}, {"path", m_snapshotPath}});
+        } catch (const std::exception& error) {
+            Logger::instance().log(Logger::Level::Error, "failed to write state snapshot", {{"path", m_snapshotPath}, {"error", error.what()}});
+        }
+    }
 
-        // Create a new Transaction object to represent the added funds
-        Transaction transaction(source, m_name, amount, 0.05, {});
-        
-        // Add the transaction to the receivedTransactions list
-        m_receivedTransactions.push_back(transaction);
+    // Index the snapshot's blocks by their headers and take over its balances
+    void restoreSnapshot(const StateSnapshot& snapshot) {
+        m_baseHeight = snapshot.height + 1 - snapshot.blocks.size();
+        m_chain.assign(m_baseHeight, nullptr);
+        for (const auto& entry : snapshot.blocks) {
+            // The genesis block's stored hash isn't its header hash, just as validateFrom skips it
+            Block block = Block::fromHeader(entry.header, entry.previousHash, entry.hash);
+            bool isGenesis = m_chain.empty();
+            if (!isGenesis && (block.calculateHash() != entry.hash || (m_chain.back() && entry.previousHash != m_chain.back()->block.getHash()))) {
+                throw std::runtime_error("State snapshot blocks don't form a chain");
+            }
+            m_chain.push_back(m_chain.size() == m_baseHeight ? m_index.insertRoot(std::move(block), entry.target, m_baseHeight, snapshot.chainWork)
+                                                             : m_index.insert(std::move(block), entry.target, m_chain.back()));
+        }
+        m_state = snapshot.state;
+        m_prunedHeight = snapshot.height + 1;
+        m_snapshotHeight = snapshot.height;
+        m_validatedHeight.store(m_chain.size());
+    }
+
+    // Make the branch ending in newTip active. Only the blocks between the two tips and their common
+    // ancestor are visited, so a reorg of depth d costs O(d) and no block is copied.
+    void switchToFork(BlockIndex::Node* newTip) {
+        // Find the common ancestor block of the main chain and the new chain
+        BlockIndex::Node* ancestor = BlockIndex::findCommonAncestor(m_chain.back(), newTip);
+        std::vector<BlockIndex::Node*> branch;
+        for (BlockIndex::Node* node = newTip; node != ancestor; node = node->parent) {
+            branch.push_back(node);
+        }
 
-        // Print transaction details
-        std::cout << "Added funds transaction details: " << transaction.toString() << std::endl;
+        // Roll back the main chain to the common ancestor block
+        std::vector<BlockIndex::Node*> disconnected;
+        bool abandonedSnapshot = false;
+        while (m_chain.back() != ancestor) {
+            // The store is about to drop the block, so bring its body back into memory first
+            BlockIndex::Node* node = m_chain.back();
+            if (node->inStore) {
+                node->block = m_store->get(node->height).toBlock();
+                node->inStore = false;
+            }
+            disconnected.push_back(node);
+            m_state.undoBlock();
+            m_chain.pop_back();
+            if (m_snapshotHeight && *m_snapshotHeight == m_chain.size()) {
+                m_snapshotHeight.reset();
+                abandonedSnapshot = true;
+            }
+        }
+        m_validatedHeight.store(std::min(m_validatedHeight.load(), m_chain.size()));
+        if (m_store) {
+            m_store->truncate(m_chain.size());
+        }
+        static Metrics::Counter& reorgs = Metrics::instance().counter("blockchain_reorgs_total", "Times the active chain switched to another branch");
+        static Metrics::Histogram& reorgDepth = Metrics::instance().histogram("blockchain_reorg_depth", "Blocks disconnected by each reorg", {1, 2, 4, 8, 16, 32, 64, 128});
+        reorgs.add();
+        reorgDepth.observe(static_cast<double>(disconnected.size()));
 
-        // Check if the transaction has senderSent information and add it to the senderSentMap
-        std::vector<double> senderSent = transaction.getSenderSent();
-        if (!senderSent.empty()) {
-            for (size_t i = 0; i < senderSent.size(); i++) {
-                if (i < transaction.getRecipientList().size()) {
-                    m_senderSentMap[transaction.getRecipientList()[i]] += senderSent[i];
+        // Transactions from the abandoned blocks go back to the mempool, except mining rewards.
+        // Any that the new branch also contains are removed again as it's connected.
+        for (BlockIndex::Node* node : disconnected) {
+            const std::vector<Transaction>& transactions = node->block.getTransactions();
+            for (size_t i = 0; i < transactions.size(); ++i) {
+                if (i != 0 || transactions[0].getSenderId() != transactions[0].getRecipientId()) {
+                    m_mempool.add(transactions[i], m_state.checkTransaction(transactions[i]));
                 }
             }
         }
+
+        // Add the blocks of the new chain to the main chain, oldest first. If one fails its checks, its
+        // branch is marked invalid and the chain switches to the best branch left, normally back to
+        // the one it just left.
+        for (auto it = branch.rbegin(); it != branch.rend(); ++it) {
+            if (!checkAgainstState((*it)->block)) {
+                m_index.markInvalid(*it);
+                switchToFork(m_index.getBestTip());
+                break;
+            }
+            connectBlock(*it);
+        }
+
+        // The latest snapshot was of an abandoned block and no longer matches the store, so replace it
+        if (abandonedSnapshot && !m_snapshotHeight && !m_snapshotPath.empty()) {
+            writeSnapshot();
+        }
     }
 
-    std::vector<Transaction> sendMoney(double amount, const std::vector<std::string>& recipients) {
+    // Admit transactions to the mempool by checkTransaction. Transactions re-added under the
+    // exclusive lock during a reorg are checked directly instead.
+    void checkMempoolAgainstState() {
+        m_mempool.setTransactionCheck([this](const Transaction& transaction) { return checkTransaction(transaction); });
+    }
+
+    void createGenesisBlock() {
+        // Create the genesis block with an arbitrary previous hash. Its timestamp is fixed, since
+        // retargeting reads it and every node has to arrive at the same targets. It mints Alice's
+        // opening balance, since blocks may only spend what their senders hold on the chain.
         std::vector<Transaction> transactions;
-        double fee = 0.05;
+        transactions.emplace_back(Transaction("Alice", "Alice", 1000000.0, 0.0));
+        transactions.emplace_back(Transaction("Alice", "Bob", 50.0, 0.0));
+        m_chain.push_back(m_index.insert(Block(transactions, "0", genesisTimestamp), m_powLimit));
+        m_state.applyGenesis(m_chain.back()->block);
+    }
+};
 
-        // Check if the wallet has enough balance to send the amount
-        if (m_balance < amount) {
-            std::cerr << "Error: Wallet balance is insufficient" << std::endl;
-            return transactions;
-        }
+// Gossip between nodes over TCP. Transactions are announced by id and only sent to peers that ask
+// for them. Blocks are relayed in compact form: the header, the mining reward, and a 6-byte short id
+// per transaction, which the receiver matches against its own mempool. Only transactions it's
+// missing cost another round trip, so relaying a block whose transactions were already gossiped
+// takes a few bytes per transaction instead of the whole block.
+//
+// Every message is framed as u32 payloadLength | u8 type | payload. Each peer has a reader thread
+// that handles its messages in order, and sends to a peer are serialised by that peer's mutex.
+class Node {
+public:
+    enum class MessageType : uint8_t {
+        Inventory = 1,        // varint count | id[count]: transactions the sender has
+        GetTransactions,      // varint count | id[count]
+        Transactions,         // varint count | str transactionRecord[count]
+        CompactBlock,         // see encodeCompactBlock
+        GetBlockTransactions, // digest blockHash | varint count | varint index[count]
+        BlockTransactions,    // digest blockHash | varint count | str transactionRecord[count]
+        GetBlock,             // digest blockHash
+        FullBlock,            // str blockRecord
+        GetHeaders,           // str blockHash | varint count: headers of the blocks after blockHash
+        Headers               // varint count | header[count], each BlockHeader::serializedSize bytes
+    };
 
-        // If there is only one recipient, send the entire amount to that recipient
-        if (recipients.size() == 1) {
-            Transaction transaction(m_name, recipients[0], amount, fee);
-            transactions.push_back(transaction);
-            m_balance -= amount;
+    struct Stats {
+        uint64_t bytesSent = 0;
+        uint64_t bytesReceived = 0;
+        uint64_t compactBlocksReceived = 0;
+        uint64_t compactBlockBytesReceived = 0;
+        uint64_t blocksReconstructed = 0;
+        uint64_t blockTransactionRequests = 0; // Compact blocks that needed a round trip for missing transactions
+        uint64_t fullBlockRequests = 0;        // Compact blocks that couldn't be rebuilt at all
+    };
+
+    static constexpr size_t maxMessageSize = 32 * 1024 * 1024;
+    static constexpr size_t shortIdSize = 6;
+    static constexpr size_t maxHeadersPerMessage = 2000;
+
+    // Block bodies a sync keeps requested ahead of the next block to connect, and how long it
+    // waits for one before asking the next peer
+    static constexpr size_t syncWindow = 256;
+    static constexpr double syncRequestSeconds = 2.0;
+
+    // How long an unanswered transaction request keeps an announced id from being requested
+    // again, and how many compact blocks a peer may leave waiting for their missing transactions
+    static constexpr double transactionRequestSeconds = 10.0;
+    static constexpr size_t maxPendingBlocks = 8;
+
+    struct SyncResult {
+        size_t headers = 0; // Headers that passed the checks
+        size_t blocks = 0;  // Blocks connected
+        double seconds = 0.0;
+        double blocksPerSecond = 0.0;
+    };
+
+    // Listen on a loopback port, or a free one if port is 0
+    explicit Node(Blockchain& chain, uint16_t port = 0) : m_chain(chain), m_port(port) {
+        m_listenFd = listenOnLoopback(m_port);
+        m_acceptor = std::thread([this] { acceptLoop(); });
+    }
+
+    ~Node() {
+        m_stop.store(true);
+        m_acceptor.join();
+        close(m_listenFd);
 
-            // Print transaction details
-            std::cout << "Sent transaction details: " << transaction.toString() << std::endl;
+        // Shutting the sockets down ends the readers' blocking reads. They may still be relaying to
+        // each other, so the lock isn't held while joining them.
+        std::vector<std::shared_ptr<Peer>> peers;
+        {
+            std::unique_lock<std::shared_mutex> lock(m_peersMutex);
+            for (auto& peer : m_peers) {
+                shutdown(peer->fd, SHUT_RDWR);
+            }
+            peers.swap(m_peers);
         }
-        // If there are multiple recipients, split the transaction into multiple transactions
-        else {
-            Transaction transaction(m_name, "", amount, fee, {});
-            transaction.setRecipientList(recipients);
-            std::vector<Transaction> splitTransactions = transaction.splitTransaction(transaction);
-            for (const auto& t : splitTransactions) {
-                transactions.push_back(t);
-                m_balance -= t.getAmount();
+        for (auto& peer : peers) {
+            peer->reader.join();
+            close(peer->fd);
+        }
+    }
 
-                // Print transaction details
-                std::cout << "Sent transaction details: " << t.toString() << std::endl;
+    Node(const Node&) = delete;
+    Node& operator=(const Node&) = delete;
+
+    uint16_t getPort() const { return m_port; }
+
+    void connect(const std::string& host, uint16_t port) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        if (fd < 0 || inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1 ||
+            ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            if (fd >= 0) {
+                close(fd);
             }
+            throw std::runtime_error("Failed to connect to " + host + ":" + std::to_string(port));
         }
+        addPeer(fd);
+    }
 
-        // Update the senderSent list for each transaction
-        std::vector<double> senderSent;
-        for (const auto& transaction : transactions) {
-            if (transaction.getSender() == m_name) {
-                senderSent.push_back(transaction.getAmount());
+    size_t getPeerCount() const {
+        std::shared_lock<std::shared_mutex> lock(m_peersMutex);
+        return std::count_if(m_peers.begin(), m_peers.end(), [](const auto& peer) { return peer->connected.load(); });
+    }
+
+    Stats getStats() const {
+        Stats stats;
+        stats.bytesSent = m_bytesSent.load();
+        stats.bytesReceived = m_bytesReceived.load();
+        stats.compactBlocksReceived = m_compactBlocksReceived.load();
+        stats.compactBlockBytesReceived = m_compactBlockBytesReceived.load();
+        stats.blocksReconstructed = m_blocksReconstructed.load();
+        stats.blockTransactionRequests = m_blockTransactionRequests.load();
+        stats.fullBlockRequests = m_fullBlockRequests.load();
+        return stats;
+    }
+
+    // Add a transaction to the local mempool and announce it to every peer
+    Mempool::AddResult broadcastTransaction(const Transaction& transaction) {
+        Mempool::AddResult result = m_chain.getMempool().add(transaction);
+        if (result == Mempool::AddResult::Added) {
+            announceTransaction(transaction.calculateHash(), nullptr);
+        }
+        return result;
+    }
+
+    // Send a block the chain has accepted, e.g. one just mined, to every peer in compact form
+    void relayBlock(const Block& block) {
+        relayBlock(block, nullptr);
+    }
+
+    // Catch up with the connected peers, headers first. The headers after the local tip come from
+    // one peer and are checked on their own: each links to the one before and meets the target for
+    // its height. Block bodies are then requested from all peers at once, at most syncWindow ahead
+    // of the next block to connect, and each is checked against its header by the reader thread it
+    // arrives on, in whatever order they come. Only connecting them runs in height order.
+    SyncResult sync(double maxSeconds = 60.0) {
+        auto startTime = std::chrono::steady_clock::now();
+        auto deadline = startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(maxSeconds));
+        SyncResult result;
+        std::vector<std::shared_ptr<Peer>> peers;
+        {
+            std::shared_lock<std::shared_mutex> lock(m_peersMutex);
+            for (auto& peer : m_peers) {
+                if (peer->connected.load()) {
+                    peers.push_back(peer);
+                }
             }
         }
-        if (!senderSent.empty()) {
-            transactions.back().setSenderSent(senderSent);
+        if (peers.empty()) {
+            return result;
         }
 
-        return transactions;
-    }
+        std::unique_lock<std::mutex> lock(m_syncMutex);
+        if (m_sync) {
+            throw std::logic_error("A sync is already running");
+        }
+        m_sync = std::make_unique<SyncState>();
+        SyncState& state = *m_sync;
+        state.headers = m_chain.beginHeaderChain();
+        state.headerPeer = peers[0].get();
 
-    void receiveMoney(const std::vector<Transaction>& transactions) {
-        // Add money to wallet balance
-        for (const auto& transaction : transactions) {
-            if (transaction.getRecipient() == m_name) {
-                // Check if the transaction has already been processed
-                if (std::find(m_receivedTransactions.begin(), m_receivedTransactions.end(), transaction) != m_receivedTransactions.end()) {
-                    std::cerr << "Error: Transaction has already been processed" << std::endl;
+        // Stage 1: headers, a batch at a time until one comes back short. Nothing is sent while
+        // holding the sync lock, since the reader threads need it to make progress.
+        for (bool more = true; more;) {
+            std::string payload;
+            appendString(payload, state.headers.getLastHash());
+            appendVarint(payload, maxHeadersPerMessage);
+            state.headersPending = true;
+            lock.unlock();
+            send(*state.headerPeer, MessageType::GetHeaders, payload);
+            lock.lock();
+            if (!m_syncChanged.wait_until(lock, deadline, [&] { return !state.headersPending; })) {
+                break;
+            }
+            more = state.headersValid && state.lastHeaderBatch == maxHeadersPerMessage;
+        }
+
+        // Stage 2: bodies from every peer in a sliding window
+        size_t total = state.headers.size();
+        result.headers = total;
+        state.indexByHash.reserve(total);
+        for (size_t i = 0; i < total; ++i) {
+            state.indexByHash.emplace(toHex(state.headers.hashes[i]), i);
+        }
+        state.requestedAt.assign(total, std::chrono::steady_clock::time_point());
+        state.attempts.assign(total, 0);
+        auto requestTimeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(syncRequestSeconds));
+        while (state.nextIndex < total && std::chrono::steady_clock::now() < deadline) {
+            // Request the bodies in the window that haven't been, or whose request timed out, each
+            // time from the next peer along
+            auto now = std::chrono::steady_clock::now();
+            std::vector<std::pair<Peer*, Hash256>> requests;
+            for (size_t i = state.nextIndex; i < std::min(total, state.nextIndex + syncWindow); ++i) {
+                if (state.ready.count(i) || (state.attempts[i] > 0 && now - state.requestedAt[i] < requestTimeout)) {
                     continue;
                 }
-                // Add the transaction amount to the balance
-                m_balance += transaction.getAmount();
-                // Add the transaction to the receivedTransactions list
-                m_receivedTransactions.push_back(transaction);
+                Peer* peer = peers[(i + state.attempts[i]++) % peers.size()].get();
+                state.requestedAt[i] = now;
+                requests.emplace_back(peer, state.headers.hashes[i]);
+            }
 
-                std::cout << "Received transaction details: " << std::endl;
-                std::cout << transaction.toString() << std::endl;
+            // Take the checked bodies that are next in line. Moving nextIndex past them right away
+            // lets the readers drop any duplicates that arrive while they're connected.
+            std::vector<Block> batch;
+            for (auto it = state.ready.begin(); it != state.ready.end() && it->first == state.nextIndex + batch.size(); it = state.ready.erase(it)) {
+                batch.push_back(std::move(it->second));
+            }
+            size_t batchSize = batch.size();
+            state.nextIndex += batchSize;
 
-                // Check if the transaction has senderSent information and add it to the senderSentMap
-                std::vector<double> senderSent = transaction.getSenderSent();
-                if (!senderSent.empty()) {
-                    for (size_t i = 0; i < senderSent.size(); i++) {
-                        if (i < transaction.getRecipientList().size()) {
-                            m_senderSentMap[transaction.getRecipientList()[i]] += senderSent[i];
-                        }
-                    }
-                }
+            lock.unlock();
+            for (const auto& [peer, hash] : requests) {
+                std::string payload;
+                appendDigest(payload, hash);
+                send(*peer, MessageType::GetBlock, payload);
+            }
+            bool connected = true;
+            if (batchSize > 0) {
+                // A body that matches a checked header can only be rejected if the header chain
+                // itself is bad, so there's no point going on
+                std::string lastHash = batch.back().getHash();
+                m_chain.connectCheckedBlocks(std::move(batch));
+                connected = m_chain.hasBlock(lastHash);
+            }
+            lock.lock();
+            if (!connected) {
+                Logger::instance().log(Logger::Level::Warning, "sync stopped at a block that failed to connect", {{"height", state.headers.baseHeight + state.nextIndex}});
+                break;
+            }
+            result.blocks += batchSize;
+            if (batchSize == 0 && requests.empty()) {
+                m_syncChanged.wait_until(lock, std::min(deadline, now + std::chrono::milliseconds(100)), [&] { return state.ready.count(state.nextIndex) > 0; });
             }
         }
+        m_sync.reset();
+        lock.unlock();
+
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        result.blocksPerSecond = result.seconds > 0.0 ? result.blocks / result.seconds : 0.0;
+        Logger::instance().log(Logger::Level::Info, "sync finished", {{"headers", result.headers}, {"blocks", result.blocks}, {"blocksPerSecond", result.blocksPerSecond}});
+        return result;
     }
 
-    std::vector<Transaction> getSentTransactions() const {
-        std::vector<Transaction> sentTransactions;
-        for (const auto& [sender, sent] : m_senderSentMap) {
-            for (auto&& amount : sent) {
-                sentTransactions.emplace_back(std::move(sender), m_name, std::move(amount));
+    // Short id of a transaction in a block, from SipHash keyed with the block's hash. The leading
+    // bytes of a mined hash are zeros, so the key comes from the trailing ones.
+    static uint64_t shortId(const Hash256& blockDigest, const Hash256& transactionId) {
+        uint64_t k0;
+        uint64_t k1;
+        std::memcpy(&k0, blockDigest.data() + 16, sizeof(k0));
+        std::memcpy(&k1, blockDigest.data() + 24, sizeof(k1));
+        return sipHash24(k0, k1, transactionId.data(), transactionId.size()) & ((uint64_t(1) << (8 * shortIdSize)) - 1);
+    }
+
+    //   str header | varint transactionCount | varint prefilledCount | (varint index | str transactionRecord)[prefilledCount] |
+    //   u48 shortId[transactionCount - prefilledCount]
+    // where header is the block's record without its transactions, and the short ids are for the
+    // transactions that weren't prefilled, in order. Only the mining reward is prefilled, since no
+    // mempool has it.
+    static std::string encodeCompactBlock(const Block& block) {
+        const std::vector<Transaction>& transactions = block.getTransactions();
+        std::string bytes;
+        appendString(bytes, BlockView::encode(Block::fromHeader(block.getHeader(), block.getPreviousHash(), block.getHash())));
+        appendVarint(bytes, transactions.size());
+        bool hasReward = !transactions.empty() && transactions[0].getSenderId() == transactions[0].getRecipientId();
+        appendVarint(bytes, hasReward ? 1 : 0);
+        if (hasReward) {
+            appendVarint(bytes, 0);
+            appendString(bytes, TransactionView::encode(transactions[0]));
+        }
+        Hash256 blockDigest = hashFromHex(block.getHash());
+        for (size_t i = hasReward ? 1 : 0; i < transactions.size(); ++i) {
+            uint64_t id = shortId(blockDigest, transactions[i].calculateHash());
+            for (size_t byte = 0; byte < shortIdSize; ++byte) {
+                bytes.push_back(static_cast<char>(id >> (8 * byte)));
             }
         }
-        return sentTransactions;
+        return bytes;
     }
 
-    std::vector<Transaction> getTransactionsInRange(const std::string& start_date, const std::string& end_date) const {
-        std::vector<Transaction> transactionsInRange;
-        for (const auto& transaction : m_receivedTransactions) {
-            if (transaction.getDate() >= start_date && transaction.getDate() <= end_date) {
-                transactionsInRange.push_back(transaction);
+private:
+    // A compact block waiting for transactions requested from the peer that sent it
+    struct PartialBlock {
+        std::string previousHash;
+        std::string hash;
+        int64_t timestamp;
+        uint64_t nonce;
+        double reward;
+        std::vector<std::optional<Transaction>> transactions;
+        std::vector<size_t> missing;
+        std::chrono::steady_clock::time_point requestedAt;
+    };
+
+    struct Peer {
+        int fd;
+        std::thread reader;
+        std::mutex sendMutex;
+        std::atomic<bool> connected{true};
+        std::unordered_map<std::string, PartialBlock> pending; // Only touched by the reader thread
+    };
+
+    // Progress of a running sync, shared between the thread running it and the reader threads
+    struct SyncState {
+        Blockchain::HeaderChain headers;
+        Peer* headerPeer = nullptr;
+        bool headersPending = false; // A GetHeaders is waiting for its answer
+        bool headersValid = true;    // Every header received so far passed the checks
+        size_t lastHeaderBatch = 0;
+        std::unordered_map<std::string, size_t> indexByHash; // Position in headers, by block hash
+        std::vector<std::chrono::steady_clock::time_point> requestedAt;
+        std::vector<uint32_t> attempts;
+        std::map<size_t, Block> ready; // Bodies checked against their headers, waiting to be connected
+        size_t nextIndex = 0;          // Position in headers of the next block to connect
+    };
+
+    Blockchain& m_chain;
+    uint16_t m_port;
+    int m_listenFd;
+    std::atomic<bool> m_stop{false};
+    std::thread m_acceptor;
+    // Shared so a running sync keeps the peers it picked alive after they're dropped from here
+    std::vector<std::shared_ptr<Peer>> m_peers;
+    mutable std::shared_mutex m_peersMutex;
+
+    // Transactions requested from some peer and when, so an announcement from several peers only
+    // fetches them once. An entry goes when the transaction arrives or is confirmed, or once the
+    // request has gone unanswered for transactionRequestSeconds.
+    std::unordered_map<Hash256, std::chrono::steady_clock::time_point, Hash256Hasher> m_requested;
+    std::mutex m_requestedMutex;
+
+    std::unique_ptr<SyncState> m_sync;
+    std::mutex m_syncMutex;
+    std::condition_variable m_syncChanged;
+
+    std::atomic<uint64_t> m_bytesSent{0};
+    std::atomic<uint64_t> m_bytesReceived{0};
+    std::atomic<uint64_t> m_compactBlocksReceived{0};
+    std::atomic<uint64_t> m_compactBlockBytesReceived{0};
+    std::atomic<uint64_t> m_blocksReconstructed{0};
+    std::atomic<uint64_t> m_blockTransactionRequests{0};
+    std::atomic<uint64_t> m_fullBlockRequests{0};
+
+    void acceptLoop() {
+        while (!m_stop.load()) {
+            removeDisconnectedPeers();
+            expireRequests();
+            pollfd listener = {m_listenFd, POLLIN, 0};
+            if (poll(&listener, 1, 100) <= 0) {
+                continue;
+            }
+            int fd = accept(m_listenFd, nullptr, nullptr);
+            if (fd >= 0) {
+                addPeer(fd);
             }
         }
-        return transactionsInRange;
     }
 
-    std::vector<Transaction> getTransactionHistory(int limit = -1) const {
-        std::vector<Transaction> transactionHistory = m_receivedTransactions;
-        std::reverse(transactionHistory.begin(), transactionHistory.end());
-        if (limit >= 0 && limit < static_cast<int>(transactionHistory.size())) {
-            transactionHistory.resize(limit);
+    void addPeer(int fd) {
+        // Messages are small and latency matters more than packet count
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        auto peer = std::make_shared<Peer>();
+        peer->fd = fd;
+        Peer& added = *peer;
+        // The reader starts before the peer is listed, so whoever finds it disconnected there can
+        // join it
+        added.reader = std::thread([this, &added] { readLoop(added); });
+        {
+            std::unique_lock<std::shared_mutex> lock(m_peersMutex);
+            m_peers.push_back(std::move(peer));
         }
-        return transactionHistory;
+        Logger::instance().log(Logger::Level::Info, "peer connected", {{"port", m_port}});
     }
 
-    int getTransactionCount() const {
-        return m_receivedTransactions.size();
+    // Forget requests nobody answered, which would otherwise pile up. This runs from the accept
+    // loop rather than per inventory message, so announcements don't pay for the sweep.
+    void expireRequests() {
+        auto now = std::chrono::steady_clock::now();
+        auto timeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(transactionRequestSeconds));
+        std::lock_guard<std::mutex> lock(m_requestedMutex);
+        for (auto it = m_requested.begin(); it != m_requested.end();) {
+            it = now - it->second >= timeout ? m_requested.erase(it) : std::next(it);
+        }
     }
 
-    double getTotalAmountSent() const {
-        double total = 0.0;
-        for (const auto& [_, sent] : m_senderSentMap) {
-            for (const auto& amount : sent) {
-                total += amount;
-            }
+    // Join and close the peers whose connection has ended. A sync may still hold one, so the
+    // socket is closed under the send lock and send() checks the connection under it too.
+    void removeDisconnectedPeers() {
+        std::vector<std::shared_ptr<Peer>> disconnected;
+        {
+            std::unique_lock<std::shared_mutex> lock(m_peersMutex);
+            auto end = std::partition(m_peers.begin(), m_peers.end(), [](const auto& peer) { return peer->connected.load(); });
+            disconnected.assign(std::make_move_iterator(end), std::make_move_iterator(m_peers.end()));
+            m_peers.erase(end, m_peers.end());
+        }
+        for (auto& peer : disconnected) {
+            shutdown(peer->fd, SHUT_RDWR);
+            peer->reader.join();
+            std::lock_guard<std::mutex> lock(peer->sendMutex);
+            close(peer->fd);
+            peer->fd = -1;
+        }
+        if (!disconnected.empty()) {
+            Logger::instance().log(Logger::Level::Info, "peers disconnected", {{"count", static_cast<uint64_t>(disconnected.size())}});
         }
-        return total;
     }
 
-    double getTotalAmountReceived() const {
-        double total = 0.0;
-        for (const auto& transaction : m_receivedTransactions) {
-            total += transaction.getAmount();
+    static bool readAll(int fd, unsigned char* data, size_t size) {
+        while (size > 0) {
+            ssize_t received = recv(fd, data, size, 0);
+            if (received <= 0) {
+                return false;
+            }
+            data += received;
+            size -= static_cast<size_t>(received);
         }
-        return total;
+        return true;
     }
 
-private:
-    std::string m_name;
-    double m_balance;
-    std::vector<Transaction> m_receivedTransactions; // vector to store all received transactions
-    std::map<std::string, std::vector<double>> m_senderSentMap; // map to store the amount sent by each sender
-};
+    void readLoop(Peer& peer) {
+        std::vector<unsigned char> payload;
+        for (;;) {
+            unsigned char header[5];
+            if (!readAll(peer.fd, header, sizeof(header))) {
+                break;
+            }
+            uint32_t length;
+            std::memcpy(&length, header, sizeof(length));
+            if (length > maxMessageSize) {
+                Logger::instance().log(Logger::Level::Warning, "peer sent an oversized message", {{"size", static_cast<uint64_t>(length)}});
+                break;
+            }
+            payload.resize(length);
+            if (!readAll(peer.fd, payload.data(), length)) {
+                break;
+            }
+            m_bytesReceived.fetch_add(sizeof(header) + length);
+            if (!handleMessage(peer, static_cast<MessageType>(header[4]), payload.data(), length)) {
+                Logger::instance().log(Logger::Level::Warning, "peer sent a malformed message", {{"type", static_cast<int>(header[4])}});
+                break;
+            }
+        }
+        peer.connected.store(false);
+        shutdown(peer.fd, SHUT_RDWR);
+    }
 
-class Block {
-public:
-    Block(const std::vector<Transaction>& transactions, const std::string& previousHash)
-    : m_transactions(transactions), m_previousHash(previousHash), m_nonce(0), m_reward(50.0) {}
+    void send(Peer& peer, MessageType type, const std::string& payload) {
+        if (!peer.connected.load()) {
+            return;
+        }
+        std::string frame;
+        frame.reserve(5 + payload.size());
+        appendU32(frame, static_cast<uint32_t>(payload.size()));
+        frame.push_back(static_cast<char>(type));
+        frame += payload;
+        std::lock_guard<std::mutex> lock(peer.sendMutex);
+        if (!peer.connected.load()) {
+            return;
+        }
+        for (size_t sent = 0; sent < frame.size();) {
+            ssize_t written = ::send(peer.fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+            if (written <= 0) {
+                peer.connected.store(false);
+                return;
+            }
+            sent += static_cast<size_t>(written);
+        }
+        m_bytesSent.fetch_add(frame.size());
+    }
 
-    std::string calculateHash() const {
-        std::stringstream ss;
-        ss << m_previousHash << m_nonce << m_reward;
-        for (const auto& transaction : m_transactions) {
-            ss << transaction.getSender() << transaction.getRecipient() << transaction.getAmount();
-            for (const auto& sent : transaction.getSenderSent()) {
-                ss << sent;
+    // Send to every connected peer except the one a message came from
+    void broadcast(MessageType type, const std::string& payload, const Peer* except) {
+        std::shared_lock<std::shared_mutex> lock(m_peersMutex);
+        for (auto& peer : m_peers) {
+            if (peer.get() != except) {
+                send(*peer, type, payload);
             }
         }
-        return sha256(ss.str());
     }
 
-    std::string getLastBlockHash() const {
-        return m_previousHash;
+    void announceTransaction(const Hash256& id, const Peer* except) {
+        std::string payload;
+        appendVarint(payload, 1);
+        payload.append(reinterpret_cast<const char*>(id.data()), id.size());
+        broadcast(MessageType::Inventory, payload, except);
     }
 
-    void mineBlock(int difficulty, const Wallet& minerWallet) {
-        // Set up the target hash prefix to match the desired block creation rate
-        std::string target(difficulty, '0');
-        double targetSeconds = 600.0 / ((double) m_transactions.size() / 1000000.0);
-        auto startTime = std::chrono::high_resolution_clock::now();
-        std::string previousHash = getLastBlockHash();
+    void relayBlock(const Block& block, const Peer* except) {
+        broadcast(MessageType::CompactBlock, encodeCompactBlock(block), except);
+    }
 
-        while (true) {
-            // Check if it's time to create a new block
-            auto currentTime = std::chrono::high_resolution_clock::now();
-            double timeElapsed = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - startTime).count() / 1000.0;
-            if (timeElapsed > targetSeconds) {
-                break;
-            }
+    static Hash256 readDigest(ByteReader& reader) {
+        Hash256 digest{};
+        std::string_view bytes = reader.readBytes(digest.size());
+        std::memcpy(digest.data(), bytes.data(), bytes.size());
+        return digest;
+    }
 
-            // Generate a random nonce and calculate the hash
-            m_nonce = rand();
-            m_hash = calculateHash();
+    static void appendDigest(std::string& bytes, const Hash256& digest) {
+        bytes.append(reinterpret_cast<const char*>(digest.data()), digest.size());
+    }
 
-            // Check if the hash matches the target prefix and the block size is within the limit
-            if (m_hash.substr(0, difficulty) == target && calculateBlockSize() <= 1000) {
-                std::cout << "Block mined: " << m_hash << std::endl;
+    static std::optional<Transaction> decodeTransaction(std::string_view record) {
+        TransactionView view = TransactionView::fromRecord(reinterpret_cast<const unsigned char*>(record.data()), record.size());
+        if (!view.isWellFormed()) {
+            return std::nullopt;
+        }
+        return view.toTransaction();
+    }
 
-                // Send the reward to the miner
-                std::vector<Transaction> rewardTransaction = minerWallet.sendMoney(m_reward, minerWallet.getName());
-                m_transactions.insert(m_transactions.begin(), rewardTransaction.begin(), rewardTransaction.end());
+    // Returns false if the message is malformed, which disconnects the peer
+    bool handleMessage(Peer& peer, MessageType type, const unsigned char* data, size_t size) {
+        ByteReader reader(data, data + size);
+        switch (type) {
+            case MessageType::Inventory: return handleInventory(peer, reader);
+            case MessageType::GetTransactions: return handleGetTransactions(peer, reader);
+            case MessageType::Transactions: return handleTransactions(peer, reader);
+            case MessageType::CompactBlock: return handleCompactBlock(peer, reader);
+            case MessageType::GetBlockTransactions: return handleGetBlockTransactions(peer, reader);
+            case MessageType::BlockTransactions: return handleBlockTransactions(peer, reader);
+            case MessageType::GetBlock: return handleGetBlock(peer, reader);
+            case MessageType::FullBlock: return handleFullBlock(peer, reader);
+            case MessageType::GetHeaders: return handleGetHeaders(peer, reader);
+            case MessageType::Headers: return handleHeaders(peer, reader);
+        }
+        return false;
+    }
 
-                // Clear the transactions list and update the previous hash
-                m_previousHash = previousHash;
-                m_transactions.clear();
-                return;
+    bool handleInventory(Peer& peer, ByteReader& reader) {
+        uint64_t count = reader.readVarint();
+        std::string request;
+        size_t requested = 0;
+        auto now = std::chrono::steady_clock::now();
+        auto timeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(transactionRequestSeconds));
+        for (uint64_t i = 0; i < count && !reader.failed; ++i) {
+            Hash256 id = readDigest(reader);
+            if (reader.failed || m_chain.getMempool().contains(id)) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(m_requestedMutex);
+            auto [it, inserted] = m_requested.try_emplace(id, now);
+            if (!inserted && now - it->second < timeout) {
+                continue;
             }
+            it->second = now;
+            appendDigest(request, id);
+            requested++;
         }
-
-        // If the loop exits, the target time has been exceeded and we need to adjust the difficulty
-        int currentDifficulty = difficulty;
-        double timeElapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - startTime).count() / 1000.0;
-        currentDifficulty = adjustDifficulty(timeElapsed, targetSeconds, currentDifficulty);
-        std::cout << "Block mining failed, adjusting difficulty to " << currentDifficulty << std::endl;
+        if (requested > 0) {
+            std::string payload;
+            appendVarint(payload, requested);
+            send(peer, MessageType::GetTransactions, payload + request);
+        }
+        return !reader.failed;
     }
 
-    std::vector<Transaction> getTransactions() const { return m_transactions; }
-    std::string getPreviousHash() const { return m_previousHash; }
-    std::string getHash() const { return m_hash; }
-    double getReward() const { return m_reward; }
-
-private:
-    std::vector<Transaction> m_transactions;
-    std::string m_previousHash;
-    std::string m_hash;
-    int m_nonce;
-    double m_reward;
-    std::vector<Block> m_chain;
-
-    std::string sha256(const std::string& str) const {
-        unsigned char hash[SHA256_DIGEST_LENGTH];
-        SHA256_CTX sha256;
-        SHA256_Init(&sha256);
-        SHA256_Update(&sha256, str.c_str(), str.size());
-        SHA256_Final(hash, &sha256);
-        std::stringstream ss;
-        for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
-            ss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(hash[i]);
+    bool handleGetTransactions(Peer& peer, ByteReader& reader) {
+        uint64_t count = reader.readVarint();
+        std::string records;
+        size_t found = 0;
+        for (uint64_t i = 0; i < count && !reader.failed; ++i) {
+            std::optional<Transaction> transaction = m_chain.getMempool().get(readDigest(reader));
+            if (transaction) {
+                appendString(records, TransactionView::encode(*transaction));
+                found++;
+            }
         }
-        return ss.str();
+        if (found > 0) {
+            std::string payload;
+            appendVarint(payload, found);
+            send(peer, MessageType::Transactions, payload + records);
+        }
+        return !reader.failed;
     }
 
-    int adjustDifficulty(double timeElapsed, int targetSeconds, int currentDifficulty) {
-        int newDifficulty = currentDifficulty;
-        if (timeElapsed < targetSeconds / 2) {
-            newDifficulty++;
-        } else if (timeElapsed > targetSeconds * 2) {
-            newDifficulty--;
+    bool handleTransactions(Peer& peer, ByteReader& reader) {
+        uint64_t count = reader.readVarint();
+        for (uint64_t i = 0; i < count && !reader.failed; ++i) {
+            std::optional<Transaction> transaction = decodeTransaction(reader.readString());
+            if (!transaction) {
+                return false;
+            }
+            Hash256 id = transaction->calculateHash();
+            if (m_chain.getMempool().add(*transaction) == Mempool::AddResult::Added) {
+                announceTransaction(id, &peer);
+            }
+            std::lock_guard<std::mutex> lock(m_requestedMutex);
+            m_requested.erase(id);
         }
-        return newDifficulty;
+        return !reader.failed;
     }
 
-    size_t calculateBlockSize() const {
-        size_t size = 0;
-        for (const auto& transaction : m_transactions) {
-            size += transaction.getSize();
+    bool handleCompactBlock(Peer& peer, ByteReader& reader) {
+        m_compactBlocksReceived.fetch_add(1);
+        m_compactBlockBytesReceived.fetch_add(static_cast<uint64_t>(reader.end - reader.position));
+        std::string_view headerRecord = reader.readString();
+        BlockView header(reinterpret_cast<const unsigned char*>(headerRecord.data()), headerRecord.size());
+        if (reader.failed || !header.isWellFormed() || header.getTransactionCount() != 0) {
+            return false;
+        }
+        PartialBlock partial{header.getPreviousHash(), header.getHash(), header.getTimestamp(), header.getNonce(), header.getReward(), {}, {}, {}};
+        if (m_chain.hasBlock(partial.hash)) {
+            return true;
         }
-        return size;
-    }
 
-    double calculateTotalFee() const {
-        double totalFee = 0.0;
+        // Every transaction takes at least a byte of the message, which bounds the count
+        uint64_t count = reader.readVarint();
+        if (count > static_cast<uint64_t>(reader.end - reader.position)) {
+            return false;
+        }
+        partial.transactions.resize(count);
+        uint64_t prefilledCount = reader.readVarint();
+        for (uint64_t i = 0; i < prefilledCount && !reader.failed; ++i) {
+            uint64_t index = reader.readVarint();
+            std::optional<Transaction> transaction = decodeTransaction(reader.readString());
+            if (index >= count || !transaction) {
+                return false;
+            }
+            partial.transactions[index] = std::move(transaction);
+        }
 
-        // Create a lambda function to calculate the fee for a single transaction
-        auto calculateTransactionFee = [] (const Transaction& t) {
-            return t.getFee();
-        };
+        // Match the short ids against the mempool. Two transactions of the block sharing a short id,
+        // or two pending ones matching the same id, mean the block can't be rebuilt reliably.
+        Hash256 blockDigest = hashFromHex(partial.hash);
+        std::unordered_map<uint64_t, size_t> byShortId;
+        bool collision = false;
+        for (size_t i = 0; i < count && !reader.failed; ++i) {
+            if (partial.transactions[i]) {
+                continue;
+            }
+            std::string_view bytes = reader.readBytes(shortIdSize);
+            uint64_t id = 0;
+            for (size_t byte = 0; byte < bytes.size(); ++byte) {
+                id |= static_cast<uint64_t>(static_cast<unsigned char>(bytes[byte])) << (8 * byte);
+            }
+            collision |= !byShortId.emplace(id, i).second;
+        }
+        if (reader.failed) {
+            return false;
+        }
+        m_chain.getMempool().forEach([&](const Hash256& transactionId, const Transaction& transaction) {
+            auto it = byShortId.find(shortId(blockDigest, transactionId));
+            if (it != byShortId.end()) {
+                collision |= partial.transactions[it->second].has_value();
+                partial.transactions[it->second] = transaction;
+            }
+        });
+        if (collision) {
+            requestFullBlock(peer, blockDigest);
+            return true;
+        }
 
-        // Use a range-based loop to calculate the fee for each transaction and add it to the total
-        for (const auto& transaction : m_transactions) {
-            totalFee += calculateTransactionFee(transaction);
+        for (size_t i = 0; i < count; ++i) {
+            if (!partial.transactions[i]) {
+                partial.missing.push_back(i);
+            }
+        }
+        if (partial.missing.empty()) {
+            finishBlock(peer, partial);
+            return true;
         }
 
-        // Return the total fee collected from all transactions in the block
-        return totalFee;
+        m_blockTransactionRequests.fetch_add(1);
+        std::string payload;
+        appendDigest(payload, blockDigest);
+        appendVarint(payload, partial.missing.size());
+        for (size_t index : partial.missing) {
+            appendVarint(payload, index);
+        }
+        partial.requestedAt = std::chrono::steady_clock::now();
+        expirePendingBlocks(peer, partial.requestedAt);
+        peer.pending[partial.hash] = std::move(partial);
+        send(peer, MessageType::GetBlockTransactions, payload);
+        return true;
     }
-};
 
-class Blockchain {
-public:
-    Blockchain() : m_difficulty(4), m_minerWallet(Wallet("Miner Wallet", 1000000.0)) {
-        // Create the genesis block with an arbitrary previous hash
-        std::vector<Transaction> transactions;
-        transactions.emplace_back(Transaction(Wallet("Alice", 1000000.0), Wallet("Bob", 0.0), 50.0));
-        m_chain.emplace_back(Block(transactions, "0"));
-        m_blocksByHash[m_chain.back().getHash()] = &m_chain.back();
+    // Drop compact blocks whose missing transactions never came, and the oldest one if the peer is
+    // at maxPendingBlocks, to make room for another. A dropped block arrives again from another
+    // peer or through a sync.
+    void expirePendingBlocks(Peer& peer, std::chrono::steady_clock::time_point now) {
+        auto timeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(transactionRequestSeconds));
+        for (auto it = peer.pending.begin(); it != peer.pending.end();) {
+            it = now - it->second.requestedAt >= timeout ? peer.pending.erase(it) : std::next(it);
+        }
+        if (peer.pending.size() >= maxPendingBlocks) {
+            peer.pending.erase(std::min_element(peer.pending.begin(), peer.pending.end(), [](const auto& a, const auto& b) {
+                return a.second.requestedAt < b.second.requestedAt;
+            }));
+        }
     }
 
-    void addBlock(Block block) {
-        std::unique_lock<std::mutex> lock(m_mutex);
-
-        // Mine the new block
-        block.mineBlock(m_difficulty, m_minerWallet);
-
-        // Check if a block with the same hash already exists
-        auto it = m_blocksByHash.find(block.getHash());
-        if (it != m_blocksByHash.end()) {
-            // A block with the same hash already exists, which means a fork has occurred
-            Block* existingBlock = it->second;
-            if (block.getIndex() <= existingBlock->getIndex()) {
-                // The existing block is already in the main chain or the new block is invalid
-                return;
+    bool handleGetBlockTransactions(Peer& peer, ByteReader& reader) {
+        Hash256 blockDigest = readDigest(reader);
+        uint64_t count = reader.readVarint();
+        std::optional<Block> block = m_chain.findBlock(toHex(blockDigest));
+        std::string payload;
+        appendDigest(payload, blockDigest);
+        appendVarint(payload, count);
+        for (uint64_t i = 0; i < count && !reader.failed; ++i) {
+            uint64_t index = reader.readVarint();
+            if (!block || index >= block->getTransactions().size()) {
+                return !reader.failed;
             }
-            // The new block is part of a longer chain, so we need to switch to that chain
-            switchToFork(block);
-            return;
+            appendString(payload, TransactionView::encode(block->getTransactions()[index]));
+        }
+        if (!reader.failed) {
+            send(peer, MessageType::BlockTransactions, payload);
         }
+        return !reader.failed;
+    }
 
-        // Add the block to the chain
-        m_chain.push_back(block);
-        m_blocksByHash[block.getHash()] = &m_chain.back();
+    bool handleBlockTransactions(Peer& peer, ByteReader& reader) {
+        Hash256 blockDigest = readDigest(reader);
+        uint64_t count = reader.readVarint();
+        auto it = peer.pending.find(toHex(blockDigest));
+        if (reader.failed || it == peer.pending.end()) {
+            return !reader.failed;
+        }
+        PartialBlock partial = std::move(it->second);
+        peer.pending.erase(it);
+        if (count != partial.missing.size()) {
+            return false;
+        }
+        for (size_t index : partial.missing) {
+            std::optional<Transaction> transaction = decodeTransaction(reader.readString());
+            if (!transaction) {
+                return false;
+            }
+            partial.transactions[index] = std::move(transaction);
+        }
+        finishBlock(peer, partial);
+        return true;
     }
 
-    bool isValid() const {
-        std::unique_lock<std::mutex> lock(m_mutex);
+    bool handleGetBlock(Peer& peer, ByteReader& reader) {
+        Hash256 blockDigest = readDigest(reader);
+        if (reader.failed) {
+            return false;
+        }
+        std::optional<Block> block = m_chain.findBlock(toHex(blockDigest));
+        if (block) {
+            std::string payload;
+            appendString(payload, BlockView::encode(*block));
+            send(peer, MessageType::FullBlock, payload);
+        }
+        return true;
+    }
 
-        for (size_t i = 1; i < m_chain.size(); ++i) {
-            Block currentBlock = m_chain[i];
-            Block previousBlock = m_chain[i-1];
+    bool handleFullBlock(Peer& peer, ByteReader& reader) {
+        std::string_view record = reader.readString();
+        BlockView view(reinterpret_cast<const unsigned char*>(record.data()), record.size());
+        if (reader.failed || !view.isWellFormed()) {
+            return false;
+        }
+        Block block = view.toBlock();
+        if (!acceptSyncBlock(block)) {
+            acceptRelayedBlock(peer, block);
+        }
+        return true;
+    }
 
-            // Check if the current block's hash is valid
-            if (currentBlock.getHash() != currentBlock.calculateHash()) {
-                std::cerr << "Block " << i << " hash is invalid" << std::endl;
+    // Hand a block the running sync asked for over to it, checked against its header. Returns
+    // false if no sync wanted it. The check runs without the sync lock, so bodies arriving from
+    // different peers are checked in parallel.
+    bool acceptSyncBlock(Block& block) {
+        SyncState* state;
+        size_t index;
+        {
+            std::lock_guard<std::mutex> lock(m_syncMutex);
+            state = m_sync.get();
+            if (!state) {
                 return false;
             }
-
-            // Check if the previous hash of the current block matches the hash of the previous block
-            if (currentBlock.getLastBlockHash() != previousBlock.getHash()) {
-                std::cerr << "Block " << i << " previous hash is invalid" << std::endl;
+            auto it = state->indexByHash.find(block.getHash());
+            if (it == state->indexByHash.end()) {
                 return false;
             }
+            index = it->second;
+            if (index < state->nextIndex || state->ready.count(index)) {
+                return true;
+            }
+        }
+        // The hash was found among the checked headers, so a body whose own header hashes to it is
+        // the right one. If it's bad the request times out and goes to another peer.
+        if (!m_chain.checkBlock(block)) {
+            return true;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_syncMutex);
+            if (m_sync.get() == state && index >= state->nextIndex) {
+                state->ready.emplace(index, std::move(block));
+            }
         }
+        m_syncChanged.notify_all();
+        return true;
+    }
 
-        // The chain is valid if all checks pass
+    bool handleGetHeaders(Peer& peer, ByteReader& reader) {
+        std::string hash(reader.readString());
+        uint64_t count = std::min<uint64_t>(reader.readVarint(), maxHeadersPerMessage);
+        if (reader.failed) {
+            return false;
+        }
+        std::vector<BlockHeader> headers = m_chain.getHeaders(hash, count);
+        std::string payload;
+        payload.reserve(10 + headers.size() * BlockHeader::serializedSize);
+        appendVarint(payload, headers.size());
+        for (const BlockHeader& header : headers) {
+            auto bytes = header.serialize();
+            payload.append(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        }
+        send(peer, MessageType::Headers, payload);
         return true;
     }
 
-    void printChain() const {
-        for (const auto& block : m_chain) {
-            std::cout << "Block " << &block - &m_chain[0] << std::endl;
-            std::cout << "Hash: " << block.getHash() << std::endl;
-            std::cout << "Previous hash: " << block.getPreviousHash() << std::endl;
-            std::cout << "Reward: " << block.getReward() << std::endl;
-            std::cout << "Transactions:" << std::endl;
-            for (const auto& transaction : block.getTransactions()) {
-                std::cout << "  Sender: " << transaction.getSender() << std::endl;
-                std::cout << "  Recipient: " << transaction.getRecipient() << std::endl;
-                std::cout << "  Amount: " << transaction.getAmount() << std::endl;
-                std::cout << "  Sender sent: ";
-                for (const auto& sent : transaction.getSenderSent()) {
-                    std::cout << sent << " ";
-                }
-                std::cout << std::endl;
+    bool handleHeaders(Peer& peer, ByteReader& reader) {
+        uint64_t count = reader.readVarint();
+        if (count > maxHeadersPerMessage) {
+            return false;
+        }
+        std::vector<BlockHeader> headers;
+        headers.reserve(count);
+        for (uint64_t i = 0; i < count; ++i) {
+            std::string_view bytes = reader.readBytes(BlockHeader::serializedSize);
+            if (reader.failed) {
+                return false;
             }
-            std::cout << std::endl;
+            headers.push_back(BlockHeader::deserialize(reinterpret_cast<const unsigned char*>(bytes.data())));
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_syncMutex);
+            if (!m_sync || m_sync->headerPeer != &peer || !m_sync->headersPending) {
+                return true;
+            }
+            m_sync->headersValid = m_chain.extendHeaderChain(m_sync->headers, headers) == headers.size();
+            m_sync->lastHeaderBatch = headers.size();
+            m_sync->headersPending = false;
         }
+        m_syncChanged.notify_all();
+        return true;
     }
 
-private:
-    int m_difficulty;
-    Wallet m_minerWallet;
-    std::vector<Block> m_chain;
-    std::unordered_map<std::string, Block*> m_blocksByHash;
-    mutable std::mutex m_mutex;
+    void requestFullBlock(Peer& peer, const Hash256& blockDigest) {
+        m_fullBlockRequests.fetch_add(1);
+        std::string payload;
+        appendDigest(payload, blockDigest);
+        send(peer, MessageType::GetBlock, payload);
+    }
 
-    void switchToFork(Block& newBlock) {
-        // Find the common ancestor block of the main chain and the new chain
-        Block* currentBlock = &m_chain.back();
-        while (currentBlock->getIndex() > newBlock.getIndex()) {
-            currentBlock = &m_chain[currentBlock->getIndex() - 1];
+    // Assemble a compact block once every transaction is known. If the result doesn't hash to the
+    // announced hash, a short id matched the wrong transaction, so fall back to the full block.
+    void finishBlock(Peer& peer, PartialBlock& partial) {
+        std::vector<Transaction> transactions;
+        transactions.reserve(partial.transactions.size());
+        for (auto& transaction : partial.transactions) {
+            transactions.push_back(std::move(*transaction));
         }
+        Block block(std::move(transactions), partial.previousHash, partial.timestamp, partial.nonce, partial.reward, partial.hash);
+        if (block.calculateHash() != partial.hash) {
+            requestFullBlock(peer, hashFromHex(partial.hash));
+            return;
+        }
+        m_blocksReconstructed.fetch_add(1);
+        acceptRelayedBlock(peer, block);
+    }
 
-        // Roll back the main chain to the common ancestor block
-        while (m_chain.back().getIndex() > currentBlock->getIndex()) {
-            m_blocksByHash.erase(m_chain.back().getHash());
-            m_chain.pop_back();
+    void acceptRelayedBlock(Peer& peer, const Block& block) {
+        if (m_chain.submitBlock(block)) {
+            forgetRequests(block);
+            relayBlock(block, &peer);
         }
+    }
 
-        // Add the blocks of the new chain to the main chain
-        while (currentBlock->getIndex() < newBlock.getIndex()) {
-            m_chain.push_back(*currentBlock);
-            m_blocksByHash[currentBlock->getHash()] = currentBlock;
-            currentBlock = currentBlock->getNextBlock();
+    // A confirmed transaction won't be answered from a mempool, so stop waiting for it
+    void forgetRequests(const Block& block) {
+        std::lock_guard<std::mutex> lock(m_requestedMutex);
+        if (m_requested.empty()) {
+            return;
+        }
+        for (const Transaction& transaction : block.getTransactions()) {
+            m_requested.erase(transaction.calculateHash());
         }
-        m_chain.push_back(newBlock);
-        m_blocksByHash[newBlock.getHash()] = &m_chain.back();
     }
 };
 